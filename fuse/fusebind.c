@@ -10,12 +10,14 @@
   gcc -Wall fusexmp_fh.c `pkg-config fuse --cflags --libs` -lulockmgr -o fusexmp_fh
 */
 
-#define FUSE_USE_VERSION 26
-
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
 #define _GNU_SOURCE
 
 #include <fuse_merge.h>
@@ -24,16 +26,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <errno.h>
 #include <sys/time.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 #include <sys/file.h> /* flock(2) */
+#include <pthread.h>
+
+#if defined(FUSE_CAP_PASSTHROUGH) && defined(__linux__)
+#include <fuse_lowlevel.h>
+#include <sys/ioctl.h>
+#include <linux/fuse.h>
+#ifdef FUSE_DEV_IOC_BACKING_OPEN
+//libfuse >= 3.16 and kernel >= 6.9 headers
+#define BIND_PASSTHROUGH 1
+#endif
+#endif
 
 #ifdef __ANDROID__
 #include <dirent2.h>
@@ -41,18 +56,364 @@
 #include <dirent.h>
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(SYS_getdents64) && defined(STATX_BASIC_STATS)
+//bulk listing: getdents64 batches, attributes by statx
+#define BIND_GETDENTS 1
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#define BIND_URING 1
+#endif
+#endif
+
+#include "fusenfs.h"
+#include "uringengine.h"
+
 #ifndef DTTOIF
 /*安卓8.1系统dirent.h 不带这个宏定义*/
 #define DTTOIF(dirtype) ((dirtype) << 12)
 #endif
 
+#define BIND_DEFAULT_URING_DEPTH 256
+//fds below this are registered with the ring
+#define BIND_URING_FILES 4096
+
+struct bind_opts
+{
+	int passthrough;
+	int uring;
+	unsigned int uring_depth;
+	unsigned int dirfds;
+};
+
+static struct bind_opts bind_opts = {
+	.uring_depth = BIND_DEFAULT_URING_DEPTH,
+};
+
+static const struct fuse_opt bind_opt_spec[] = {
+	{"passthrough", offsetof(struct bind_opts, passthrough), 1},
+	{"uring", offsetof(struct bind_opts, uring), 1},
+	{"uring_depth=%u", offsetof(struct bind_opts, uring_depth), 0},
+	{"dirfds=%u", offsetof(struct bind_opts, dirfds), 0},
+	FUSE_OPT_END};
+
+//NULL unless -o uring and the ring could be set up
+static struct uring_engine *uring;
+
+/* With -o dirfds=N the subdir module is not used: paths are resolved below
+ * rootfd, from an O_PATH fd of their parent directory. Those fds are kept
+ * in a table of N slots, so a lookup in a deep tree walks one component
+ * instead of every component from /.
+ */
+struct dirfd_ent
+{
+	char *path;
+	size_t len;
+	int fd;
+	int refs;
+	int cached;
+};
+
+//where the *at() calls of one path go: dfd is AT_FDCWD without dirfds
+struct xmp_at
+{
+	int dfd;
+	const char *name;
+	struct dirfd_ent *dent;
+};
+
+static int rootfd = -1;
+static struct dirfd_ent **dirfds;
+static pthread_mutex_t dirfds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int dirfd_slot(const char *path, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)path[i]) * 16777619u;
+	return h % bind_opts.dirfds;
+}
+
+static void dirfd_free(struct dirfd_ent *de)
+{
+	close(de->fd);
+	free(de->path);
+	free(de);
+}
+
+static void dirfd_put(struct dirfd_ent *de)
+{
+	int last;
+
+	pthread_mutex_lock(&dirfds_lock);
+	last = !--de->refs && !de->cached;
+	pthread_mutex_unlock(&dirfds_lock);
+	if (last)
+		dirfd_free(de);
+}
+
+/* O_PATH fd of the directory path[0, len), opened from its parent's fd */
+static struct dirfd_ent *dirfd_get(const char *path, size_t len, int *err)
+{
+	unsigned int slot = dirfd_slot(path, len);
+	struct dirfd_ent *de, *parent = NULL, *old;
+	const char *slash;
+	char name[NAME_MAX + 1];
+	int fd;
+
+	pthread_mutex_lock(&dirfds_lock);
+	de = dirfds[slot];
+	if (de && de->len == len && !memcmp(de->path, path, len))
+	{
+		de->refs++;
+		pthread_mutex_unlock(&dirfds_lock);
+		return de;
+	}
+	pthread_mutex_unlock(&dirfds_lock);
+
+	slash = memrchr(path, '/', len);
+	if (len - (slash - path) - 1 > NAME_MAX)
+	{
+		*err = -ENAMETOOLONG;
+		return NULL;
+	}
+	memcpy(name, slash + 1, len - (slash - path) - 1);
+	name[len - (slash - path) - 1] = 0;
+	if (slash != path && !(parent = dirfd_get(path, slash - path, err)))
+		return NULL;
+
+	//FUSE resolves symlinks itself, a component is never one
+	fd = openat(parent ? parent->fd : rootfd, name,
+				O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (parent)
+		dirfd_put(parent);
+	if (fd == -1)
+	{
+		*err = -errno;
+		return NULL;
+	}
+
+	de = calloc(1, sizeof(struct dirfd_ent));
+	if (!de || !(de->path = strndup(path, len)))
+	{
+		free(de);
+		close(fd);
+		*err = -ENOMEM;
+		return NULL;
+	}
+	de->len = len;
+	de->fd = fd;
+	de->refs = 1;
+	de->cached = 1;
+
+	pthread_mutex_lock(&dirfds_lock);
+	old = dirfds[slot];
+	dirfds[slot] = de;
+	if (old)
+		old->cached = 0;
+	if (old && old->refs)
+		old = NULL;
+	pthread_mutex_unlock(&dirfds_lock);
+	if (old)
+		dirfd_free(old);
+	return de;
+}
+
+/* a renamed or removed directory takes the fds below it along */
+static void dirfd_invalidate(const char *path)
+{
+	size_t len = strlen(path);
+	struct dirfd_ent *de;
+	unsigned int i;
+
+	if (rootfd < 0)
+		return;
+	pthread_mutex_lock(&dirfds_lock);
+	for (i = 0; i < bind_opts.dirfds; i++)
+	{
+		de = dirfds[i];
+		if (!de || de->len < len || memcmp(de->path, path, len) ||
+			(de->len > len && de->path[len] != '/'))
+			continue;
+		dirfds[i] = NULL;
+		de->cached = 0;
+		if (!de->refs)
+			dirfd_free(de);
+	}
+	pthread_mutex_unlock(&dirfds_lock);
+}
+
+static int xmp_at(const char *path, struct xmp_at *at)
+{
+	const char *slash;
+	int err = 0;
+
+	at->dent = NULL;
+	if (rootfd < 0)
+	{
+		at->dfd = AT_FDCWD;
+		at->name = path;
+		return 0;
+	}
+
+	slash = strrchr(path, '/');
+	at->name = slash[1] ? slash + 1 : ".";
+	if (slash == path)
+	{
+		at->dfd = rootfd;
+		return 0;
+	}
+	if (!(at->dent = dirfd_get(path, slash - path, &err)))
+		return err;
+	at->dfd = at->dent->fd;
+	return 0;
+}
+
+static void xmp_at_put(struct xmp_at *at)
+{
+	if (at->dent)
+		dirfd_put(at->dent);
+}
+
+#ifdef BIND_PASSTHROUGH
+/* Backing ids registered for passthrough, indexed by fd. The kernel keeps
+ * its own reference to the backing file once the open reply is sent, the
+ * id only has to be released again with the fd.
+ */
+static pthread_mutex_t backing_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *backing;
+static int nbacking;
+//set by init when the kernel takes passthrough, dropped once it refuses
+static int backing_on;
+
+/* libfuse's fuse_passthrough_open/close take the fuse_req_t of a low level
+ * handler, which the high level operations never see: these do the same
+ * on the session the request came in through
+ */
+static int backing_open(int fd)
+{
+	struct fuse_backing_map map = {.fd = fd};
+	struct fuse_session *se = fuse_get_session(fuse_get_context()->fuse);
+	int id = ioctl(fuse_session_fd(se), FUSE_DEV_IOC_BACKING_OPEN, &map);
+	return id > 0 ? id : -errno;
+}
+
+static void backing_close(int id)
+{
+	struct fuse_session *se = fuse_get_session(fuse_get_context()->fuse);
+	ioctl(fuse_session_fd(se), FUSE_DEV_IOC_BACKING_CLOSE, &id);
+}
+
+/* register fd with the kernel, the reads and writes of fi bypass us */
+static void xmp_passthrough_open(int fd, struct fuse_file_info *fi)
+{
+	int id;
+
+	if (!__atomic_load_n(&backing_on, __ATOMIC_ACQUIRE))
+		return;
+	id = backing_open(fd);
+	if (id < 0)
+	{
+		//EPERM without CAP_SYS_ADMIN, don't retry on every open
+		LOG("passthrough disabled, backing open failed: %d\n", -id);
+		__atomic_store_n(&backing_on, 0, __ATOMIC_RELEASE);
+		return;
+	}
+
+	pthread_mutex_lock(&backing_lock);
+	if (fd >= nbacking)
+	{
+		int n = fd + 64;
+		int *b = realloc(backing, n * sizeof(int));
+		if (!b)
+		{
+			pthread_mutex_unlock(&backing_lock);
+			backing_close(id);
+			return;
+		}
+		memset(b + nbacking, 0, (n - nbacking) * sizeof(int));
+		backing = b;
+		nbacking = n;
+	}
+	backing[fd] = id;
+	pthread_mutex_unlock(&backing_lock);
+
+	fi->backing_id = id;
+}
+
+static void xmp_passthrough_release(int fd)
+{
+	int id = 0;
+
+	pthread_mutex_lock(&backing_lock);
+	if (fd < nbacking)
+	{
+		id = backing[fd];
+		backing[fd] = 0;
+	}
+	pthread_mutex_unlock(&backing_lock);
+
+	if (id > 0)
+		backing_close(id);
+}
+#else
+static inline void xmp_passthrough_open(int fd, struct fuse_file_info *fi) {}
+static inline void xmp_passthrough_release(int fd) {}
+#endif
+
+#ifdef BIND_GETDENTS
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
-	int res = lstat(path, stbuf);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+#ifdef BIND_URING
+	if (uring)
+	{
+		struct statx stx;
+		struct uring_req req = {.op = URING_OP_STATX, .dirfd = at.dfd, .path = at.name,
+								.flags = AT_SYMLINK_NOFOLLOW, .stx = &stx};
+		res = uring_engine_call(uring, &req);
+		xmp_at_put(&at);
+		if (res < 0)
+			return res;
+		statx_to_stat(&stx, stbuf);
+		return 0;
+	}
+#endif
+	res = fstatat(at.dfd, at.name, stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_fgetattr(const char *path, struct stat *stbuf,
@@ -66,33 +427,259 @@ static int xmp_fgetattr(const char *path, struct stat *stbuf,
 
 static int xmp_access(const char *path, int mask)
 {
-	int res = access(path, mask);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = faccessat(at.dfd, at.name, mask, 0);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	xmp_at_put(&at);
+	return res;
 }
 
 static int xmp_readlink(const char *path, char *buf, size_t size)
 {
-	int res = readlink(path, buf, size - 1);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = readlinkat(at.dfd, at.name, buf, size - 1);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
+	if (res < 0)
+		return res;
 	buf[res] = 0;
 	return 0;
 }
 
-// struct xmp_dirp
-// {
-// 	DIR *dp;
-// 	struct dirent *entry;
-// 	off_t offset;
-// };
+#ifdef BIND_GETDENTS
+#define DIRBUF_SIZE (64 * 1024)
+#define STATX_BATCH 256
+
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct xmp_dirp
+{
+	int fd;
+	off_t offset;
+	int pos;
+	int len;
+	char buf[DIRBUF_SIZE];
+};
+
+static int xmp_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct xmp_dirp *d = malloc(sizeof(struct xmp_dirp));
+	struct xmp_at at;
+	int res;
+
+	if (!d)
+		return -ENOMEM;
+	if ((res = xmp_at(path, &at)))
+	{
+		free(d);
+		return res;
+	}
+	d->fd = openat(at.dfd, at.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	res = -errno;
+	xmp_at_put(&at);
+	if (d->fd == -1)
+	{
+		free(d);
+		return res;
+	}
+	d->offset = 0;
+	d->pos = d->len = 0;
+	fi->fh = (uint64_t)d;
+	return 0;
+}
+
+static inline struct xmp_dirp *get_dirp(struct fuse_file_info *fi)
+{
+	return (void *)fi->fh;
+}
+
+#ifdef HAVE_LIBURING
+static struct io_uring ring;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+//0 not tried, 1 usable, -1 unavailable
+static int ring_state;
+
+/* statx of all n entries in one submission, 0 when the ring is unusable */
+static int xmp_statx_ring(int dirfd, struct linux_dirent64 **ents,
+						  struct statx *stx, int *ok, int n)
+{
+	struct io_uring_cqe *cqe;
+	int i;
+
+	pthread_mutex_lock(&ring_lock);
+	if (!ring_state)
+		ring_state = io_uring_queue_init(STATX_BATCH, &ring, 0) ? -1 : 1;
+	if (ring_state < 0)
+	{
+		pthread_mutex_unlock(&ring_lock);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_statx(sqe, dirfd, ents[i]->d_name, AT_SYMLINK_NOFOLLOW,
+							STATX_BASIC_STATS, &stx[i]);
+		io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+	}
+	if (io_uring_submit_and_wait(&ring, n) < 0)
+	{
+		ring_state = -1;
+		io_uring_queue_exit(&ring);
+		pthread_mutex_unlock(&ring_lock);
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+	{
+		if (io_uring_wait_cqe(&ring, &cqe))
+			break;
+		//kernels before 5.6 have no IORING_OP_STATX
+		if (cqe->res == -EINVAL)
+			ring_state = -1;
+		ok[(uintptr_t)io_uring_cqe_get_data(cqe)] = cqe->res == 0;
+		io_uring_cqe_seen(&ring, cqe);
+	}
+	if (ring_state < 0)
+		io_uring_queue_exit(&ring);
+	pthread_mutex_unlock(&ring_lock);
+	return ring_state > 0;
+}
+#endif
+
+static void xmp_statx_batch(int dirfd, struct linux_dirent64 **ents,
+							struct statx *stx, int *ok, int n)
+{
+	int i;
+
+	memset(ok, 0, n * sizeof(int));
+#ifdef HAVE_LIBURING
+	if (xmp_statx_ring(dirfd, ents, stx, ok, n))
+		return;
+#endif
+	for (i = 0; i < n; i++)
+		ok[i] = !statx(dirfd, ents[i]->d_name, AT_SYMLINK_NOFOLLOW,
+					   STATX_BASIC_STATS, &stx[i]);
+}
+
+/* Pass the entries of d->buf from d->pos on to the filler. When the stat
+ * cache is on, their attributes are fetched in batches first so the
+ * lookups that follow the listing are answered from the cache.
+ */
+static int xmp_readdir_fill(struct xmp_dirp *d, void *buf, fs_fill_dir_t filler)
+{
+	struct linux_dirent64 *ents[STATX_BATCH];
+	struct statx stx[STATX_BATCH];
+	int ok[STATX_BATCH];
+	int plus = cache_stat_enabled();
+	struct stat st;
+	int i, n, res;
+
+	while (d->pos < d->len)
+	{
+		for (n = 0; n < STATX_BATCH && d->pos < d->len; n++)
+		{
+			ents[n] = (struct linux_dirent64 *)(d->buf + d->pos);
+			d->pos += ents[n]->d_reclen;
+		}
+		if (plus)
+			xmp_statx_batch(d->fd, ents, stx, ok, n);
+
+		for (i = 0; i < n; i++)
+		{
+			if (plus && ok[i])
+			{
+				statx_to_stat(&stx[i], &st);
+				res = fill_dir_attr(filler, buf, ents[i]->d_name, &st, ents[i]->d_off);
+			}
+			else
+			{
+				memset(&st, 0, sizeof(st));
+				st.st_ino = ents[i]->d_ino;
+				st.st_mode = DTTOIF(ents[i]->d_type);
+				res = filler(buf, ents[i]->d_name, &st, ents[i]->d_off);
+			}
+			if (res)
+			{
+				//resume at the entry the filler refused
+				d->pos = (char *)ents[i] - d->buf;
+				return 1;
+			}
+			d->offset = ents[i]->d_off;
+		}
+	}
+	return 0;
+}
+
+static int xmp_readdir(const char *path, void *buf, fs_fill_dir_t filler,
+					   off_t offset, struct fuse_file_info *fi)
+{
+	struct xmp_dirp *d = get_dirp(fi);
+
+	if (offset != d->offset)
+	{
+		if (lseek(d->fd, offset, SEEK_SET) == -1)
+			return -errno;
+		d->offset = offset;
+		d->pos = d->len = 0;
+	}
+
+	for (;;)
+	{
+		if (xmp_readdir_fill(d, buf, filler))
+			break;
+		int res = syscall(SYS_getdents64, d->fd, d->buf, DIRBUF_SIZE);
+		if (res == -1)
+			return -errno;
+		if (res == 0)
+			break;
+		d->pos = 0;
+		d->len = res;
+	}
+
+	return 0;
+}
 
+static int xmp_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct xmp_dirp *d = get_dirp(fi);
+	close(d->fd);
+	free(d);
+	return 0;
+}
+#else
 static int xmp_opendir(const char *path, struct fuse_file_info *fi)
 {
-	DIR *dirp = opendir(path);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	int fd = openat(at.dfd, at.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	res = -errno;
+	xmp_at_put(&at);
+	if (fd == -1)
+		return res;
+	DIR *dirp = fdopendir(fd);
 	if (!dirp)
-		return -errno;
+	{
+		res = -errno;
+		close(fd);
+		return res;
+	}
 	fi->fh = (uint64_t)dirp;
 	return 0;
 }
@@ -102,7 +689,7 @@ static inline DIR *get_dirp(struct fuse_file_info *fi)
 	return (void *)fi->fh;
 }
 
-static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+static int xmp_readdir(const char *path, void *buf, fs_fill_dir_t filler,
 					   off_t offset, struct fuse_file_info *fi)
 {
 	DIR *dirp = get_dirp(fi);
@@ -135,100 +722,178 @@ static int xmp_releasedir(const char *path, struct fuse_file_info *fi)
 	closedir(get_dirp(fi));
 	return 0;
 }
+#endif
 
 static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-	int res;
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
 
 	if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
+		res = mkfifoat(at.dfd, at.name, mode);
 	else
-		res = mknod(path, mode, rdev);
+		res = mknodat(at.dfd, at.name, mode, rdev);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_mkdir(const char *path, mode_t mode)
 {
-	int res = mkdir(path, mode);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = mkdirat(at.dfd, at.name, mode);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_unlink(const char *path)
 {
-	int res = unlink(path);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = unlinkat(at.dfd, at.name, 0);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_rmdir(const char *path)
 {
-	int res = rmdir(path);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = unlinkat(at.dfd, at.name, AT_REMOVEDIR);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
+	if (!res)
+		dirfd_invalidate(path);
 
-	return 0;
+	return res;
 }
 
 static int xmp_symlink(const char *from, const char *to)
 {
-	int res = symlink(from, to);
+	struct xmp_at at;
+	int res = xmp_at(to, &at);
+	if (res)
+		return res;
+	res = symlinkat(from, at.dfd, at.name);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_rename(const char *from, const char *to)
 {
-	int res = rename(from, to);
+	struct xmp_at at, at2;
+	int res = xmp_at(from, &at);
+	if (res)
+		return res;
+	if ((res = xmp_at(to, &at2)))
+	{
+		xmp_at_put(&at);
+		return res;
+	}
+	res = renameat(at.dfd, at.name, at2.dfd, at2.name);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at2);
+	xmp_at_put(&at);
+	if (!res)
+	{
+		dirfd_invalidate(from);
+		dirfd_invalidate(to);
+	}
 
-	return 0;
+	return res;
 }
 
 static int xmp_link(const char *from, const char *to)
 {
-	int res = link(from, to);
+	struct xmp_at at, at2;
+	int res = xmp_at(from, &at);
+	if (res)
+		return res;
+	if ((res = xmp_at(to, &at2)))
+	{
+		xmp_at_put(&at);
+		return res;
+	}
+	res = linkat(at.dfd, at.name, at2.dfd, at2.name, 0);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at2);
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_chmod(const char *path, mode_t mode)
 {
-	int res = chmod(path, mode);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = fchmodat(at.dfd, at.name, mode, 0);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 {
-	int res = lchown(path, uid, gid);
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = fchownat(at.dfd, at.name, uid, gid, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_truncate(const char *path, off_t size)
 {
-	int res = truncate(path, size);
+	struct xmp_at at;
+	int fd, res = xmp_at(path, &at);
+	if (res)
+		return res;
+	if (at.dfd == AT_FDCWD)
+		res = truncate(path, size);
+	else if ((fd = openat(at.dfd, at.name, O_WRONLY | O_CLOEXEC)) == -1)
+		res = -1;
+	else
+	{
+		//no truncateat()
+		res = ftruncate(fd, size);
+		close(fd);
+	}
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 
 static int xmp_ftruncate(const char *path, off_t size,
@@ -244,41 +909,84 @@ static int xmp_ftruncate(const char *path, off_t size,
 #ifdef HAVE_UTIMENSAT
 static int xmp_utimens(const char *path, const struct timespec ts[2])
 {
-	int res;
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
 
 	/* don't use utime/utimes since they follow symlinks */
-	res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
+	res = utimensat(at.dfd, at.name, ts, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 
-	return 0;
+	return res;
 }
 #endif
 
+/* open(2), through the ring when there is one */
+static int xmp_openat(const char *path, int flags, mode_t mode)
+{
+	struct xmp_at at;
+	int fd = xmp_at(path, &at);
+	if (fd)
+		return fd;
+
+	if (uring)
+	{
+		struct uring_req req = {.op = URING_OP_OPENAT, .dirfd = at.dfd, .path = at.name,
+								.flags = flags, .mode = mode};
+		fd = uring_engine_call(uring, &req);
+		if (fd >= 0)
+			uring_engine_register_fd(uring, fd);
+	}
+	else if ((fd = openat(at.dfd, at.name, flags, mode)) == -1)
+		fd = -errno;
+	xmp_at_put(&at);
+	return fd;
+}
+
+/* pread/pwrite/fsync of fd on the ring, -ENOSYS without one */
+static int xmp_uring_io(enum uring_op op, int fd, void *buf, size_t size, off_t offset)
+{
+	if (!uring)
+		return -ENOSYS;
+
+	struct uring_req req = {.op = op, .fd = fd, .buf = buf,
+							.count = size, .offset = offset};
+	return uring_engine_call(uring, &req);
+}
+
 static int xmp_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	int fd = open(path, fi->flags, mode);
-	if (fd == -1)
-		return -errno;
+	int fd = xmp_openat(path, fi->flags, mode);
+	if (fd < 0)
+		return fd;
 
 	fi->fh = fd;
+	xmp_passthrough_open(fd, fi);
 	return 0;
 }
 
 static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
-	int fd = open(path, fi->flags);
-	if (fd == -1)
-		return -errno;
+	int fd = xmp_openat(path, fi->flags, 0);
+	if (fd < 0)
+		return fd;
 
 	fi->fh = fd;
+	xmp_passthrough_open(fd, fi);
 	return 0;
 }
 
 static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
 					struct fuse_file_info *fi)
 {
-	int res = pread(fi->fh, buf, size, offset);
+	int res = xmp_uring_io(URING_OP_READ, fi->fh, buf, size, offset);
+	if (res != -ENOSYS)
+		return res;
+
+	res = pread(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
@@ -306,7 +1014,11 @@ static int xmp_read_buf(const char *path, struct fuse_bufvec **bufp,
 static int xmp_write(const char *path, const char *buf, size_t size,
 					 off_t offset, struct fuse_file_info *fi)
 {
-	int res = pwrite(fi->fh, buf, size, offset);
+	int res = xmp_uring_io(URING_OP_WRITE, fi->fh, (void *)buf, size, offset);
+	if (res != -ENOSYS)
+		return res;
+
+	res = pwrite(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
@@ -318,6 +1030,11 @@ static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
 {
 	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
 
+	//data already in memory goes out on the ring, spliced pipes do not
+	if (uring && buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		return xmp_uring_io(URING_OP_WRITE, fi->fh, buf->buf[0].mem,
+							buf->buf[0].size, offset);
+
 	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
 	dst.buf[0].fd = fi->fh;
 	dst.buf[0].pos = offset;
@@ -327,7 +1044,7 @@ static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
 
 static int xmp_statfs(const char *path, struct statvfs *stbuf)
 {
-	int res = statvfs(path, stbuf);
+	int res = rootfd < 0 ? statvfs(path, stbuf) : fstatvfs(rootfd, stbuf);
 	if (res == -1)
 		return -errno;
 
@@ -351,6 +1068,9 @@ static int xmp_flush(const char *path, struct fuse_file_info *fi)
 
 static int xmp_release(const char *path, struct fuse_file_info *fi)
 {
+	xmp_passthrough_release(fi->fh);
+	if (uring)
+		uring_engine_unregister_fd(uring, fi->fh);
 	close(fi->fh);
 	return 0;
 }
@@ -360,6 +1080,11 @@ static int xmp_fsync(const char *path, int isdatasync,
 {
 	int res;
 
+	res = xmp_uring_io(isdatasync ? URING_OP_FDATASYNC : URING_OP_FSYNC,
+					   fi->fh, NULL, 0, 0);
+	if (res != -ENOSYS)
+		return res;
+
 #ifndef HAVE_FDATASYNC
 	(void)isdatasync;
 #else
@@ -374,53 +1099,127 @@ static int xmp_fsync(const char *path, int isdatasync,
 	return 0;
 }
 
-#ifdef HAVE_POSIX_FALLOCATE
+#if defined(HAVE_FALLOCATE) || defined(HAVE_POSIX_FALLOCATE)
+/* every mode of fallocate(2): allocate, keep size, punch hole, zero range */
 static int xmp_fallocate(const char *path, int mode,
 						 off_t offset, off_t length, struct fuse_file_info *fi)
 {
 	(void)path;
 
+#ifdef HAVE_FALLOCATE
+	if (fallocate(fi->fh, mode, offset, length) == -1)
+		return -errno;
+
+	return 0;
+#else
 	if (mode)
 		return -EOPNOTSUPP;
 
 	return -posix_fallocate(fi->fh, offset, length);
+#endif
+}
+#endif
+
+#if defined(SEEK_DATA) && defined(HAVE_STRUCT_FUSE_OPERATIONS_LSEEK)
+static off_t xmp_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+	off_t res;
+	(void)path;
+
+	res = lseek(fi->fh, off, whence);
+	if (res == -1)
+		return -errno;
+
+	return res;
+}
+#endif
+
+#if defined(HAVE_COPY_FILE_RANGE) && defined(HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE)
+/* the kernel copies in place: a reflink on XFS/btrfs, server side copy on NFS */
+static ssize_t xmp_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+								   off_t offset_in, const char *path_out,
+								   struct fuse_file_info *fi_out, off_t offset_out,
+								   size_t size, int flags)
+{
+	ssize_t res;
+	(void)path_in;
+	(void)path_out;
+
+	res = copy_file_range(fi_in->fh, &offset_in, fi_out->fh, &offset_out, size, flags);
+	if (res == -1)
+		return -errno;
+
+	return res;
 }
 #endif
 
 #ifdef HAVE_SETXATTR
+/* l*xattr() have no *at() form, go through the parent's fd in /proc */
+static const char *xmp_at_path(struct xmp_at *at, char *buf, size_t size)
+{
+	if (at->dfd == AT_FDCWD)
+		return at->name;
+	snprintf(buf, size, "/proc/self/fd/%d/%s", at->dfd, at->name);
+	return buf;
+}
+
 /* xattr operations are optional and can safely be left unimplemented */
 static int xmp_setxattr(const char *path, const char *name, const char *value,
 						size_t size, int flags)
 {
-	int res = lsetxattr(path, name, value, size, flags);
+	char buf[PATH_MAX];
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = lsetxattr(xmp_at_path(&at, buf, sizeof(buf)), name, value, size, flags);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	xmp_at_put(&at);
+	return res;
 }
 
 static int xmp_getxattr(const char *path, const char *name, char *value,
 						size_t size)
 {
-	int res = lgetxattr(path, name, value, size);
+	char buf[PATH_MAX];
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = lgetxattr(xmp_at_path(&at, buf, sizeof(buf)), name, value, size);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 	return res;
 }
 
 static int xmp_listxattr(const char *path, char *list, size_t size)
 {
-	int res = llistxattr(path, list, size);
+	char buf[PATH_MAX];
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = llistxattr(xmp_at_path(&at, buf, sizeof(buf)), list, size);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	xmp_at_put(&at);
 	return res;
 }
 
 static int xmp_removexattr(const char *path, const char *name)
 {
-	int res = lremovexattr(path, name);
+	char buf[PATH_MAX];
+	struct xmp_at at;
+	int res = xmp_at(path, &at);
+	if (res)
+		return res;
+	res = lremovexattr(xmp_at_path(&at, buf, sizeof(buf)), name);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	xmp_at_put(&at);
+	return res;
 }
 #endif /* HAVE_SETXATTR */
 
@@ -445,10 +1244,41 @@ static int xmp_flock(const char *path, struct fuse_file_info *fi, int op)
 	return 0;
 }
 
-extern struct fuse_operations nfs_oper;
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+#ifdef BIND_PASSTHROUGH
+	if (bind_opts.passthrough)
+	{
+		//the kernel refuses passthrough opens with the writeback cache
+		if (conn->capable & FUSE_CAP_PASSTHROUGH)
+		{
+			conn->want = (conn->want | FUSE_CAP_PASSTHROUGH) & ~FUSE_CAP_WRITEBACK_CACHE;
+			__atomic_store_n(&backing_on, 1, __ATOMIC_RELEASE);
+		}
+		else
+			fprintf(stderr, "fusebind: kernel does not support passthrough\n");
+	}
+#endif
+	//after fuse_main() has daemonized, the ring is not shared with a fork
+	if (bind_opts.uring)
+	{
+		uring = uring_engine_new(bind_opts.uring_depth, BIND_URING_FILES);
+		if (!uring)
+			LOG("fusebind: io_uring unavailable, using system calls: %s\n",
+				strerror(errno));
+	}
+	return NULL;
+}
+
+static void xmp_destroy(void *private_data)
+{
+	uring_engine_free(uring);
+	uring = NULL;
+}
+
 static void set_oper_bind()
 {
-	memset(&nfs_oper,0,sizeof(struct fuse_operations));
+	memset(&nfs_oper,0,sizeof(struct fs_operations));
 
 	nfs_oper.getattr = xmp_getattr;
 	nfs_oper.fgetattr = xmp_fgetattr;
@@ -474,16 +1304,24 @@ static void set_oper_bind()
 	nfs_oper.create = xmp_create;
 	nfs_oper.open = xmp_open;
 	nfs_oper.read = xmp_read;
-	nfs_oper.read_buf = xmp_read_buf;
+	//read_buf would have libfuse read the fd itself, past the ring
+	if (!bind_opts.uring)
+		nfs_oper.read_buf = xmp_read_buf;
 	nfs_oper.write = xmp_write;
 	nfs_oper.write_buf = xmp_write_buf;
 	nfs_oper.statfs = xmp_statfs;
 	nfs_oper.flush = xmp_flush;
 	nfs_oper.release = xmp_release;
 	nfs_oper.fsync = xmp_fsync;
-#ifdef HAVE_POSIX_FALLOCATE
+#if defined(HAVE_FALLOCATE) || defined(HAVE_POSIX_FALLOCATE)
 	nfs_oper.fallocate = xmp_fallocate;
 #endif
+#if defined(SEEK_DATA) && defined(HAVE_STRUCT_FUSE_OPERATIONS_LSEEK)
+	nfs_oper.lseek = xmp_lseek;
+#endif
+#if defined(HAVE_COPY_FILE_RANGE) && defined(HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE)
+	nfs_oper.copy_file_range = xmp_copy_file_range;
+#endif
 #ifdef HAVE_SETXATTR
 	nfs_oper.setxattr = xmp_setxattr;
 	nfs_oper.getxattr = xmp_getxattr;
@@ -492,6 +1330,8 @@ static void set_oper_bind()
 #endif
 	nfs_oper.lock = xmp_lock;
 	nfs_oper.flock = xmp_flock;
+	nfs_oper.init = xmp_init;
+	nfs_oper.destroy = xmp_destroy;
 
 	nfs_oper.flag_nullpath_ok = 1;
 #if HAVE_UTIMENSAT
@@ -502,11 +1342,28 @@ static void set_oper_bind()
 int _env_init_bind(struct nfsdata *_d, struct fuse_args *args)
 {
 	int res = 0;
-#ifdef FLAG_STATIC_LINKFUSE
-	fuse_module_libstaticlink_explicitreference_subdir();
-#endif
 	char *arg_pre = "-omodules=subdir,subdir=", *arg_pre2 = ",fsname=", *arg = NULL;
 	size_t mlen = strlen(arg_pre) + strlen(arg_pre2) + strlen(_d->fsname) * 2 + 1;
+
+	if (fuse_opt_parse(args, &bind_opts, bind_opt_spec, NULL) == -1)
+		return -2;
+#ifndef BIND_PASSTHROUGH
+	if (bind_opts.passthrough)
+	{
+		fprintf(stderr, "fusebind: passthrough needs libfuse >= 3.16, ignored\n");
+		bind_opts.passthrough = 0;
+	}
+#endif
+#ifndef BIND_URING
+	if (bind_opts.uring)
+	{
+		fprintf(stderr, "fusebind: built without liburing, uring ignored\n");
+		bind_opts.uring = 0;
+	}
+#endif
+	if (!bind_opts.uring_depth)
+		bind_opts.uring_depth = BIND_DEFAULT_URING_DEPTH;
+
 	arg = malloc(mlen);
 	if (!arg)
 	{
@@ -514,8 +1371,29 @@ int _env_init_bind(struct nfsdata *_d, struct fuse_args *args)
 		res = -errno;
 		goto out_free;
 	}
-	arg[0] = 0, strcat(strcat(arg, arg_pre), _d->fsname);
-	strcat(strcat(arg, arg_pre2), _d->fsname);
+	arg[0] = 0;
+	if (bind_opts.dirfds)
+	{
+		//paths are resolved below rootfd by xmp_at(), no subdir module
+		rootfd = open(_d->fsname, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		dirfds = calloc(bind_opts.dirfds, sizeof(struct dirfd_ent *));
+		if (rootfd == -1 || !dirfds)
+		{
+			fprintf(stderr, "fusebind: %s: %s\n", _d->fsname, strerror(errno));
+			res = -2;
+			goto out_free;
+		}
+		strcat(strcat(arg, "-o"), arg_pre2 + 1);
+	}
+	else
+	{
+#ifdef FLAG_STATIC_LINKFUSE
+		fuse_module_libstaticlink_explicitreference_subdir();
+#endif
+		strcat(strcat(arg, arg_pre), _d->fsname);
+		strcat(arg, arg_pre2);
+	}
+	strcat(arg, _d->fsname);
 	if (fuse_opt_add_arg(args, arg))
 	{
 		res = -6;
@@ -0,0 +1,1311 @@
+/*
+  fusenfs-cache module: attribute, directory, negative-entry and readlink
+  caches stacked on top of whichever backend table main() selected
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "fusenfs.h"
+
+#define DEFAULT_CACHE_TIMEOUT_SECS 20
+#define CACHE_CLEAN_INTERVAL_SECS 60
+#define CACHE_MIN_BUCKETS 256
+#define PAGES_BUCKETS 1024
+#define PAGES_MAX 8192
+#define CACHE_WRITE_STAMPS 256
+
+struct cache_dirent
+{
+	char *name;
+	ino_t ino;
+	mode_t mode;
+};
+
+struct node
+{
+	struct node *next;
+	char *path;
+	struct stat stat;
+	time_t stat_valid;
+	time_t neg_valid;
+	struct cache_dirent *dir;
+	size_t dir_len;
+	time_t dir_valid;
+	char *link;
+	time_t link_valid;
+	time_t valid;
+};
+
+/* Version of a file the kernel page cache was filled from. It outlives the
+ * attribute cache entry: an open that finds the same inode, size and mtime
+ * on the server lets the kernel keep its pages.
+ */
+struct page_node
+{
+	struct page_node *next;
+	char *path;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	int valid;
+	//written through fusenfs, the version is taken again on release
+	int written;
+};
+
+//fi->fh of an open directory, the backend handle is opened lazily
+struct cache_dirh
+{
+	char *path;
+	uint64_t fh;
+	int opened;
+};
+
+struct cache_fill
+{
+	struct cache_dirent *dir;
+	size_t len;
+	size_t size;
+	int err;
+	//directory being listed, for attributes harvested from the entries
+	const char *path;
+	uint64_t wrctr;
+	//set when entries are passed through instead of collected
+	void *buf;
+	fs_fill_dir_t filler;
+};
+
+struct cache
+{
+	int on;
+	unsigned int stat_timeout_secs;
+	unsigned int dir_timeout_secs;
+	unsigned int link_timeout_secs;
+	unsigned int negative_timeout_secs;
+	int pages;
+
+	pthread_mutex_t lock;
+	struct node **table;
+	size_t buckets;
+	size_t count;
+	time_t last_cleaned;
+	/* Fills started at write_ctr are kept unless something they may have
+	 * missed changed since: write_all stamps changes to several paths,
+	 * write_stamp those to a single one, by hash of its path.
+	 */
+	uint64_t write_ctr;
+	uint64_t write_all;
+	uint64_t write_stamp[CACHE_WRITE_STAMPS];
+	struct page_node **pages_table;
+	size_t pages_count;
+	struct fs_operations *next_oper;
+};
+
+static struct cache cache = {
+	.stat_timeout_secs = DEFAULT_CACHE_TIMEOUT_SECS,
+	.dir_timeout_secs = DEFAULT_CACHE_TIMEOUT_SECS,
+	.link_timeout_secs = DEFAULT_CACHE_TIMEOUT_SECS,
+	.negative_timeout_secs = DEFAULT_CACHE_TIMEOUT_SECS,
+	.pages = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct fs_operations cache_oper;
+
+static time_t cache_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static size_t cache_hash(const char *path)
+{
+	size_t h = 5381;
+	while (*path)
+		h = h * 33 + (unsigned char)*path++;
+	return h;
+}
+
+static struct node **cache_slot(const char *path)
+{
+	struct node **np = &cache.table[cache_hash(path) & (cache.buckets - 1)];
+	while (*np && strcmp((*np)->path, path))
+		np = &(*np)->next;
+	return np;
+}
+
+static void free_dir(struct cache_dirent *dir, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		free(dir[i].name);
+	free(dir);
+}
+
+static void free_node(struct node *node)
+{
+	free_dir(node->dir, node->dir_len);
+	free(node->link);
+	free(node->path);
+	free(node);
+}
+
+static void cache_grow(void)
+{
+	size_t i, buckets = cache.buckets * 2;
+	struct node **table = calloc(buckets, sizeof(struct node *));
+	if (!table)
+		return;
+
+	for (i = 0; i < cache.buckets; i++)
+	{
+		struct node *node, *next;
+		for (node = cache.table[i]; node; node = next)
+		{
+			struct node **np = &table[cache_hash(node->path) & (buckets - 1)];
+			next = node->next;
+			node->next = *np;
+			*np = node;
+		}
+	}
+	free(cache.table);
+	cache.table = table;
+	cache.buckets = buckets;
+}
+
+static struct node *cache_lookup(const char *path)
+{
+	return *cache_slot(path);
+}
+
+static struct node *cache_get(const char *path)
+{
+	struct node **np = cache_slot(path), *node = *np;
+	if (node)
+		return node;
+
+	node = calloc(1, sizeof(struct node));
+	if (!node)
+		return NULL;
+	node->path = strdup(path);
+	if (!node->path)
+	{
+		free(node);
+		return NULL;
+	}
+	*np = node;
+	if (++cache.count > cache.buckets * 2)
+		cache_grow();
+	return node;
+}
+
+static void cache_remove(const char *path)
+{
+	struct node **np = cache_slot(path), *node = *np;
+	if (!node)
+		return;
+	*np = node->next;
+	free_node(node);
+	cache.count--;
+}
+
+static void cache_update_valid(struct node *node, time_t valid)
+{
+	if (valid > node->valid)
+		node->valid = valid;
+}
+
+static void cache_clean(time_t now)
+{
+	size_t i;
+
+	if (now - cache.last_cleaned < CACHE_CLEAN_INTERVAL_SECS)
+		return;
+
+	for (i = 0; i < cache.buckets; i++)
+	{
+		struct node **np = &cache.table[i];
+		while (*np)
+		{
+			struct node *node = *np;
+			if (node->valid > now)
+			{
+				np = &node->next;
+				continue;
+			}
+			*np = node->next;
+			free_node(node);
+			cache.count--;
+		}
+	}
+	cache.last_cleaned = now;
+}
+
+static void cache_do_invalidate_dir(const char *path)
+{
+	char *parent = strdup(path), *pos;
+
+	cache_remove(path);
+	if (!parent)
+		return;
+	pos = strrchr(parent, '/');
+	if (pos)
+	{
+		//keep the root as "/"
+		if (pos == parent)
+			pos++;
+		*pos = '\0';
+		cache_remove(parent);
+	}
+	free(parent);
+}
+
+/* with kernel, the kernel is told to forget each path dropped as well */
+static void cache_do_invalidate_prefix(const char *prefix, int kernel)
+{
+	size_t i, len = strlen(prefix);
+
+	if (len && prefix[len - 1] == '/')
+		len--;
+	for (i = 0; i < cache.buckets; i++)
+	{
+		struct node **np = &cache.table[i];
+		while (*np)
+		{
+			struct node *node = *np;
+			if (strncmp(node->path, prefix, len) ||
+				(node->path[len] && node->path[len] != '/'))
+			{
+				np = &node->next;
+				continue;
+			}
+			*np = node->next;
+			if (kernel)
+				compat_invalidate(node->path);
+			free_node(node);
+			cache.count--;
+		}
+	}
+}
+
+/* called with cache.lock held */
+static void cache_do_invalidate(const char *path)
+{
+	cache_remove(path);
+	cache.write_stamp[cache_hash(path) & (CACHE_WRITE_STAMPS - 1)] = ++cache.write_ctr;
+}
+
+/* called with cache.lock held: no change a fill of path started at wrctr
+ * may have missed
+ */
+static int cache_fill_current(const char *path, uint64_t wrctr)
+{
+	return cache.write_all <= wrctr &&
+		   cache.write_stamp[cache_hash(path) & (CACHE_WRITE_STAMPS - 1)] <= wrctr;
+}
+
+void cache_invalidate(const char *path)
+{
+	if (!cache.table || !path)
+		return;
+	pthread_mutex_lock(&cache.lock);
+	cache_do_invalidate(path);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* drop the entry itself and the parent listing/attributes it appears in */
+void cache_invalidate_dir(const char *path)
+{
+	if (!cache.table || !path)
+		return;
+	pthread_mutex_lock(&cache.lock);
+	cache_do_invalidate_dir(path);
+	cache.write_all = ++cache.write_ctr;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* drop the entry, everything below it and its parent (renamed/removed subtrees) */
+void cache_invalidate_prefix(const char *prefix)
+{
+	if (!cache.table || !prefix)
+		return;
+	pthread_mutex_lock(&cache.lock);
+	cache_do_invalidate_prefix(prefix, 0);
+	cache_do_invalidate_dir(prefix);
+	cache.write_all = ++cache.write_ctr;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* a timeout of the cache, the control socket may change it any time */
+static unsigned int cache_timeout(unsigned int *secs)
+{
+	return __atomic_load_n(secs, __ATOMIC_RELAXED);
+}
+
+/* whether attributes passed to the readdir filler are kept */
+int cache_stat_enabled(void)
+{
+	return cache.table && cache_timeout(&cache.stat_timeout_secs);
+}
+
+/* whether listings are cached, the kernel may then keep them too */
+int cache_dir_enabled(void)
+{
+	return cache.table && cache_timeout(&cache.dir_timeout_secs);
+}
+
+static uint64_t cache_get_write_ctr(void)
+{
+	uint64_t res;
+
+	pthread_mutex_lock(&cache.lock);
+	res = cache.write_ctr;
+	pthread_mutex_unlock(&cache.lock);
+	return res;
+}
+
+static void cache_add_attr(const char *path, const struct stat *stbuf, uint64_t wrctr)
+{
+	struct node *node;
+	time_t now;
+
+	if (!cache_timeout(&cache.stat_timeout_secs) || !path)
+		return;
+
+	pthread_mutex_lock(&cache.lock);
+	if (cache_fill_current(path, wrctr) && (node = cache_get(path)))
+	{
+		now = cache_now();
+		node->stat = *stbuf;
+		node->stat_valid = now + cache_timeout(&cache.stat_timeout_secs);
+		node->neg_valid = 0;
+		cache_update_valid(node, node->stat_valid);
+		cache_clean(now);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static void cache_add_negative(const char *path, uint64_t wrctr)
+{
+	struct node *node;
+	time_t now;
+
+	if (!cache_timeout(&cache.negative_timeout_secs))
+		return;
+
+	pthread_mutex_lock(&cache.lock);
+	if (cache_fill_current(path, wrctr) && (node = cache_get(path)))
+	{
+		now = cache_now();
+		node->stat_valid = 0;
+		node->neg_valid = now + cache_timeout(&cache.negative_timeout_secs);
+		cache_update_valid(node, node->neg_valid);
+		cache_clean(now);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static void cache_add_dir(const char *path, struct cache_fill *fill, uint64_t wrctr)
+{
+	struct node *node;
+	time_t now;
+
+	pthread_mutex_lock(&cache.lock);
+	if (cache_fill_current(path, wrctr) && (node = cache_get(path)))
+	{
+		now = cache_now();
+		free_dir(node->dir, node->dir_len);
+		node->dir = fill->dir;
+		node->dir_len = fill->len;
+		node->dir_valid = now + cache_timeout(&cache.dir_timeout_secs);
+		cache_update_valid(node, node->dir_valid);
+		cache_clean(now);
+		fill->dir = NULL;
+		fill->len = 0;
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static void cache_add_link(const char *path, const char *link, uint64_t wrctr)
+{
+	struct node *node;
+	time_t now;
+
+	pthread_mutex_lock(&cache.lock);
+	if (cache_fill_current(path, wrctr) && (node = cache_get(path)))
+	{
+		char *dup = strdup(link);
+		if (dup)
+		{
+			now = cache_now();
+			free(node->link);
+			node->link = dup;
+			node->link_valid = now + cache_timeout(&cache.link_timeout_secs);
+			cache_update_valid(node, node->link_valid);
+			cache_clean(now);
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* returns -EAGAIN when the backend has to be asked */
+static int cache_get_attr(const char *path, struct stat *stbuf)
+{
+	struct node *node;
+	time_t now;
+	int err = -EAGAIN;
+
+	pthread_mutex_lock(&cache.lock);
+	node = cache_lookup(path);
+	if (node)
+	{
+		now = cache_now();
+		if (node->stat_valid > now)
+		{
+			*stbuf = node->stat;
+			err = 0;
+		}
+		else if (node->neg_valid > now)
+			err = -ENOENT;
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return err;
+}
+
+/* size of a regular file whose attributes are still valid, -EAGAIN when the
+ * cache does not know it: backends size their work at open by it
+ */
+int cache_known_size(const char *path, off_t *size)
+{
+	struct stat st;
+	int err;
+
+	if (!cache.table)
+		return -EAGAIN;
+	if ((err = cache_get_attr(path, &st)))
+		return err;
+	if (!S_ISREG(st.st_mode))
+		return -EAGAIN;
+	*size = st.st_size;
+	return 0;
+}
+
+static struct page_node **pages_slot(const char *path)
+{
+	struct page_node **np = &cache.pages_table[cache_hash(path) & (PAGES_BUCKETS - 1)];
+	while (*np && strcmp((*np)->path, path))
+		np = &(*np)->next;
+	return np;
+}
+
+static struct page_node *pages_get(const char *path)
+{
+	struct page_node **np = pages_slot(path), *node = *np;
+	if (node)
+		return node;
+
+	//full: forget the bucket, its files are read from the server again
+	if (cache.pages_count >= PAGES_MAX)
+	{
+		struct page_node **head = &cache.pages_table[cache_hash(path) & (PAGES_BUCKETS - 1)];
+		while ((node = *head))
+		{
+			*head = node->next;
+			free(node->path);
+			free(node);
+			cache.pages_count--;
+		}
+		np = head;
+	}
+
+	node = calloc(1, sizeof(struct page_node));
+	if (!node)
+		return NULL;
+	node->path = strdup(path);
+	if (!node->path)
+	{
+		free(node);
+		return NULL;
+	}
+	*np = node;
+	cache.pages_count++;
+	return node;
+}
+
+static void pages_set(struct page_node *node, const struct stat *stbuf)
+{
+	node->ino = stbuf->st_ino;
+	node->size = stbuf->st_size;
+	node->mtime = stbuf->st_mtim;
+	node->valid = 1;
+}
+
+/* the kernel has the written data in its pages already */
+static void pages_written(const char *path)
+{
+	struct page_node *node;
+
+	if (!cache.pages_table)
+		return;
+	pthread_mutex_lock(&cache.lock);
+	if ((node = pages_get(path)))
+		node->written = 1;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* data was written to path: its attributes go, the fills of other paths
+ * are kept, and its pages are the kernel's own
+ */
+static void cache_written(const char *path)
+{
+	struct page_node *node;
+
+	if (!path)
+		return;
+	pthread_mutex_lock(&cache.lock);
+	cache_do_invalidate(path);
+	if (cache.pages_table && (node = pages_get(path)))
+		node->written = 1;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* called with cache.lock held */
+static void pages_drop_prefix(const char *prefix)
+{
+	size_t i, len = strlen(prefix);
+
+	if (len && prefix[len - 1] == '/')
+		len--;
+	for (i = 0; i < PAGES_BUCKETS; i++)
+	{
+		struct page_node **np = &cache.pages_table[i], *node;
+		while ((node = *np))
+		{
+			if (strncmp(node->path, prefix, len) ||
+				(node->path[len] && node->path[len] != '/'))
+			{
+				np = &node->next;
+				continue;
+			}
+			*np = node->next;
+			compat_invalidate(node->path);
+			free(node->path);
+			free(node);
+			cache.pages_count--;
+		}
+	}
+}
+
+/* Forget prefix and everything below it on request: attributes, listings,
+ * links and the versions of the kernel pages. The kernel drops the entries
+ * and pages it has of those paths too, the next access goes to the server.
+ */
+void cache_drop(const char *prefix)
+{
+	if (cache.table)
+	{
+		pthread_mutex_lock(&cache.lock);
+		cache_do_invalidate_prefix(prefix, 1);
+		if (cache.pages_table)
+			pages_drop_prefix(prefix);
+		cache.write_all = ++cache.write_ctr;
+		pthread_mutex_unlock(&cache.lock);
+	}
+	compat_invalidate(prefix);
+}
+
+/* Asks the server whether the file changed since its pages were read, on
+ * the handle just opened. A changed file is opened without keep_cache,
+ * which makes the kernel drop its pages, and the attributes it sent replace
+ * the cached ones so the new size is seen. A file with no version yet takes
+ * it from the attribute cache, without a round trip.
+ */
+static int pages_unchanged(const char *path, struct fuse_file_info *fi)
+{
+	struct page_node *node;
+	struct node *attr;
+	struct stat st;
+	uint64_t wrctr;
+	int keep = 0, changed = 0, tracked, err;
+
+	pthread_mutex_lock(&cache.lock);
+	node = *pages_slot(path);
+	tracked = node && node->valid && !node->written;
+	if (!tracked && (!node || !node->written) && (node = pages_get(path)) &&
+		(attr = cache_lookup(path)) && attr->stat_valid > cache_now())
+		pages_set(node, &attr->stat);
+	wrctr = cache.write_ctr;
+	pthread_mutex_unlock(&cache.lock);
+	if (!tracked)
+		return 0;
+
+	if (cache.next_oper->fgetattr)
+		err = cache.next_oper->fgetattr(path, &st, fi);
+	else
+		err = cache.next_oper->getattr(path, &st);
+	if (err)
+		return 0;
+	cache_add_attr(path, &st, wrctr);
+
+	pthread_mutex_lock(&cache.lock);
+	if ((node = *pages_slot(path)))
+	{
+		if (node->valid && !node->written)
+		{
+			keep = node->ino == st.st_ino && node->size == st.st_size &&
+				   node->mtime.tv_sec == st.st_mtim.tv_sec &&
+				   node->mtime.tv_nsec == st.st_mtim.tv_nsec;
+			changed = !keep;
+		}
+		pages_set(node, &st);
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	if (changed)
+	{
+		LOG("cache: [%s] changed on the server, dropping its pages\n", path);
+		compat_invalidate(path);
+	}
+	return keep;
+}
+
+static int cache_getattr(const char *path, struct stat *stbuf)
+{
+	uint64_t wrctr;
+	int err = cache_get_attr(path, stbuf);
+	if (err != -EAGAIN)
+		return err;
+
+	wrctr = cache_get_write_ctr();
+	err = cache.next_oper->getattr(path, stbuf);
+	if (!err)
+		cache_add_attr(path, stbuf, wrctr);
+	else if (err == -ENOENT)
+		cache_add_negative(path, wrctr);
+	return err;
+}
+
+static int cache_fgetattr(const char *path, struct stat *stbuf,
+						  struct fuse_file_info *fi)
+{
+	uint64_t wrctr = cache_get_write_ctr();
+	int err = cache.next_oper->fgetattr(path, stbuf, fi);
+	if (!err)
+		cache_add_attr(path, stbuf, wrctr);
+	return err;
+}
+
+static int cache_readlink(const char *path, char *buf, size_t size)
+{
+	struct node *node;
+	uint64_t wrctr;
+	int err;
+
+	pthread_mutex_lock(&cache.lock);
+	node = cache_lookup(path);
+	if (node && node->link && node->link_valid > cache_now())
+	{
+		strncpy(buf, node->link, size - 1);
+		buf[size - 1] = '\0';
+		pthread_mutex_unlock(&cache.lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	wrctr = cache_get_write_ctr();
+	err = cache.next_oper->readlink(path, buf, size);
+	if (!err)
+		cache_add_link(path, buf, wrctr);
+	return err;
+}
+
+static inline struct cache_dirh *get_dirh(struct fuse_file_info *fi)
+{
+	return (struct cache_dirh *)fi->fh;
+}
+
+/* the backend sees its own handle in a copy of fi */
+static struct fuse_file_info *cache_dirh_fi(struct cache_dirh *dh,
+											struct fuse_file_info *fi,
+											struct fuse_file_info *bfi)
+{
+	*bfi = *fi;
+	bfi->fh = dh->fh;
+	return bfi;
+}
+
+static int cache_dirh_open(struct cache_dirh *dh, struct fuse_file_info *fi)
+{
+	struct fuse_file_info bfi;
+	int err;
+
+	if (dh->opened)
+		return 0;
+	if (cache.next_oper->opendir)
+	{
+		err = cache.next_oper->opendir(dh->path, cache_dirh_fi(dh, fi, &bfi));
+		if (err)
+			return err;
+		dh->fh = bfi.fh;
+	}
+	dh->opened = 1;
+	return 0;
+}
+
+static int cache_dir_valid(const char *path)
+{
+	struct node *node;
+	int res;
+
+	pthread_mutex_lock(&cache.lock);
+	node = cache_lookup(path);
+	res = node && node->dir && node->dir_valid > cache_now();
+	pthread_mutex_unlock(&cache.lock);
+	return res;
+}
+
+static int cache_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct cache_dirh *dh = calloc(1, sizeof(struct cache_dirh));
+	int err;
+
+	if (!dh)
+		return -ENOMEM;
+	dh->path = strdup(path);
+	if (!dh->path)
+	{
+		free(dh);
+		return -ENOMEM;
+	}
+
+	//a cached listing is served without touching the backend at all
+	if (!cache_dir_valid(path) && (err = cache_dirh_open(dh, fi)))
+	{
+		free(dh->path);
+		free(dh);
+		return err;
+	}
+	fi->fh = (uint64_t)dh;
+	return 0;
+}
+
+/* Backends that get complete attributes with the listing anyway (SMB
+ * enumeration) pass them through fill_dir_attr(), keep them so the
+ * getattr that follows every entry does not go to the server.
+ */
+static void cache_harvest_attr(struct cache_fill *fill, const char *name,
+							   const struct stat *stbuf)
+{
+	size_t dlen, nlen;
+	char *path;
+
+	if (!stbuf || !fill_dir_has_attr() || !cache_timeout(&cache.stat_timeout_secs))
+		return;
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return;
+
+	dlen = strcmp(fill->path, "/") ? strlen(fill->path) : 0;
+	nlen = strlen(name);
+	path = malloc(dlen + nlen + 2);
+	if (!path)
+		return;
+	memcpy(path, fill->path, dlen);
+	path[dlen] = '/';
+	memcpy(path + dlen + 1, name, nlen + 1);
+	cache_add_attr(path, stbuf, fill->wrctr);
+	free(path);
+}
+
+static int cache_dirfill(void *buf, const char *name,
+						 const struct stat *stbuf, off_t off)
+{
+	struct cache_fill *fill = buf;
+	struct cache_dirent *ent;
+
+	cache_harvest_attr(fill, name, stbuf);
+	if (fill->filler)
+		return fill->filler(fill->buf, name, stbuf, off);
+
+	if (fill->len == fill->size)
+	{
+		size_t size = fill->size ? fill->size * 2 : 64;
+		struct cache_dirent *dir = realloc(fill->dir, size * sizeof(struct cache_dirent));
+		if (!dir)
+		{
+			fill->err = -ENOMEM;
+			return 1;
+		}
+		fill->dir = dir;
+		fill->size = size;
+	}
+
+	ent = &fill->dir[fill->len];
+	ent->name = strdup(name);
+	if (!ent->name)
+	{
+		fill->err = -ENOMEM;
+		return 1;
+	}
+	ent->ino = stbuf ? stbuf->st_ino : 0;
+	ent->mode = stbuf ? stbuf->st_mode & S_IFMT : 0;
+	fill->len++;
+	return 0;
+}
+
+static void cache_replay_dir(struct cache_dirent *dir, size_t len,
+							 void *buf, fs_fill_dir_t filler)
+{
+	struct stat st;
+	size_t i;
+
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < len; i++)
+	{
+		st.st_ino = dir[i].ino;
+		st.st_mode = dir[i].mode;
+		if (filler(buf, dir[i].name, &st, 0))
+			break;
+	}
+}
+
+static int cache_readdir(const char *path, void *buf, fs_fill_dir_t filler,
+						 off_t offset, struct fuse_file_info *fi)
+{
+	struct cache_dirh *dh = get_dirh(fi);
+	struct fuse_file_info bfi;
+	struct cache_fill fill;
+	struct node *node;
+	uint64_t wrctr;
+	int err;
+
+	pthread_mutex_lock(&cache.lock);
+	node = cache_lookup(dh->path);
+	if (node && node->dir && node->dir_valid > cache_now())
+	{
+		cache_replay_dir(node->dir, node->dir_len, buf, filler);
+		pthread_mutex_unlock(&cache.lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	err = cache_dirh_open(dh, fi);
+	if (err)
+		return err;
+	cache_dirh_fi(dh, fi, &bfi);
+
+	memset(&fill, 0, sizeof(fill));
+	fill.path = dh->path;
+	fill.wrctr = wrctr = cache_get_write_ctr();
+	if (!cache_timeout(&cache.dir_timeout_secs))
+	{
+		fill.buf = buf;
+		fill.filler = filler;
+		return cache.next_oper->readdir(path, &fill, cache_dirfill, offset, &bfi);
+	}
+
+	/* collect the whole listing, then hand it out without offsets */
+	err = cache.next_oper->readdir(path, &fill, cache_dirfill, 0, &bfi);
+	if (!err)
+		err = fill.err;
+	if (!err)
+	{
+		cache_replay_dir(fill.dir, fill.len, buf, filler);
+		cache_add_dir(dh->path, &fill, wrctr);
+	}
+	free_dir(fill.dir, fill.len);
+	return err;
+}
+
+static int cache_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct cache_dirh *dh = get_dirh(fi);
+	struct fuse_file_info bfi;
+	int err = 0;
+
+	if (dh->opened && cache.next_oper->releasedir)
+		err = cache.next_oper->releasedir(path, cache_dirh_fi(dh, fi, &bfi));
+	free(dh->path);
+	free(dh);
+	return err;
+}
+
+static int cache_fsyncdir(const char *path, int isdatasync,
+						  struct fuse_file_info *fi)
+{
+	struct cache_dirh *dh = get_dirh(fi);
+	struct fuse_file_info bfi;
+
+	if (!dh->opened)
+		return 0;
+	return cache.next_oper->fsyncdir(path, isdatasync, cache_dirh_fi(dh, fi, &bfi));
+}
+
+static int cache_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	int err = cache.next_oper->mknod(path, mode, rdev);
+	cache_invalidate_dir(path);
+	return err;
+}
+
+static int cache_mkdir(const char *path, mode_t mode)
+{
+	int err = cache.next_oper->mkdir(path, mode);
+	cache_invalidate_dir(path);
+	return err;
+}
+
+static int cache_unlink(const char *path)
+{
+	int err = cache.next_oper->unlink(path);
+	cache_invalidate_dir(path);
+	return err;
+}
+
+static int cache_rmdir(const char *path)
+{
+	int err = cache.next_oper->rmdir(path);
+	cache_invalidate_prefix(path);
+	return err;
+}
+
+static int cache_symlink(const char *from, const char *to)
+{
+	int err = cache.next_oper->symlink(from, to);
+	cache_invalidate_dir(to);
+	return err;
+}
+
+static int cache_rename(const char *from, const char *to)
+{
+	int err = cache.next_oper->rename(from, to);
+	cache_invalidate_prefix(from);
+	cache_invalidate_prefix(to);
+	return err;
+}
+
+static int cache_link(const char *from, const char *to)
+{
+	int err = cache.next_oper->link(from, to);
+	cache_invalidate(from);
+	cache_invalidate_dir(to);
+	return err;
+}
+
+static int cache_chmod(const char *path, mode_t mode)
+{
+	int err = cache.next_oper->chmod(path, mode);
+	cache_invalidate(path);
+	return err;
+}
+
+static int cache_chown(const char *path, uid_t uid, gid_t gid)
+{
+	int err = cache.next_oper->chown(path, uid, gid);
+	cache_invalidate(path);
+	return err;
+}
+
+static int cache_truncate(const char *path, off_t size)
+{
+	int err = cache.next_oper->truncate(path, size);
+	cache_invalidate(path);
+	pages_written(path);
+	return err;
+}
+
+static int cache_ftruncate(const char *path, off_t size,
+						   struct fuse_file_info *fi)
+{
+	int err = cache.next_oper->ftruncate(path, size, fi);
+	cache_invalidate(path);
+	pages_written(path);
+	return err;
+}
+
+static int cache_utime(const char *path, struct utimbuf *times)
+{
+	int err = cache.next_oper->utime(path, times);
+	cache_invalidate(path);
+	return err;
+}
+
+static int cache_utimens(const char *path, const struct timespec ts[2])
+{
+	int err = cache.next_oper->utimens(path, ts);
+	cache_invalidate(path);
+	return err;
+}
+
+static int cache_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int err = cache.next_oper->create(path, mode, fi);
+	cache_invalidate_dir(path);
+	return err;
+}
+
+static int cache_open(const char *path, struct fuse_file_info *fi)
+{
+	int err = cache.next_oper->open(path, fi);
+	if (fi->flags & O_TRUNC)
+	{
+		cache_invalidate(path);
+		pages_written(path);
+	}
+	if (!err && cache.pages_table && !fi->direct_io)
+		fi->keep_cache = pages_unchanged(path, fi);
+	return err;
+}
+
+/* once the last written data is on the server, its version matches the pages */
+static int cache_release(const char *path, struct fuse_file_info *fi)
+{
+	struct page_node *node;
+	struct stat st;
+	int written = 0;
+	int err = cache.next_oper->release(path, fi);
+
+	if (!cache.pages_table || !path)
+		return err;
+	pthread_mutex_lock(&cache.lock);
+	node = *pages_slot(path);
+	if (node && node->written)
+	{
+		node->written = 0;
+		written = 1;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	if (written && !cache.next_oper->getattr(path, &st))
+	{
+		pthread_mutex_lock(&cache.lock);
+		node = *pages_slot(path);
+		//written again in the meantime by another handle
+		if (node && !node->written)
+			pages_set(node, &st);
+		pthread_mutex_unlock(&cache.lock);
+	}
+	return err;
+}
+
+static int cache_write(const char *path, const char *buf, size_t size,
+					   off_t offset, struct fuse_file_info *fi)
+{
+	int res = cache.next_oper->write(path, buf, size, offset, fi);
+	cache_written(path);
+	return res;
+}
+
+static int cache_write_buf(const char *path, struct fuse_bufvec *buf,
+						   off_t offset, struct fuse_file_info *fi)
+{
+	int res = cache.next_oper->write_buf(path, buf, offset, fi);
+	cache_written(path);
+	return res;
+}
+
+static int cache_fallocate(const char *path, int mode, off_t offset,
+						   off_t length, struct fuse_file_info *fi)
+{
+	int err = cache.next_oper->fallocate(path, mode, offset, length, fi);
+	cache_written(path);
+	return err;
+}
+
+static int cache_setxattr(const char *path, const char *name, const char *value,
+						  size_t size, int flags)
+{
+	int err = cache.next_oper->setxattr(path, name, value, size, flags);
+	cache_invalidate(path);
+	return err;
+}
+
+static int cache_removexattr(const char *path, const char *name)
+{
+	int err = cache.next_oper->removexattr(path, name);
+	cache_invalidate(path);
+	return err;
+}
+
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+static ssize_t cache_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+									 off_t offset_in, const char *path_out,
+									 struct fuse_file_info *fi_out, off_t offset_out,
+									 size_t size, int flags)
+{
+	ssize_t res = cache.next_oper->copy_file_range(path_in, fi_in, offset_in, path_out,
+												   fi_out, offset_out, size, flags);
+	cache_written(path_out);
+	return res;
+}
+#endif
+
+#define CACHE_WRAP(op) cache_oper.op = oper->op ? cache_##op : NULL
+
+struct fs_operations *cache_wrap(struct fs_operations *oper)
+{
+	cache.next_oper = oper;
+	if (cache.pages == -1)
+		cache.pages = cache.on;
+	if (!cache.on)
+		cache.stat_timeout_secs = cache.dir_timeout_secs =
+			cache.link_timeout_secs = cache.negative_timeout_secs = 0;
+	if (!cache.stat_timeout_secs && !cache.dir_timeout_secs &&
+		!cache.link_timeout_secs && !cache.negative_timeout_secs && !cache.pages)
+		return oper;
+
+	cache.buckets = CACHE_MIN_BUCKETS;
+	cache.table = calloc(cache.buckets, sizeof(struct node *));
+	if (!cache.table)
+	{
+		fprintf(stderr, "fusenfs: cache disabled, memory allocation failed\n");
+		return oper;
+	}
+	cache.last_cleaned = cache_now();
+	if (cache.pages && oper->open && oper->getattr)
+		cache.pages_table = calloc(PAGES_BUCKETS, sizeof(struct page_node *));
+
+	cache_oper = *oper;
+	CACHE_WRAP(getattr);
+	CACHE_WRAP(fgetattr);
+	CACHE_WRAP(readlink);
+	CACHE_WRAP(readdir);
+	CACHE_WRAP(fsyncdir);
+	CACHE_WRAP(mknod);
+	CACHE_WRAP(mkdir);
+	CACHE_WRAP(unlink);
+	CACHE_WRAP(rmdir);
+	CACHE_WRAP(symlink);
+	CACHE_WRAP(rename);
+	CACHE_WRAP(link);
+	CACHE_WRAP(chmod);
+	CACHE_WRAP(chown);
+	CACHE_WRAP(truncate);
+	CACHE_WRAP(ftruncate);
+	CACHE_WRAP(utime);
+	CACHE_WRAP(utimens);
+	CACHE_WRAP(create);
+	CACHE_WRAP(open);
+	CACHE_WRAP(release);
+	CACHE_WRAP(write);
+	CACHE_WRAP(write_buf);
+	CACHE_WRAP(fallocate);
+	CACHE_WRAP(setxattr);
+	CACHE_WRAP(removexattr);
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+	CACHE_WRAP(copy_file_range);
+#endif
+	//the directory handle is ours even when the backend keeps none
+	if (oper->readdir)
+	{
+		cache_oper.opendir = cache_opendir;
+		cache_oper.releasedir = cache_releasedir;
+	}
+	if (!cache_timeout(&cache.link_timeout_secs))
+		cache_oper.readlink = oper->readlink;
+
+	return &cache_oper;
+}
+
+static const struct fuse_opt cache_opts[] = {
+	{"cache=yes", offsetof(struct cache, on), 1},
+	{"cache=no", offsetof(struct cache, on), 0},
+	{"cache_timeout=%u", offsetof(struct cache, stat_timeout_secs), 0},
+	{"cache_timeout=%u", offsetof(struct cache, dir_timeout_secs), 0},
+	{"cache_timeout=%u", offsetof(struct cache, link_timeout_secs), 0},
+	{"cache_timeout=%u", offsetof(struct cache, negative_timeout_secs), 0},
+	{"cache_stat_timeout=%u", offsetof(struct cache, stat_timeout_secs), 0},
+	{"cache_dir_timeout=%u", offsetof(struct cache, dir_timeout_secs), 0},
+	{"cache_link_timeout=%u", offsetof(struct cache, link_timeout_secs), 0},
+	{"cache_negative_timeout=%u", offsetof(struct cache, negative_timeout_secs), 0},
+	{"cache_pages=yes", offsetof(struct cache, pages), 1},
+	{"cache_pages=no", offsetof(struct cache, pages), 0},
+	FUSE_OPT_END};
+
+int cache_parse_options(struct fuse_args *args, int on)
+{
+	cache.on = on;
+	return fuse_opt_parse(args, &cache, cache_opts, NULL);
+}
+
+//the timeouts can change while mounted, what is wrapped stays as it was
+struct cache_timeouts
+{
+	unsigned int stat;
+	unsigned int dir;
+	unsigned int link;
+	unsigned int negative;
+};
+
+static const struct fuse_opt cache_tune_opts[] = {
+	{"cache_timeout=%u", offsetof(struct cache_timeouts, stat), 0},
+	{"cache_timeout=%u", offsetof(struct cache_timeouts, dir), 0},
+	{"cache_timeout=%u", offsetof(struct cache_timeouts, link), 0},
+	{"cache_timeout=%u", offsetof(struct cache_timeouts, negative), 0},
+	{"cache_stat_timeout=%u", offsetof(struct cache_timeouts, stat), 0},
+	{"cache_dir_timeout=%u", offsetof(struct cache_timeouts, dir), 0},
+	{"cache_link_timeout=%u", offsetof(struct cache_timeouts, link), 0},
+	{"cache_negative_timeout=%u", offsetof(struct cache_timeouts, negative), 0},
+	FUSE_OPT_END};
+
+/* new timeouts apply to what is cached from now on, stored only when apply
+ * is set; a mount without the cache leaves the options to the caller as
+ * unknown
+ */
+int cache_tune(struct fuse_args *args, int apply)
+{
+	struct cache_timeouts t;
+
+	if (!cache.table)
+		return 0;
+	t.stat = cache_timeout(&cache.stat_timeout_secs);
+	t.dir = cache_timeout(&cache.dir_timeout_secs);
+	t.link = cache_timeout(&cache.link_timeout_secs);
+	t.negative = cache_timeout(&cache.negative_timeout_secs);
+	if (fuse_opt_parse(args, &t, cache_tune_opts, NULL) == -1)
+		return -1;
+	if (apply)
+	{
+		__atomic_store_n(&cache.stat_timeout_secs, t.stat, __ATOMIC_RELAXED);
+		__atomic_store_n(&cache.dir_timeout_secs, t.dir, __ATOMIC_RELAXED);
+		__atomic_store_n(&cache.link_timeout_secs, t.link, __ATOMIC_RELAXED);
+		__atomic_store_n(&cache.negative_timeout_secs, t.negative, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+int cache_stats(char *buf, size_t size)
+{
+	int len;
+
+	if (!cache.table)
+		return snprintf(buf, size, "off");
+	pthread_mutex_lock(&cache.lock);
+	len = snprintf(buf, size, "entries=%zu pages=%zu timeouts stat=%u dir=%u link=%u negative=%u",
+				   cache.count, cache.pages_count, cache_timeout(&cache.stat_timeout_secs),
+				   cache_timeout(&cache.dir_timeout_secs), cache_timeout(&cache.link_timeout_secs),
+				   cache_timeout(&cache.negative_timeout_secs));
+	pthread_mutex_unlock(&cache.lock);
+	return len;
+}
@@ -0,0 +1,406 @@
+/*
+  fusenfs-compat module: the FUSE 2 operation table of the backends on top
+  of the libfuse3 API
+
+  The backends and the cache are written against the FUSE 2 table. With a
+  libfuse3 build this module translates the calls that changed and
+  negotiates what only FUSE 3 offers: the kernel writeback cache, requests
+  of up to max_pages pages, parallel directory operations, READDIRPLUS,
+  kernel cached listings and invalidations of remote changes.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "fusenfs.h"
+
+#if FUSE_USE_VERSION >= 30
+
+//FUSE_MAX_MAX_PAGES of the kernel and of the libfuse request buffer
+#define COMPAT_MAX_PAGES 256
+
+struct compat_opts
+{
+	unsigned int writeback;
+	unsigned int max_pages;
+};
+
+static struct compat_opts compat_opts = {
+	.max_pages = COMPAT_MAX_PAGES,
+};
+
+//paths of remote changes, handed to the kernel off the backend threads
+struct compat_inval
+{
+	struct compat_inval *next;
+	char path[];
+};
+
+static struct
+{
+	struct fs_operations *next_oper;
+	int writeback;
+	struct fuse *fuse;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int started;
+	int stop;
+	struct compat_inval *head, **tail;
+} compat = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.tail = &compat.head,
+};
+
+static struct fuse_operations compat_oper;
+
+/* The kernel may hold page locks while it waits for a request the backend
+ * threads are serving, so notifications are sent from their own thread.
+ */
+static void *compat_inval_thread(void *arg)
+{
+	struct compat_inval *inval;
+
+	pthread_mutex_lock(&compat.lock);
+	for (;;)
+	{
+		while (!compat.head && !compat.stop)
+			pthread_cond_wait(&compat.cond, &compat.lock);
+		if (!compat.head)
+			break;
+		inval = compat.head;
+		compat.head = inval->next;
+		if (!compat.head)
+			compat.tail = &compat.head;
+		pthread_mutex_unlock(&compat.lock);
+
+#ifdef HAVE_FUSE_INVALIDATE_PATH
+		//-ENOENT: the kernel never looked the path up, nothing to drop
+		fuse_invalidate_path(compat.fuse, inval->path);
+#endif
+		free(inval);
+		pthread_mutex_lock(&compat.lock);
+	}
+	pthread_mutex_unlock(&compat.lock);
+	return NULL;
+}
+
+void compat_invalidate(const char *path)
+{
+	size_t len = strlen(path);
+	struct compat_inval *inval;
+
+	pthread_mutex_lock(&compat.lock);
+	if (!compat.started || compat.stop)
+	{
+		pthread_mutex_unlock(&compat.lock);
+		return;
+	}
+	inval = malloc(sizeof(struct compat_inval) + len + 1);
+	if (inval)
+	{
+		inval->next = NULL;
+		memcpy(inval->path, path, len + 1);
+		*compat.tail = inval;
+		compat.tail = &inval->next;
+		pthread_cond_signal(&compat.cond);
+	}
+	pthread_mutex_unlock(&compat.lock);
+}
+
+static void *compat_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	struct fs_operations *next = compat.next_oper;
+	unsigned int max_write = compat_opts.max_pages * getpagesize();
+
+	cfg->nullpath_ok = next->flag_nullpath_ok;
+
+	//coalesced writes and readahead reach the backends in large requests
+	if (compat_opts.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	if (conn->capable & FUSE_CAP_PARALLEL_DIROPS)
+		conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+	if (next->readdir && (conn->capable & FUSE_CAP_READDIRPLUS))
+		conn->want |= FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO;
+	if (max_write > conn->max_write)
+		conn->max_write = max_write;
+	if (max_write > conn->max_readahead)
+		conn->max_readahead = max_write;
+
+	pthread_mutex_lock(&compat.lock);
+	compat.fuse = fuse_get_context()->fuse;
+	compat.started = !pthread_create(&compat.thread, NULL, compat_inval_thread, NULL);
+	pthread_mutex_unlock(&compat.lock);
+
+	void *private_data = next->init ? next->init(conn) : NULL;
+	//a backend may have dropped it again, e.g. for passthrough
+	compat.writeback = !!(conn->want & FUSE_CAP_WRITEBACK_CACHE);
+	return private_data;
+}
+
+static void compat_destroy(void *private_data)
+{
+	struct compat_inval *inval;
+
+	pthread_mutex_lock(&compat.lock);
+	compat.stop = 1;
+	pthread_cond_signal(&compat.cond);
+	pthread_mutex_unlock(&compat.lock);
+	if (compat.started)
+		pthread_join(compat.thread, NULL);
+	while ((inval = compat.head))
+	{
+		compat.head = inval->next;
+		free(inval);
+	}
+	compat.tail = &compat.head;
+
+	if (compat.next_oper->destroy)
+		compat.next_oper->destroy(private_data);
+}
+
+static int compat_getattr(const char *path, struct stat *stbuf,
+						  struct fuse_file_info *fi)
+{
+	if (fi && compat.next_oper->fgetattr)
+		return compat.next_oper->fgetattr(path, stbuf, fi);
+	return compat.next_oper->getattr(path, stbuf);
+}
+
+static int compat_rename(const char *from, const char *to, unsigned int flags)
+{
+	//RENAME_NOREPLACE and RENAME_EXCHANGE are not atomic on the backends
+	if (flags)
+		return -EINVAL;
+	return compat.next_oper->rename(from, to);
+}
+
+static int compat_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	return compat.next_oper->chmod(path, mode);
+}
+
+static int compat_chown(const char *path, uid_t uid, gid_t gid,
+						struct fuse_file_info *fi)
+{
+	return compat.next_oper->chown(path, uid, gid);
+}
+
+static int compat_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	if (fi && compat.next_oper->ftruncate)
+		return compat.next_oper->ftruncate(path, size, fi);
+	if (!compat.next_oper->truncate)
+		return -ENOSYS;
+	return compat.next_oper->truncate(path, size);
+}
+
+/* FUSE 2 resolved UTIME_NOW and UTIME_OMIT for backends without
+ * flag_utime_omit_ok, libfuse3 passes them on
+ */
+static int compat_utimens(const char *path, const struct timespec tv[2],
+						  struct fuse_file_info *fi)
+{
+	struct fs_operations *next = compat.next_oper;
+	struct timespec ts[2];
+	struct stat st;
+	int i, res;
+
+	if (!next->utimens && !next->utime)
+		return -ENOSYS;
+
+	ts[0] = tv[0];
+	ts[1] = tv[1];
+	if (!next->flag_utime_omit_ok)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			if (ts[i].tv_nsec == UTIME_NOW)
+				clock_gettime(CLOCK_REALTIME, &ts[i]);
+		}
+		if (ts[0].tv_nsec == UTIME_OMIT || ts[1].tv_nsec == UTIME_OMIT)
+		{
+			if ((res = compat_getattr(path, &st, fi)))
+				return res;
+			if (ts[0].tv_nsec == UTIME_OMIT)
+				ts[0] = st.st_atim;
+			if (ts[1].tv_nsec == UTIME_OMIT)
+				ts[1] = st.st_mtim;
+		}
+	}
+
+	if (next->utimens)
+		return next->utimens(path, ts);
+
+	struct utimbuf buf = {.actime = ts[0].tv_sec, .modtime = ts[1].tv_sec};
+	return next->utime(path, &buf);
+}
+
+/* With the writeback cache the kernel reads pages around partial writes and
+ * positions O_APPEND writes itself
+ */
+static void compat_writeback_flags(struct fuse_file_info *fi)
+{
+	if (!compat.writeback)
+		return;
+	if ((fi->flags & O_ACCMODE) == O_WRONLY)
+		fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+	fi->flags &= ~O_APPEND;
+}
+
+static int compat_open(const char *path, struct fuse_file_info *fi)
+{
+	compat_writeback_flags(fi);
+	return compat.next_oper->open(path, fi);
+}
+
+static int compat_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	compat_writeback_flags(fi);
+	return compat.next_oper->create(path, mode, fi);
+}
+
+static int compat_opendir(const char *path, struct fuse_file_info *fi)
+{
+	int res = compat.next_oper->opendir ? compat.next_oper->opendir(path, fi) : 0;
+
+	//listings stay in the page cache until the directory changes
+	if (!res && cache_dir_enabled())
+	{
+		fi->cache_readdir = 1;
+		fi->keep_cache = 1;
+	}
+	return res;
+}
+
+struct compat_fill
+{
+	void *buf;
+	fuse_fill_dir_t filler;
+	int plus;
+};
+
+/* only complete attributes may answer the lookups, see fill_dir_attr() */
+static int compat_filler(void *buf, const char *name,
+						 const struct stat *stbuf, off_t off)
+{
+	struct compat_fill *fill = buf;
+	enum fuse_fill_dir_flags flags = 0;
+
+	if (fill->plus && stbuf && fill_dir_has_attr() &&
+		strcmp(name, ".") && strcmp(name, ".."))
+		flags = FUSE_FILL_DIR_PLUS;
+	return fill->filler(fill->buf, name, stbuf, off, flags);
+}
+
+static int compat_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+						  off_t offset, struct fuse_file_info *fi,
+						  enum fuse_readdir_flags flags)
+{
+	struct compat_fill fill = {.buf = buf, .filler = filler,
+							   .plus = !!(flags & FUSE_READDIR_PLUS)};
+
+	return compat.next_oper->readdir(path, &fill, compat_filler, offset, fi);
+}
+
+#define COMPAT_PASS(op) compat_oper.op = oper->op
+#define COMPAT_WRAP(op) compat_oper.op = oper->op ? compat_##op : NULL
+
+struct fuse_operations *compat_wrap(struct fs_operations *oper)
+{
+	compat.next_oper = oper;
+
+	memset(&compat_oper, 0, sizeof(struct fuse_operations));
+	compat_oper.init = compat_init;
+	compat_oper.destroy = compat_destroy;
+	compat_oper.opendir = compat_opendir;
+	COMPAT_WRAP(getattr);
+	COMPAT_WRAP(rename);
+	COMPAT_WRAP(chmod);
+	COMPAT_WRAP(chown);
+	compat_oper.truncate = oper->truncate || oper->ftruncate ? compat_truncate : NULL;
+	compat_oper.utimens = oper->utimens || oper->utime ? compat_utimens : NULL;
+	COMPAT_WRAP(open);
+	COMPAT_WRAP(create);
+	COMPAT_WRAP(readdir);
+	COMPAT_PASS(readlink);
+	COMPAT_PASS(mknod);
+	COMPAT_PASS(mkdir);
+	COMPAT_PASS(unlink);
+	COMPAT_PASS(rmdir);
+	COMPAT_PASS(symlink);
+	COMPAT_PASS(link);
+	COMPAT_PASS(read);
+	COMPAT_PASS(write);
+	COMPAT_PASS(statfs);
+	COMPAT_PASS(flush);
+	COMPAT_PASS(release);
+	COMPAT_PASS(fsync);
+	COMPAT_PASS(setxattr);
+	COMPAT_PASS(getxattr);
+	COMPAT_PASS(listxattr);
+	COMPAT_PASS(removexattr);
+	COMPAT_PASS(releasedir);
+	COMPAT_PASS(fsyncdir);
+	COMPAT_PASS(access);
+	COMPAT_PASS(lock);
+	COMPAT_PASS(write_buf);
+	COMPAT_PASS(read_buf);
+	COMPAT_PASS(flock);
+	COMPAT_PASS(fallocate);
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+	COMPAT_PASS(copy_file_range);
+#endif
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+	COMPAT_PASS(lseek);
+#endif
+
+	return &compat_oper;
+}
+
+static const struct fuse_opt compat_opt_spec[] = {
+	{"writeback_cache=%u", offsetof(struct compat_opts, writeback), 0},
+	{"max_pages=%u", offsetof(struct compat_opts, max_pages), 0},
+	FUSE_OPT_END};
+
+int compat_parse_options(struct fuse_args *args, int writeback)
+{
+	compat_opts.writeback = writeback;
+	if (fuse_opt_parse(args, &compat_opts, compat_opt_spec, NULL) == -1)
+		return -1;
+	if (!compat_opts.max_pages || compat_opts.max_pages > COMPAT_MAX_PAGES)
+		compat_opts.max_pages = COMPAT_MAX_PAGES;
+	return 0;
+}
+
+#else
+
+/* the FUSE 2 kernel interface has no notifications from the high level API */
+void compat_invalidate(const char *path)
+{
+}
+
+#endif
@@ -0,0 +1,457 @@
+/*
+  fusenfs-ctl module: control socket of a mount
+
+  With -o ctl_socket=PATH the daemon listens on a Unix socket at PATH,
+  usable by its owner (and root) only. A client, fusenfsctl, sends one
+  command line and reads the reply until the daemon closes the connection;
+  the reply ends with a line "ok" or "error: <reason>".
+
+    stats		counters and settings of the caches, the buffer pool,
+    			the warm-up and the backend
+    drop PREFIX		forget what is cached of PREFIX and everything below
+    			it, in fusenfs and in the kernel
+    set OPT[,OPT...]	change options as with -o while mounted
+    flush		write back dirty data: the kernel's pages, then what
+    			the backend buffers
+    reconnect		connect lost servers or sessions again right away
+
+  Commands are served one at a time by a thread of their own. Those that
+  need the backend thread, e.g. the single threaded nfs backend, are left
+  to it and completed with a call through the mount point.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _GNU_SOURCE
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fusenfs.h"
+#include "iobuf.h"
+
+#define CTL_LINE_MAX 4096
+#define CTL_REPLY_MAX 16384
+//a client that does not send its command in time is dropped
+#define CTL_RECV_TIMEOUT_SECS 5
+
+struct ctl
+{
+	char *path;
+	char *mountpoint;
+	struct fs_operations *next_oper;
+	const struct ctl_backend *backend;
+
+	int fd;
+	int stop;
+	int started;
+	pthread_t thread;
+};
+
+static struct ctl ctl = {
+	.fd = -1,
+};
+
+static struct fs_operations ctl_oper;
+
+//options of set handled here, parsed into a fresh copy each time
+struct ctl_set
+{
+	char *logfile;
+};
+
+static const struct fuse_opt ctl_set_opts[] = {
+	{"logfile=%s", offsetof(struct ctl_set, logfile), 0},
+	FUSE_OPT_END};
+
+static const char ctl_help[] =
+	"stats			counters and settings\n"
+	"drop PREFIX		forget the cached attributes, listings and pages below PREFIX\n"
+	"set OPT[,OPT...]	change options while mounted:\n"
+	"			  cache_timeout, cache_stat_timeout, cache_dir_timeout,\n"
+	"			  cache_link_timeout, cache_negative_timeout,\n"
+	"			  deadline, deadline_meta, deadline_read, deadline_write,\n"
+	"			  logfile (empty stops logging),\n"
+	"			  nfs_readahead, nfs_hedge, nfs_hedge_budget,\n"
+	"			  smb_small_file, smb_handle_timeout\n"
+	"flush			write back dirty data\n"
+	"reconnect		connect lost servers or sessions again now\n";
+
+void ctl_backend(const struct ctl_backend *backend)
+{
+	ctl.backend = backend;
+}
+
+/* "name: " and the line a module's stats give, appended to buf */
+static void ctl_stats_line(char *buf, size_t size, const char *name,
+						   int (*stats)(char *, size_t))
+{
+	char line[1024], *s = line;
+	size_t len = strlen(buf);
+
+	if (stats(line, sizeof(line)) < 0)
+		line[0] = '\0';
+	line[strcspn(line, "\n")] = '\0';
+	while (*s == ' ')
+		s++;
+	if (len < size)
+		snprintf(buf + len, size - len, "%s: %s\n", name, s);
+}
+
+static int ctl_stats(char *buf, size_t size)
+{
+	size_t len;
+
+	ctl_stats_line(buf, size, "cache", cache_stats);
+	ctl_stats_line(buf, size, "iobuf", iobuf_stats);
+	ctl_stats_line(buf, size, "warmup", warm_stats);
+	ctl_stats_line(buf, size, "deadline", deadline_stats);
+	//the backend's lines carry their own names
+	if (ctl.backend && ctl.backend->stats && (len = strlen(buf)) < size - 1)
+		ctl.backend->stats(buf + len, size - len);
+	return 0;
+}
+
+/* The new name is used by the next LOG. The old one is left allocated: a
+ * LOG of another thread may be opening it right now.
+ */
+static void ctl_logfile(char *logfile)
+{
+	if (!*logfile)
+	{
+		free(logfile);
+		logfile = NULL;
+	}
+	__atomic_store_n(&d.logfile, logfile, __ATOMIC_RELEASE);
+}
+
+/* opts in -o syntax go through every table that can change while mounted,
+ * any left over is not known or cannot change on this mount. Only
+ * apply stores what was parsed, so a bad option leaves all as they were.
+ */
+static int ctl_tune(const char *opts, struct ctl_set *set, int apply, char *reply, size_t size)
+{
+	char *argv[] = {"fusenfsctl", "-o", (char *)opts, NULL};
+	struct fuse_args args = FUSE_ARGS_INIT(3, argv);
+	int res = 0;
+
+	if (fuse_opt_parse(&args, set, ctl_set_opts, NULL) == -1 ||
+		cache_tune(&args, apply) == -1 || deadline_tune(&args, apply) == -1 ||
+		(ctl.backend && ctl.backend->tune && ctl.backend->tune(&args, apply) == -1))
+	{
+		snprintf(reply, size, "invalid value, nothing changed\n");
+		res = -EINVAL;
+	}
+	else if (args.argc > 1)
+	{
+		snprintf(reply, size, "not changeable on this mount: %s, nothing changed\n",
+				 args.argv[args.argc - 1]);
+		res = -EINVAL;
+	}
+	fuse_opt_free_args(&args);
+	return res;
+}
+
+static int ctl_set(const char *opts, char *reply, size_t size)
+{
+	struct ctl_set set = {NULL}, again = {NULL};
+	int res;
+
+	//every option is checked before any is applied
+	if (!(res = ctl_tune(opts, &set, 0, reply, size)))
+		res = ctl_tune(opts, &again, 1, reply, size);
+	free(again.logfile);
+
+	if (!res && set.logfile)
+		ctl_logfile(set.logfile);
+	else
+		free(set.logfile);
+	LOG("ctl: set %s%s\n", opts, res ? " failed" : "");
+	return res;
+}
+
+/* a call the backend serves, for the work it was left */
+static int ctl_call(void)
+{
+	struct statvfs st;
+
+	if (!ctl.mountpoint || statvfs(ctl.mountpoint, &st) < 0)
+		return -errno;
+	return 0;
+}
+
+static int ctl_flush(void)
+{
+	int fd, res = 0;
+
+	//dirty kernel pages (writeback cache) reach the backend first
+	if (!ctl.mountpoint || (fd = open(ctl.mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -errno;
+	if (syncfs(fd) < 0)
+		res = -errno;
+	close(fd);
+	if (!res && ctl.backend && ctl.backend->flush)
+		res = ctl.backend->flush();
+	return res;
+}
+
+static int ctl_reconnect(void)
+{
+	int res;
+
+	if (!ctl.backend || !ctl.backend->reconnect)
+		return -ENOTSUP;
+	if ((res = ctl.backend->reconnect()) < 0)
+		return res;
+	return ctl_call();
+}
+
+/* runs the command of line, the output goes to reply */
+static int ctl_command(char *line, char *reply, size_t size)
+{
+	char *arg = strchr(line, ' ');
+
+	if (arg)
+	{
+		*arg++ = '\0';
+		while (*arg == ' ')
+			arg++;
+	}
+	if (!strcmp(line, "help"))
+	{
+		snprintf(reply, size, "%s", ctl_help);
+		return 0;
+	}
+	if (!strcmp(line, "stats"))
+		return ctl_stats(reply, size);
+	if (!strcmp(line, "drop"))
+	{
+		if (!arg || *arg != '/')
+			return -EINVAL;
+		LOG("ctl: drop [%s]\n", arg);
+		cache_drop(arg);
+		return 0;
+	}
+	if (!strcmp(line, "set"))
+		return arg && *arg ? ctl_set(arg, reply, size) : -EINVAL;
+	if (!strcmp(line, "flush"))
+		return ctl_flush();
+	if (!strcmp(line, "reconnect"))
+	{
+		LOG("ctl: reconnect\n");
+		return ctl_reconnect();
+	}
+	snprintf(reply, size, "unknown command, try help\n");
+	return -EINVAL;
+}
+
+//a client gone meanwhile must not raise SIGPIPE
+static void ctl_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len && ((n = send(fd, buf, len, MSG_NOSIGNAL)) > 0 || (n < 0 && errno == EINTR)))
+		if (n > 0)
+			buf += n, len -= n;
+}
+
+static void ctl_serve(int fd)
+{
+	static char reply[CTL_REPLY_MAX];
+	char line[CTL_LINE_MAX], *end;
+	struct timeval tv = {CTL_RECV_TIMEOUT_SECS, 0};
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	size_t len = 0, rlen;
+	ssize_t n;
+	int res;
+
+	//the socket file is 0600, the check also covers the time before its chmod
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 ||
+		(cred.uid && cred.uid != getuid()))
+	{
+		ctl_write(fd, "error: permission denied\n", 25);
+		return;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (len < sizeof(line) - 1 && !memchr(line, '\n', len) &&
+		   ((n = read(fd, line + len, sizeof(line) - 1 - len)) > 0 || (n < 0 && errno == EINTR)))
+		if (n > 0)
+			len += n;
+	line[len] = '\0';
+	if ((end = strchr(line, '\n')))
+		*end = '\0';
+	if ((len = strlen(line)) && line[len - 1] == '\r')
+		line[len - 1] = '\0';
+
+	reply[0] = '\0';
+	res = ctl_command(line, reply, sizeof(reply) - 64);
+	rlen = strlen(reply);
+	if (!res)
+		rlen += snprintf(reply + rlen, sizeof(reply) - rlen, "ok\n");
+	else
+		rlen += snprintf(reply + rlen, sizeof(reply) - rlen, "error: %s\n", strerror(-res));
+	ctl_write(fd, reply, rlen);
+}
+
+static void *ctl_thread(void *arg)
+{
+	int fd;
+
+	for (;;)
+	{
+		fd = accept(ctl.fd, NULL, NULL);
+		if (__atomic_load_n(&ctl.stop, __ATOMIC_ACQUIRE))
+		{
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			LOG("ctl: accept failed, %s\n", strerror(errno));
+			break;
+		}
+		ctl_serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* a socket file nobody listens on is left over from an earlier mount */
+static int ctl_stale(const struct sockaddr_un *addr)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), stale;
+
+	if (fd < 0)
+		return 0;
+	stale = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno == ECONNREFUSED;
+	close(fd);
+	return stale && !unlink(addr->sun_path);
+}
+
+static int ctl_listen(void)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int fd, res;
+
+	if (strlen(ctl.path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, ctl.path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -errno;
+
+	res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (res < 0 && errno == EADDRINUSE && ctl_stale(&addr))
+		res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (res < 0 || chmod(ctl.path, 0600) < 0 || listen(fd, 8) < 0)
+	{
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	ctl.fd = fd;
+	return 0;
+}
+
+/* the thread has to be created after fuse_main() daemonized */
+static void *ctl_init(struct fuse_conn_info *conn)
+{
+	void *private_data = ctl.next_oper->init ? ctl.next_oper->init(conn) : NULL;
+	int res = ctl_listen();
+
+	if (res < 0)
+		LOG("ctl: no control socket at [%s], %s\n", ctl.path, strerror(-res));
+	else if (!(ctl.started = !pthread_create(&ctl.thread, NULL, ctl_thread, NULL)))
+		LOG("ctl: failed to start the control thread\n");
+	else
+		LOG("ctl: listening at [%s]\n", ctl.path);
+	return private_data;
+}
+
+static void ctl_destroy(void *private_data)
+{
+	//a command being served is waited for, its client has to send in time
+	if (ctl.fd >= 0)
+	{
+		__atomic_store_n(&ctl.stop, 1, __ATOMIC_RELEASE);
+		shutdown(ctl.fd, SHUT_RDWR);
+		if (ctl.started)
+			pthread_join(ctl.thread, NULL);
+		close(ctl.fd);
+		ctl.fd = -1;
+		unlink(ctl.path);
+	}
+
+	if (ctl.next_oper->destroy)
+		ctl.next_oper->destroy(private_data);
+}
+
+struct fs_operations *ctl_wrap(struct fs_operations *oper)
+{
+	if (!ctl.path)
+		return oper;
+
+	ctl.next_oper = oper;
+	ctl_oper = *oper;
+	ctl_oper.init = ctl_init;
+	ctl_oper.destroy = ctl_destroy;
+	return &ctl_oper;
+}
+
+static const struct fuse_opt ctl_opts[] = {
+	{"ctl_socket=%s", offsetof(struct ctl, path), 0},
+	FUSE_OPT_END};
+
+//flush and reconnect go through the mount point, made absolute before fuse changes directory
+static int ctl_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	if (key == FUSE_OPT_KEY_NONOPT && !ctl.mountpoint)
+		ctl.mountpoint = realpath(arg, NULL);
+	return 1;
+}
+
+int ctl_parse_options(struct fuse_args *args)
+{
+	char cwd[PATH_MAX], *path;
+
+	if (fuse_opt_parse(args, &ctl, ctl_opts, ctl_opt_proc) == -1)
+		return -1;
+	//the socket is created once fuse_main() changed to /
+	if (ctl.path && ctl.path[0] != '/')
+	{
+		if (!getcwd(cwd, sizeof(cwd)) || !(path = malloc(strlen(cwd) + strlen(ctl.path) + 2)))
+			return -1;
+		sprintf(path, "%s/%s", cwd, ctl.path);
+		free(ctl.path);
+		ctl.path = path;
+	}
+	return 0;
+}
@@ -0,0 +1,346 @@
+/*
+  fusenfs-lazy module: mount first, connect to the server in the background
+
+  With lazy_mount the backend only checks its url before fuse_main, the
+  mount point appears at once and a thread started from init() does the
+  handshake, retrying until it succeeds. Operations arriving meanwhile wait
+  for the session, up to lazy_timeout seconds after the mount.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "fusenfs.h"
+
+#define LAZY_DEFAULT_TIMEOUT_SECS 30
+#define LAZY_RETRY_MAX_SECS 30
+
+enum lazy_state
+{
+	LAZY_CONNECTING,
+	LAZY_READY,
+	LAZY_STOPPED,
+};
+
+struct lazy
+{
+	unsigned int on;
+	unsigned int timeout_secs;
+	int (*connect)(void);
+	struct fs_operations *next_oper;
+	//capabilities seen by init(), handed to the backend once connected
+	struct fuse_conn_info conn;
+	struct timespec deadline;
+	pthread_t thread;
+	int thread_started;
+	int inited;
+	enum lazy_state state;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static struct lazy lazy = {
+	.timeout_secs = LAZY_DEFAULT_TIMEOUT_SECS,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct fs_operations lazy_oper;
+
+static void lazy_after(struct timespec *ts, unsigned int secs)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += secs;
+}
+
+/* 0 once the backend is connected, -ETIMEDOUT when lazy_timeout ran out
+ * first; the connection keeps being retried and later calls succeed.
+ */
+static int lazy_wait(void)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&lazy.lock);
+	while (lazy.state == LAZY_CONNECTING && res != ETIMEDOUT)
+		res = pthread_cond_timedwait(&lazy.cond, &lazy.lock, &lazy.deadline);
+	res = lazy.state == LAZY_READY ? 0 : lazy.state == LAZY_STOPPED ? -ENOTCONN : -ETIMEDOUT;
+	pthread_mutex_unlock(&lazy.lock);
+	return res;
+}
+
+static void *lazy_connector(void *arg)
+{
+	unsigned int retry = 1;
+	struct timespec ts;
+
+	for (;;)
+	{
+		int res = lazy.connect();
+
+		pthread_mutex_lock(&lazy.lock);
+		if (lazy.state == LAZY_STOPPED)
+			break;
+		if (!res)
+		{
+			//engines and helper threads of the backend start now
+			pthread_mutex_unlock(&lazy.lock);
+			if (lazy.next_oper->init)
+				lazy.next_oper->init(&lazy.conn);
+			pthread_mutex_lock(&lazy.lock);
+			lazy.inited = 1;
+			if (lazy.state != LAZY_STOPPED)
+				lazy.state = LAZY_READY;
+			pthread_cond_broadcast(&lazy.cond);
+			break;
+		}
+
+		LOG("lazy mount: connecting failed (%d), retrying in %u s\n", res, retry);
+		lazy_after(&ts, retry);
+		while (lazy.state != LAZY_STOPPED &&
+			   pthread_cond_timedwait(&lazy.cond, &lazy.lock, &ts) != ETIMEDOUT)
+			;
+		if (lazy.state == LAZY_STOPPED)
+			break;
+		pthread_mutex_unlock(&lazy.lock);
+		if ((retry *= 2) > LAZY_RETRY_MAX_SECS)
+			retry = LAZY_RETRY_MAX_SECS;
+	}
+	pthread_mutex_unlock(&lazy.lock);
+	return NULL;
+}
+
+static void *lazy_init(struct fuse_conn_info *conn)
+{
+	pthread_condattr_t attr;
+
+	lazy.conn = *conn;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&lazy.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	lazy_after(&lazy.deadline, lazy.timeout_secs);
+	lazy.thread_started = !pthread_create(&lazy.thread, NULL, lazy_connector, NULL);
+	if (!lazy.thread_started)
+	{
+		LOG("lazy mount: failed to start the connecting thread\n");
+		lazy.state = LAZY_STOPPED;
+	}
+	LOG("lazy mount: mounted, connecting in the background\n");
+	return NULL;
+}
+
+static void lazy_destroy(void *private_data)
+{
+	//a connect in progress is waited for, it ends at the backend's own timeout
+	pthread_mutex_lock(&lazy.lock);
+	lazy.state = LAZY_STOPPED;
+	pthread_cond_broadcast(&lazy.cond);
+	pthread_mutex_unlock(&lazy.lock);
+	if (lazy.thread_started)
+		pthread_join(lazy.thread, NULL);
+
+	if (lazy.inited && lazy.next_oper->destroy)
+		lazy.next_oper->destroy(private_data);
+}
+
+/* only the calls that can reach the backend first are held, anything with
+ * an open file or directory behind it already went through one of these
+ */
+#define LAZY_CALL(op, ...)                                  \
+	do                                                      \
+	{                                                       \
+		int res = lazy_wait();                              \
+		return res ? res : lazy.next_oper->op(__VA_ARGS__); \
+	} while (0)
+
+static int lazy_getattr(const char *path, struct stat *stbuf)
+{
+	LAZY_CALL(getattr, path, stbuf);
+}
+
+static int lazy_access(const char *path, int mask)
+{
+	LAZY_CALL(access, path, mask);
+}
+
+static int lazy_readlink(const char *path, char *buf, size_t size)
+{
+	LAZY_CALL(readlink, path, buf, size);
+}
+
+static int lazy_opendir(const char *path, struct fuse_file_info *fi)
+{
+	LAZY_CALL(opendir, path, fi);
+}
+
+static int lazy_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	LAZY_CALL(mknod, path, mode, rdev);
+}
+
+static int lazy_mkdir(const char *path, mode_t mode)
+{
+	LAZY_CALL(mkdir, path, mode);
+}
+
+static int lazy_unlink(const char *path)
+{
+	LAZY_CALL(unlink, path);
+}
+
+static int lazy_rmdir(const char *path)
+{
+	LAZY_CALL(rmdir, path);
+}
+
+static int lazy_symlink(const char *from, const char *to)
+{
+	LAZY_CALL(symlink, from, to);
+}
+
+static int lazy_rename(const char *from, const char *to)
+{
+	LAZY_CALL(rename, from, to);
+}
+
+static int lazy_link(const char *from, const char *to)
+{
+	LAZY_CALL(link, from, to);
+}
+
+static int lazy_chmod(const char *path, mode_t mode)
+{
+	LAZY_CALL(chmod, path, mode);
+}
+
+static int lazy_chown(const char *path, uid_t uid, gid_t gid)
+{
+	LAZY_CALL(chown, path, uid, gid);
+}
+
+static int lazy_truncate(const char *path, off_t size)
+{
+	LAZY_CALL(truncate, path, size);
+}
+
+static int lazy_utime(const char *path, struct utimbuf *buf)
+{
+	LAZY_CALL(utime, path, buf);
+}
+
+static int lazy_utimens(const char *path, const struct timespec ts[2])
+{
+	LAZY_CALL(utimens, path, ts);
+}
+
+static int lazy_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	LAZY_CALL(create, path, mode, fi);
+}
+
+static int lazy_open(const char *path, struct fuse_file_info *fi)
+{
+	LAZY_CALL(open, path, fi);
+}
+
+static int lazy_statfs(const char *path, struct statvfs *stbuf)
+{
+	LAZY_CALL(statfs, path, stbuf);
+}
+
+static int lazy_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	LAZY_CALL(setxattr, path, name, value, size, flags);
+}
+
+static int lazy_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	LAZY_CALL(getxattr, path, name, value, size);
+}
+
+static int lazy_listxattr(const char *path, char *list, size_t size)
+{
+	LAZY_CALL(listxattr, path, list, size);
+}
+
+static int lazy_removexattr(const char *path, const char *name)
+{
+	LAZY_CALL(removexattr, path, name);
+}
+
+#define LAZY_WRAP(op) lazy_oper.op = oper->op ? lazy_##op : NULL
+
+struct fs_operations *lazy_wrap(struct fs_operations *oper)
+{
+	if (!lazy.on || !lazy.connect)
+		return oper;
+
+	lazy.next_oper = oper;
+	lazy_oper = *oper;
+	lazy_oper.init = lazy_init;
+	lazy_oper.destroy = lazy_destroy;
+	LAZY_WRAP(getattr);
+	LAZY_WRAP(access);
+	LAZY_WRAP(readlink);
+	LAZY_WRAP(opendir);
+	LAZY_WRAP(mknod);
+	LAZY_WRAP(mkdir);
+	LAZY_WRAP(unlink);
+	LAZY_WRAP(rmdir);
+	LAZY_WRAP(symlink);
+	LAZY_WRAP(rename);
+	LAZY_WRAP(link);
+	LAZY_WRAP(chmod);
+	LAZY_WRAP(chown);
+	LAZY_WRAP(truncate);
+	LAZY_WRAP(utime);
+	LAZY_WRAP(utimens);
+	LAZY_WRAP(create);
+	LAZY_WRAP(open);
+	LAZY_WRAP(statfs);
+	LAZY_WRAP(setxattr);
+	LAZY_WRAP(getxattr);
+	LAZY_WRAP(listxattr);
+	LAZY_WRAP(removexattr);
+	return &lazy_oper;
+}
+
+/* the backend's handshake: run now, or deferred to init() with lazy_mount */
+int lazy_connect(int (*connect)(void))
+{
+	if (!lazy.on)
+		return connect();
+	lazy.connect = connect;
+	return 0;
+}
+
+static const struct fuse_opt lazy_opts[] = {
+	{"lazy_mount", offsetof(struct lazy, on), 1},
+	{"lazy_timeout=%u", offsetof(struct lazy, timeout_secs), 0},
+	FUSE_OPT_END};
+
+int lazy_parse_options(struct fuse_args *args)
+{
+	return fuse_opt_parse(args, &lazy, lazy_opts, NULL);
+}
@@ -6,12 +6,15 @@
   See the file COPYING.LIB
 */
 
-#define FUSE_USE_VERSION 26
-
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
+//a libfuse3 build gets FUSE_USE_VERSION 31 from config.h
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
 #include <fuse_merge.h>
 #include <fuse.h>
 #include <stdio.h>
@@ -36,16 +39,21 @@
 #include <win32/win32_compat.h>
 #endif
 
+#include "fusenfs.h"
+#include "iobuf.h"
+
 struct nfsdata d;
 int _env_init_smb(struct nfsdata *_d, struct fuse_args *args);
 int _env_init_bind(struct nfsdata *_d, struct fuse_args *args);
 
 void LOG(const char *__restrict __fmt, ...)
 {
-	if (!d.logfile)
+	//the control socket may switch it meanwhile
+	const char *logfile = __atomic_load_n(&d.logfile, __ATOMIC_ACQUIRE);
+	if (!logfile)
 		return;
 
-	FILE *fh = fopen(d.logfile, "a+");
+	FILE *fh = fopen(logfile, "a+");
 	if (!fh)
 		return;
 
@@ -62,6 +70,70 @@ void LOG(const char *__restrict __fmt, ...)
 	fclose(fh);
 }
 
+/* Deadlines in ms of the calls to the server, 0 waits forever and -1
+ * keeps the backend's own timeout (nfs_timeout, the smb url's timeout=).
+ * The control socket changes them while mounted, so they are read and
+ * stored atomically.
+ */
+struct deadlines
+{
+	int all;
+	int meta;
+	int read;
+	int write;
+};
+
+static struct deadlines deadlines = {-1, -1, -1, -1};
+
+int deadline_ms(enum deadline_class c)
+{
+	int *p = c == DEADLINE_READ ? &deadlines.read : c == DEADLINE_WRITE ? &deadlines.write : &deadlines.meta;
+	int ms = __atomic_load_n(p, __ATOMIC_RELAXED);
+	return ms < 0 ? __atomic_load_n(&deadlines.all, __ATOMIC_RELAXED) : ms;
+}
+
+static const struct fuse_opt deadline_opts[] = {
+	{"deadline=%d", offsetof(struct deadlines, all), 0},
+	{"deadline_meta=%d", offsetof(struct deadlines, meta), 0},
+	{"deadline_read=%d", offsetof(struct deadlines, read), 0},
+	{"deadline_write=%d", offsetof(struct deadlines, write), 0},
+	FUSE_OPT_END};
+
+int deadline_parse_options(struct fuse_args *args)
+{
+	return fuse_opt_parse(args, &deadlines, deadline_opts, NULL);
+}
+
+/* while mounted: parsed into a copy, stored only when apply is set */
+int deadline_tune(struct fuse_args *args, int apply)
+{
+	struct deadlines t;
+
+	t.all = __atomic_load_n(&deadlines.all, __ATOMIC_RELAXED);
+	t.meta = __atomic_load_n(&deadlines.meta, __ATOMIC_RELAXED);
+	t.read = __atomic_load_n(&deadlines.read, __ATOMIC_RELAXED);
+	t.write = __atomic_load_n(&deadlines.write, __ATOMIC_RELAXED);
+	if (fuse_opt_parse(args, &t, deadline_opts, NULL) == -1)
+		return -1;
+	if (apply)
+	{
+		__atomic_store_n(&deadlines.all, t.all, __ATOMIC_RELAXED);
+		__atomic_store_n(&deadlines.meta, t.meta, __ATOMIC_RELAXED);
+		__atomic_store_n(&deadlines.read, t.read, __ATOMIC_RELAXED);
+		__atomic_store_n(&deadlines.write, t.write, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+int deadline_stats(char *buf, size_t size)
+{
+	return snprintf(buf, size, "all=%d meta=%d read=%d write=%d",
+					__atomic_load_n(&deadlines.all, __ATOMIC_RELAXED),
+					__atomic_load_n(&deadlines.meta, __ATOMIC_RELAXED),
+					__atomic_load_n(&deadlines.read, __ATOMIC_RELAXED),
+					__atomic_load_n(&deadlines.write, __ATOMIC_RELAXED));
+}
+
 #ifdef __MINGW32__
 gid_t getgid()
 {
@@ -106,6 +178,107 @@ static gid_t map_reverse_gid(gid_t possible_gid)
 	return possible_gid;
 }
 
+//the uid/gid of the rpc credentials show as the user asking
+static void nfs_owner(struct stat *stbuf)
+{
+	stbuf->st_uid = map_uid(stbuf->st_uid);
+	stbuf->st_gid = map_gid(stbuf->st_gid);
+}
+
+static struct
+{
+	void (*map)(struct stat *stbuf);
+	struct fs_operations *next_oper;
+} owner;
+static struct fs_operations owner_oper;
+
+//set while the filler is handed complete attributes
+static __thread int fill_attr;
+
+int fill_dir_attr(fs_fill_dir_t filler, void *buf, const char *name,
+				  const struct stat *stbuf, off_t off)
+{
+	int old = fill_attr, res;
+
+	fill_attr = 1;
+	res = filler(buf, name, stbuf, off);
+	fill_attr = old;
+	return res;
+}
+
+int fill_dir_has_attr(void)
+{
+	return fill_attr;
+}
+
+void owner_map(void (*map)(struct stat *stbuf))
+{
+	owner.map = map;
+}
+
+static int owner_getattr(const char *path, struct stat *stbuf)
+{
+	int err = owner.next_oper->getattr(path, stbuf);
+	if (!err)
+		owner.map(stbuf);
+	return err;
+}
+
+static int owner_fgetattr(const char *path, struct stat *stbuf,
+						  struct fuse_file_info *fi)
+{
+	int err = owner.next_oper->fgetattr(path, stbuf, fi);
+	if (!err)
+		owner.map(stbuf);
+	return err;
+}
+
+struct owner_fill
+{
+	void *buf;
+	fs_fill_dir_t filler;
+};
+
+static int owner_filler(void *buf, const char *name,
+						const struct stat *stbuf, off_t off)
+{
+	struct owner_fill *fill = buf;
+	struct stat st;
+
+	if (!stbuf || !fill_attr)
+		return fill->filler(fill->buf, name, stbuf, off);
+	st = *stbuf;
+	owner.map(&st);
+	return fill->filler(fill->buf, name, &st, off);
+}
+
+static int owner_readdir(const char *path, void *buf, fs_fill_dir_t filler,
+						 off_t offset, struct fuse_file_info *fi)
+{
+	struct owner_fill fill = {.buf = buf, .filler = filler};
+
+	return owner.next_oper->readdir(path, &fill, owner_filler, offset, fi);
+}
+
+/* sits right above the cache, so that what it keeps is the same for everyone */
+struct fs_operations *owner_wrap(struct fs_operations *oper)
+{
+	if (!owner.map)
+		return oper;
+
+	owner.next_oper = oper;
+	owner_oper = *oper;
+	if (oper->getattr)
+		owner_oper.getattr = owner_getattr;
+	if (oper->fgetattr)
+		owner_oper.fgetattr = owner_fgetattr;
+	if (oper->readdir)
+		owner_oper.readdir = owner_readdir;
+	return &owner_oper;
+}
+
+static void nfs_context_broken(struct nfs_context *nfs);
+
 static void wait_for_nfs_reply(struct nfs_context *nfs, struct sync_cb_data *cb_data)
 {
 	struct pollfd pfd;
@@ -119,6 +292,9 @@ static void wait_for_nfs_reply(struct nfs_context *nfs, struct sync_cb_data *cb_
 		pfd.revents = 0;
 
 		ret = poll(&pfd, 1, 100);
+		//a signal, e.g. an interrupt with -o intr, is no error of the socket
+		if (ret < 0 && errno == EINTR)
+			continue;
 		if (ret < 0)
 			revents = -1;
 		else
@@ -128,6 +304,7 @@ static void wait_for_nfs_reply(struct nfs_context *nfs, struct sync_cb_data *cb_
 		if (ret < 0)
 		{
 			cb_data->status = -EIO;
+			nfs_context_broken(nfs);
 			break;
 		}
 	}
@@ -144,12 +321,388 @@ static void generic_cb(int status, struct nfs_context *nfs, void *data, void *pr
 /* Update the rpc credentials to the current user unless
  * have are overriding the credentials via url arguments.
  */
-static void update_rpc_credentials()
+static void update_rpc_credentials(struct nfs_context *nfs)
 {
 	struct fuse_context *ctx = fuse_get_context();
 	uid_t uid = d.custom_uid == -1U ? ctx->uid : d.custom_uid;
 	gid_t gid = d.custom_gid == -1U ? ctx->gid : d.custom_gid;
-	nfs_set_uid_gid(d.nfs, uid, gid);
+	nfs_set_uid_gid(nfs, uid, gid);
+}
+
+/* Replicas: the fsname may list several servers exporting the same data,
+ * nfs://srv1+srv2+srv3/export. Calls that only read (getattr, readdir,
+ * readlink, statfs, opens for reading and their reads) go to one of them
+ * picked by latency and move to another one when it stops answering.
+ * Everything that modifies goes to the first server still up, d.nfs.
+ * The backend runs single threaded (-s), nothing here is locked.
+ */
+#define NFS_MAX_REPLICAS 8
+//seconds a failed server stays out before it is tried again
+#define NFS_REPLICA_RETRY_SECS 30
+//rpc timeout with several servers, so that a dead one is noticed
+#define NFS_REPLICA_TIMEOUT_MS 5000
+#define NFS_REPLICA_RTT_US 1000
+
+struct nfs_replica
+{
+	struct nfs_context *nfs;
+	struct nfs_url *urls;
+	char *url;
+	//smoothed latency of the calls sent to it
+	uint64_t rtt_us;
+	//bumped when the context is replaced, handles of the older one are stale
+	unsigned int gen;
+	time_t retry_at;
+	int down;
+	int mounted;
+	//the connection broke and its context could not be replaced yet
+	int broken;
+	//a mount of a fresh context running off the backend thread
+	struct nfs_revive *revive;
+};
+
+struct nfs_revive
+{
+	struct nfs_context *nfs;
+	struct nfs_url *urls;
+	pthread_t thread;
+	int res;
+	int done;
+};
+
+//fi->fh: the handle on the server it was opened on and, for reads, on others
+struct nfs_file
+{
+	char *path;
+	unsigned int home;
+	int rdonly;
+	struct nfsfh *fh[NFS_MAX_REPLICAS];
+	unsigned int gen[NFS_MAX_REPLICAS];
+	//hedged reads still in flight, released waits for the last one
+	unsigned int hedges;
+	int released;
+};
+
+static struct nfs_replica replicas[NFS_MAX_REPLICAS];
+static unsigned int nreplicas, primary;
+
+struct nfs_opts
+{
+	int timeout_ms;
+	//percentile of the read latency after which a read is duplicated
+	unsigned int hedge;
+	//percent of the reads that may be duplicated
+	unsigned int hedge_budget;
+	//libnfs readahead of the contexts, -1 leaves the url's readahead=
+	int readahead_kb;
+};
+
+static struct nfs_opts nfs_opts = {
+	.timeout_ms = -1,
+	.hedge_budget = 5,
+	.readahead_kb = -1,
+};
+
+/* requests of the control socket thread, carried out by the backend thread
+ * at its next call to a server
+ */
+#define NFS_CTL_READAHEAD 1
+#define NFS_CTL_RECONNECT 2
+static int nfs_ctl_pending;
+
+//rpc timeout of the contexts when no deadline applies
+static int nfs_base_timeout = -1;
+
+static int nfs_replica_context(struct nfs_replica *rp)
+{
+	if (!(rp->nfs = nfs_init_context()))
+		return -ENOMEM;
+	if (!(rp->urls = nfs_parse_url_dir(rp->nfs, rp->url)))
+	{
+		fprintf(stderr, "Failed to parse url : %s\n", nfs_get_error(rp->nfs));
+		nfs_destroy_context(rp->nfs);
+		rp->nfs = NULL;
+		return -EINVAL;
+	}
+	if (nfs_opts.timeout_ms > 0)
+		nfs_set_timeout(rp->nfs, nfs_opts.timeout_ms);
+	if (nfs_opts.readahead_kb >= 0)
+		nfs_set_readahead(rp->nfs, nfs_opts.readahead_kb * 1024U);
+	nfs_base_timeout = nfs_get_timeout(rp->nfs);
+	return 0;
+}
+
+/* libnfs stamps the timeout on a call when it is queued, so the deadline of
+ * its class is set right before; a call that runs out is failed by libnfs
+ * and a late reply is dropped with it, the cb_data on the stack is safe.
+ */
+static void nfs_deadline(struct nfs_context *nfs, enum deadline_class c)
+{
+	int ms = deadline_ms(c);
+
+	nfs_set_timeout(nfs, ms < 0 ? nfs_base_timeout : ms);
+}
+
+static int nfs_replica_mount(struct nfs_replica *rp)
+{
+	struct nfs_replica next = *rp;
+
+	update_rpc_credentials(rp->nfs);
+	if (!nfs_mount(rp->nfs, rp->urls->server, rp->urls->path))
+	{
+		rp->mounted = 1, rp->down = 0;
+		return 0;
+	}
+	fprintf(stderr, "Failed to mount nfs share : %s\n", nfs_get_error(rp->nfs));
+	LOG("Failed to mount nfs share %s : %s\n", rp->url, nfs_get_error(rp->nfs));
+
+	//a failed mount leaves the context unusable, the url arguments are set on a new one
+	if (!nfs_replica_context(&next))
+	{
+		nfs_destroy_url(rp->urls);
+		nfs_destroy_context(rp->nfs);
+		rp->nfs = next.nfs, rp->urls = next.urls;
+	}
+	rp->mounted = 0, rp->down = 1;
+	rp->retry_at = time(NULL) + NFS_REPLICA_RETRY_SECS;
+	return -EIO;
+}
+
+static void nfs_set_primary(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nreplicas && replicas[i].down; i++)
+		;
+	//with every server down the writes still need a live context
+	if (i == nreplicas)
+		i = primary;
+	else if (i != primary)
+		LOG("nfs: %s takes over the writes\n", replicas[i].url);
+	primary = i;
+	d.v_nfs = replicas[i].nfs, d.v_urls = replicas[i].urls;
+}
+
+/* A context whose connection broke is destroyed right away: the calls
+ * still pending on it belong to the waits that saw it break, whose frames
+ * are still there, and libnfs completes them as cancelled. Its handles go
+ * stale with the generation.
+ */
+static int nfs_replica_reset(struct nfs_replica *rp)
+{
+	struct nfs_replica next = *rp;
+
+	if (nfs_replica_context(&next))
+		return -ENOMEM;
+	nfs_destroy_url(rp->urls);
+	nfs_destroy_context(rp->nfs);
+	rp->nfs = next.nfs, rp->urls = next.urls;
+	rp->gen++, rp->broken = 0, rp->mounted = 0;
+	return 0;
+}
+
+static void nfs_replica_failed(unsigned int r, int broken)
+{
+	struct nfs_replica *rp = &replicas[r];
+
+	LOG("nfs: %s failed, %s\n", rp->url, broken ? "connection lost" : "not answering");
+	rp->down = 1;
+	rp->retry_at = time(NULL) + NFS_REPLICA_RETRY_SECS;
+	if (broken)
+	{
+		rp->broken = 1;
+		nfs_replica_reset(rp);
+	}
+	if (r == primary)
+		nfs_set_primary();
+}
+
+static void *nfs_revive_thread(void *data)
+{
+	struct nfs_revive *rv = data;
+
+	rv->res = nfs_mount(rv->nfs, rv->urls->server, rv->urls->path);
+	__atomic_store_n(&rv->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* The mount of a failed server runs on a context of its own in a thread,
+ * the backend keeps serving from the others meanwhile; the context is
+ * touched by nothing else until the thread is done.
+ */
+static void nfs_revive_start(struct nfs_replica *rp)
+{
+	struct nfs_replica next = *rp;
+	struct nfs_revive *rv = calloc(1, sizeof(struct nfs_revive));
+
+	if (!rv)
+		return;
+	if (nfs_replica_context(&next))
+	{
+		free(rv);
+		return;
+	}
+	rv->nfs = next.nfs, rv->urls = next.urls;
+	//the credentials of the call that noticed it is time
+	update_rpc_credentials(rv->nfs);
+	if (pthread_create(&rv->thread, NULL, nfs_revive_thread, rv))
+	{
+		nfs_destroy_url(rv->urls);
+		nfs_destroy_context(rv->nfs);
+		free(rv);
+		return;
+	}
+	rp->revive = rv;
+}
+
+/* the mounted context replaces the one of the failed server, returns 0 then */
+static int nfs_revive_finish(struct nfs_replica *rp)
+{
+	struct nfs_revive *rv = rp->revive;
+	int res;
+
+	pthread_join(rv->thread, NULL);
+	rp->revive = NULL;
+	if ((res = rv->res))
+	{
+		LOG("Failed to mount nfs share %s : %s\n", rp->url, nfs_get_error(rv->nfs));
+		nfs_destroy_url(rv->urls);
+		nfs_destroy_context(rv->nfs);
+	}
+	else
+	{
+		//nothing is pending on the old one, it was not picked while down
+		if (!rp->broken)
+			nfs_destroy_context(rp->nfs);
+		nfs_destroy_url(rp->urls);
+		rp->nfs = rv->nfs, rp->urls = rv->urls;
+		rp->gen++, rp->broken = 0, rp->mounted = 1;
+	}
+	free(rv);
+	return res;
+}
+
+/* failed servers are given another chance once their time is up */
+static void nfs_replica_revive(void)
+{
+	int ctl = __atomic_exchange_n(&nfs_ctl_pending, 0, __ATOMIC_ACQ_REL);
+	int readahead = __atomic_load_n(&nfs_opts.readahead_kb, __ATOMIC_RELAXED);
+	time_t now = time(NULL);
+	unsigned int i;
+
+	for (i = 0; i < nreplicas; i++)
+	{
+		struct nfs_replica *rp = &replicas[i];
+
+		if ((ctl & NFS_CTL_READAHEAD) && readahead >= 0)
+			nfs_set_readahead(rp->nfs, readahead * 1024U);
+		//asked to reconnect, the failed ones do not wait for their time
+		if ((ctl & NFS_CTL_RECONNECT) && !rp->revive)
+			rp->retry_at = now;
+		if (rp->revive)
+		{
+			if (!__atomic_load_n(&rp->revive->done, __ATOMIC_ACQUIRE))
+				continue;
+			if (nfs_revive_finish(rp))
+			{
+				rp->retry_at = now + NFS_REPLICA_RETRY_SECS;
+				continue;
+			}
+		}
+		else
+		{
+			if (!rp->down || now < rp->retry_at)
+				continue;
+			rp->retry_at = now + NFS_REPLICA_RETRY_SECS;
+			if (rp->broken && nfs_replica_reset(rp))
+				continue;
+			//the mount is waited for off the backend thread
+			if (!rp->mounted)
+			{
+				nfs_revive_start(rp);
+				continue;
+			}
+		}
+		rp->down = 0;
+		LOG("nfs: %s is back\n", rp->url);
+		//d.nfs of the primary itself has to follow a new context as well
+		if (i <= primary || replicas[primary].down)
+			nfs_set_primary();
+	}
+}
+
+/* a server up, weighted by the inverse of its latency; -1 if all are down */
+static int nfs_pick(void)
+{
+	uint64_t total = 0, w[NFS_MAX_REPLICAS], x;
+	unsigned int i;
+
+	nfs_replica_revive();
+	//the only server is tried again after a call ran out of time
+	if (nreplicas == 1)
+		return replicas[0].mounted && !replicas[0].broken ? 0 : -1;
+	for (i = 0; i < nreplicas; i++)
+		total += w[i] = replicas[i].down ? 0 : 1000000000ULL / (replicas[i].rtt_us + 1);
+	if (!total)
+		return -1;
+	x = (uint64_t)random() % total;
+	for (i = 0; x >= w[i]; i++)
+		x -= w[i];
+	return i;
+}
+
+static void nfs_clock(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+//the server of a context that stopped working is taken out
+static void nfs_context_broken(struct nfs_context *nfs)
+{
+	unsigned int i;
+
+	for (i = 0; i < nreplicas; i++)
+		if (replicas[i].nfs == nfs && !replicas[i].broken)
+			nfs_replica_failed(i, 1);
+}
+
+//rpc timeouts and i/o errors are the server's, not the call's
+static int nfs_server_error(int status)
+{
+	return status == -EIO || status == -EINTR || status == -ETIMEDOUT || status == -EFAULT;
+}
+
+static uint64_t nfs_elapsed_us(const struct timespec *start)
+{
+	struct timespec end;
+
+	nfs_clock(&end);
+	return (end.tv_sec - start->tv_sec) * 1000000ULL + (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void nfs_rtt_sample(unsigned int r, uint64_t us)
+{
+	replicas[r].rtt_us = (replicas[r].rtt_us * 7 + us) / 8;
+}
+
+/* Accounts for a read only call sent to replica r. Returns 1 when the
+ * server failed rather than the call: it is taken out and the call can go
+ * to another one.
+ */
+static int nfs_replica_check(unsigned int r, struct sync_cb_data *cb_data,
+							 const struct timespec *start)
+{
+	if (replicas[r].broken)
+		return 1;
+	if (nfs_server_error(cb_data->status))
+	{
+		//a connection that broke took it out already
+		if (!replicas[r].down)
+			nfs_replica_failed(r, 0);
+		return 1;
+	}
+	nfs_rtt_sample(r, nfs_elapsed_us(start));
+	return 0;
 }
 
 static void stat64_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
@@ -167,26 +720,39 @@ static int fuse_nfs_getattr(const char *path, struct stat *stbuf)
 {
 	struct nfs_stat_64 st;
 	struct sync_cb_data cb_data;
-	int ret;
+	struct timespec start;
+	unsigned int tries;
+	int ret, r;
 
 	LOG("fuse_nfs_getattr entered [%s]\n", path);
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	cb_data.return_data = &st;
-
-	ret = nfs_lstat64_async(d.nfs, path, stat64_cb, &cb_data);
-	if (ret < 0)
+	cb_data.status = -EIO;
+	for (tries = 0; tries < nreplicas && (r = nfs_pick()) >= 0; tries++)
 	{
-		return ret;
+		memset(&cb_data, 0, sizeof(struct sync_cb_data));
+		cb_data.return_data = &st;
+		nfs_clock(&start);
+
+		nfs_deadline(replicas[r].nfs, DEADLINE_META);
+		ret = nfs_lstat64_async(replicas[r].nfs, path, stat64_cb, &cb_data);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		wait_for_nfs_reply(replicas[r].nfs, &cb_data);
+		if (!nfs_replica_check(r, &cb_data, &start))
+			break;
 	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
+	if (cb_data.status < 0)
+		return cb_data.status;
 
 	stbuf->st_dev = st.nfs_dev;
 	stbuf->st_ino = st.nfs_ino;
 	stbuf->st_mode = st.nfs_mode;
 	stbuf->st_nlink = st.nfs_nlink;
-	stbuf->st_uid = map_uid(st.nfs_uid);
-	stbuf->st_gid = map_gid(st.nfs_gid);
+	stbuf->st_uid = st.nfs_uid;
+	stbuf->st_gid = st.nfs_gid;
 	stbuf->st_rdev = st.nfs_rdev;
 	stbuf->st_size = st.nfs_size;
 	stbuf->st_blksize = st.nfs_blksize;
@@ -226,154 +792,580 @@ static void readdir_cb(int status, struct nfs_context *nfs, void *data, void *pr
 	cb_data->return_data = data;
 }
 
-static int fuse_nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+static int fuse_nfs_readdir(const char *path, void *buf, fs_fill_dir_t filler,
 							off_t offset, struct fuse_file_info *fi)
 {
 	struct nfsdir *nfsdir;
 	struct nfsdirent *nfsdirent;
 	struct sync_cb_data cb_data;
-	int ret;
+	struct timespec start;
+	unsigned int tries;
+	int ret, r;
 
 	LOG("fuse_nfs_readdir entered [%s]\n", path);
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.status = -EIO;
+	for (tries = 0; tries < nreplicas && (r = nfs_pick()) >= 0; tries++)
+	{
+		memset(&cb_data, 0, sizeof(struct sync_cb_data));
+		nfs_clock(&start);
 
-	ret = nfs_opendir_async(d.nfs, path, readdir_cb, &cb_data);
+		nfs_deadline(replicas[r].nfs, DEADLINE_META);
+		ret = nfs_opendir_async(replicas[r].nfs, path, readdir_cb, &cb_data);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		wait_for_nfs_reply(replicas[r].nfs, &cb_data);
+		if (!nfs_replica_check(r, &cb_data, &start))
+			break;
+	}
+	if (cb_data.status < 0)
+		return cb_data.status;
+
+	//the whole listing came with the opendir, nothing more goes to the server
+	nfsdir = cb_data.return_data;
+	while ((nfsdirent = nfs_readdir(replicas[r].nfs, nfsdir)) != NULL)
+	{
+		filler(buf, nfsdirent->name, NULL, 0);
+	}
+
+	nfs_closedir(replicas[r].nfs, nfsdir);
+
+	return cb_data.status;
+}
+
+static void readlink_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	cb_data->is_finished = 1;
+	cb_data->status = status;
+
+	if (status < 0)
+	{
+		return;
+	}
+	strncat(cb_data->return_data, data, cb_data->max_size);
+}
+
+static int fuse_nfs_readlink(const char *path, char *buf, size_t size)
+{
+	struct sync_cb_data cb_data;
+	struct timespec start;
+	unsigned int tries;
+	int ret, r;
+
+	LOG("fuse_nfs_readlink entered [%s]\n", path);
+
+	memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.status = -EIO;
+	for (tries = 0; tries < nreplicas && (r = nfs_pick()) >= 0; tries++)
+	{
+		memset(&cb_data, 0, sizeof(struct sync_cb_data));
+		cb_data.return_data = buf;
+		cb_data.max_size = size;
+		buf[0] = 0;
+		nfs_clock(&start);
+
+		nfs_deadline(replicas[r].nfs, DEADLINE_META);
+		ret = nfs_readlink_async(replicas[r].nfs, path, readlink_cb, &cb_data);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		wait_for_nfs_reply(replicas[r].nfs, &cb_data);
+		if (!nfs_replica_check(r, &cb_data, &start))
+			break;
+	}
+
+	return cb_data.status;
+}
+
+static void open_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	cb_data->is_finished = 1;
+	cb_data->status = status;
+
+	LOG("open_cb status:%d\n", status);
+
+	if (status < 0)
+	{
+		return;
+	}
+	cb_data->return_data = data;
+}
+
+static struct nfs_file *nfs_file_new(const char *path, unsigned int home, int rdonly)
+{
+	struct nfs_file *f = calloc(1, sizeof(struct nfs_file));
+
+	if (!f)
+		return NULL;
+	if (!(f->path = strdup(path)))
+	{
+		free(f);
+		return NULL;
+	}
+	f->home = home;
+	f->rdonly = rdonly;
+	return f;
+}
+
+static void nfs_file_free(struct nfs_file *f)
+{
+	free(f->path);
+	free(f);
+}
+
+/* 0 with f opened on replica r, 1 when that server failed */
+static int nfs_file_open(struct nfs_file *f, unsigned int r, int flags)
+{
+	struct sync_cb_data cb_data;
+	struct timespec start;
+	int ret;
+
+	memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	nfs_clock(&start);
+
+	nfs_deadline(replicas[r].nfs, DEADLINE_META);
+	ret = nfs_open_async(replicas[r].nfs, f->path, flags, open_cb, &cb_data);
 	if (ret < 0)
 	{
 		return ret;
 	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
+	wait_for_nfs_reply(replicas[r].nfs, &cb_data);
+	if (nfs_replica_check(r, &cb_data, &start))
+		return 1;
+	if (cb_data.status < 0)
+		return cb_data.status;
+
+	f->fh[r] = cb_data.return_data;
+	f->gen[r] = replicas[r].gen;
+	return 0;
+}
 
-	nfsdir = cb_data.return_data;
-	while ((nfsdirent = nfs_readdir(d.nfs, nfsdir)) != NULL)
+static void read_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	cb_data->is_finished = 1;
+	cb_data->status = status;
+
+	if (status < 0)
+	{
+		return;
+	}
+	memcpy(cb_data->return_data, data, status);
+}
+
+/* The handle of f on replica r. A file open for reading is opened there on
+ * first use; a file open for writing only has the one it was opened with.
+ */
+static int nfs_file_fh(struct nfs_file *f, unsigned int r, struct nfsfh **fh)
+{
+	int ret = 0;
+
+	if (!f->fh[r] || f->gen[r] != replicas[r].gen)
+	{
+		if (!f->rdonly)
+			return -EIO;
+		ret = nfs_file_open(f, r, O_RDONLY);
+	}
+	*fh = f->fh[r];
+	return ret;
+}
+
+/* the server and handle f is written through, NULL once that connection broke */
+static struct nfs_context *nfs_file_home(struct nfs_file *f, struct nfsfh **fh)
+{
+	struct nfs_replica *rp = &replicas[f->home];
+
+	if (!f->fh[f->home] || f->gen[f->home] != rp->gen || rp->broken)
+		return NULL;
+	*fh = f->fh[f->home];
+	return rp->nfs;
+}
+
+static int fuse_nfs_open(const char *path, struct fuse_file_info *fi)
+{
+	struct nfs_file *f;
+	unsigned int tries;
+	int ret = -EIO, r;
+
+	LOG("fuse_nfs_open entered [%s]\n", path);
+
+	fi->fh = 0;
+	if (!(f = nfs_file_new(path, primary, (fi->flags & O_ACCMODE) == O_RDONLY)))
+		return -ENOMEM;
+
+	if (!f->rdonly)
+		ret = nfs_file_open(f, primary, fi->flags);
+	else
+		for (tries = 0; tries < nreplicas && (r = nfs_pick()) >= 0; tries++)
+			if ((ret = nfs_file_open(f, r, fi->flags)) <= 0)
+			{
+				f->home = r;
+				break;
+			}
+	if (ret)
+	{
+		nfs_file_free(f);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	fi->fh = (uint64_t)f;
+	return 0;
+}
+
+static int fuse_nfs_release(const char *path, struct fuse_file_info *fi)
+{
+	struct sync_cb_data cb_data;
+	struct nfs_file *f = (struct nfs_file *)fi->fh;
+	unsigned int r;
+
+	//a read left behind by a hedge still uses a handle, its callback closes
+	if (f->hedges)
 	{
-		filler(buf, nfsdirent->name, NULL, 0);
+		f->released = 1;
+		return 0;
 	}
+	for (r = 0; r < nreplicas; r++)
+	{
+		if (!f->fh[r] || f->gen[r] != replicas[r].gen || replicas[r].broken)
+			continue;
+		memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
-	nfs_closedir(d.nfs, nfsdir);
+		nfs_deadline(replicas[r].nfs, DEADLINE_META);
+		nfs_close_async(replicas[r].nfs, f->fh[r], generic_cb, &cb_data);
+		wait_for_nfs_reply(replicas[r].nfs, &cb_data);
+	}
+	nfs_file_free(f);
 
-	return cb_data.status;
+	return 0;
 }
 
-static void readlink_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+/* Hedged reads: a read of a file open read-only that is still outstanding
+ * past the nfs_hedge percentile of the recent read latencies is sent again
+ * to another server and the first answer is used. The slower request is
+ * left behind, its reply is dropped when it arrives and a release of the
+ * file waits for it to close the handles. At most nfs_hedge_budget
+ * percent of the reads are duplicated.
+ */
+#define NFS_HEDGE_SAMPLES 256
+//samples taken before the first hedge, and between two estimates
+#define NFS_HEDGE_WARMUP 64
+#define NFS_HEDGE_REESTIMATE 32
+#define NFS_HEDGE_MIN_US 1000
+//hedges that can be sent in a burst
+#define NFS_HEDGE_BURST 10
+
+static struct
 {
-	struct sync_cb_data *cb_data = private_data;
+	uint32_t lat_us[NFS_HEDGE_SAMPLES];
+	unsigned int nsamples;
+	uint64_t threshold_us;
+	//hundredths of a hedge
+	unsigned int credit;
+	unsigned long reads, hedged, won;
+} hedge;
+
+struct nfs_hedge
+{
+	char *buf;
+	int finished;
+	int status;
+	int inflight;
+	struct nfs_hedge_req *winner;
+};
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+//one of the copies of a hedged read, freed by its callback once abandoned
+struct nfs_hedge_req
+{
+	struct nfs_hedge *h;
+	struct nfs_file *f;
+	unsigned int r;
+	//the first copy, its latency is what the hedge threshold estimates
+	int primary;
+	int done;
+	int status;
+	uint64_t offset, size;
+	//sent at start, answered us later
+	struct timespec start;
+	uint64_t us;
+};
 
-	if (status < 0)
-	{
-		return;
-	}
-	strncat(cb_data->return_data, data, cb_data->max_size);
+static int hedge_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
 }
 
-static int fuse_nfs_readlink(const char *path, char *buf, size_t size)
+static void nfs_hedge_sample(uint64_t us)
 {
-	struct sync_cb_data cb_data;
-	int ret;
+	uint32_t sorted[NFS_HEDGE_SAMPLES];
+	unsigned int n;
 
-	LOG("fuse_nfs_readlink entered [%s]\n", path);
+	hedge.lat_us[hedge.nsamples++ % NFS_HEDGE_SAMPLES] = us > UINT32_MAX ? UINT32_MAX : us;
+	if (hedge.nsamples < NFS_HEDGE_WARMUP || hedge.nsamples % NFS_HEDGE_REESTIMATE)
+		return;
+	n = hedge.nsamples < NFS_HEDGE_SAMPLES ? hedge.nsamples : NFS_HEDGE_SAMPLES;
+	memcpy(sorted, hedge.lat_us, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), hedge_cmp);
+	hedge.threshold_us = sorted[(n - 1) * __atomic_load_n(&nfs_opts.hedge, __ATOMIC_RELAXED) / 100];
+	if (hedge.threshold_us < NFS_HEDGE_MIN_US)
+		hedge.threshold_us = NFS_HEDGE_MIN_US;
+}
 
-	memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	cb_data.return_data = buf;
-	cb_data.max_size = size;
+static void hedge_drop_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+}
 
-	ret = nfs_readlink_async(d.nfs, path, readlink_cb, &cb_data);
-	if (ret < 0)
-	{
-		return ret;
-	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
+//the last request of a released file closes it, without waiting from a callback
+static void nfs_hedge_free(struct nfs_hedge_req *req)
+{
+	struct nfs_file *f = req->f;
+	unsigned int r;
 
-	return cb_data.status;
+	free(req);
+	if (--f->hedges || !f->released)
+		return;
+	for (r = 0; r < nreplicas; r++)
+		if (f->fh[r] && f->gen[r] == replicas[r].gen && !replicas[r].broken)
+			nfs_close_async(replicas[r].nfs, f->fh[r], hedge_drop_cb, NULL);
+	nfs_file_free(f);
 }
 
-static void open_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+static void hedge_read_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
 {
-	struct sync_cb_data *cb_data = private_data;
+	struct nfs_hedge_req *req = private_data;
+	struct nfs_hedge *h = req->h;
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+	req->us = nfs_elapsed_us(&req->start);
+	if (!h)
+	{
+		//the late answer still tells how slow that server is
+		if (!nfs_server_error(status))
+		{
+			nfs_rtt_sample(req->r, req->us);
+			if (req->primary)
+				nfs_hedge_sample(req->us);
+		}
+		nfs_hedge_free(req);
+		return;
+	}
+	req->done = 1, req->status = status;
+	h->inflight--;
+	if (h->finished || nfs_server_error(status))
+		return;
+	if (status > 0)
+		memcpy(h->buf, data, status);
+	h->finished = 1, h->status = status;
+	h->winner = req;
+}
 
-	LOG("open_cb status:%d\n", status);
+static void hedge_open_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct nfs_hedge_req *req = private_data;
 
-	if (status < 0)
+	if (!req->h)
 	{
+		if (status >= 0)
+			nfs_close_async(nfs, data, hedge_drop_cb, NULL);
+		nfs_hedge_free(req);
 		return;
 	}
-	cb_data->return_data = data;
+	if (status >= 0)
+	{
+		req->f->fh[req->r] = data;
+		req->f->gen[req->r] = replicas[req->r].gen;
+		nfs_deadline(nfs, DEADLINE_READ);
+		if (!nfs_pread_async(nfs, data, req->offset, req->size, hedge_read_cb, req))
+			return;
+		status = -ENOMEM;
+	}
+	hedge_read_cb(status, nfs, NULL, req);
 }
 
-static int fuse_nfs_open(const char *path, struct fuse_file_info *fi)
+//the file is opened on the way if this server has no handle of it yet
+static struct nfs_hedge_req *nfs_hedge_send(struct nfs_hedge *h, struct nfs_file *f,
+											unsigned int r, uint64_t offset, uint64_t size)
 {
-	struct sync_cb_data cb_data;
+	struct nfs_hedge_req *req = calloc(1, sizeof(struct nfs_hedge_req));
 	int ret;
 
-	LOG("fuse_nfs_open entered [%s]\n", path);
-
-	memset(&cb_data, 0, sizeof(struct sync_cb_data));
-
-	fi->fh = 0;
-	ret = nfs_open_async(d.nfs, path, fi->flags, open_cb, &cb_data);
+	if (!req)
+		return NULL;
+	req->h = h, req->f = f, req->r = r;
+	req->offset = offset, req->size = size;
+	nfs_clock(&req->start);
+	nfs_deadline(replicas[r].nfs, DEADLINE_READ);
+	if (f->fh[r] && f->gen[r] == replicas[r].gen)
+		ret = nfs_pread_async(replicas[r].nfs, f->fh[r], offset, size, hedge_read_cb, req);
+	else
+		ret = nfs_open_async(replicas[r].nfs, f->path, O_RDONLY, hedge_open_cb, req);
 	if (ret < 0)
 	{
-		return ret;
+		free(req);
+		return NULL;
 	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
-
-	fi->fh = (uint64_t)cb_data.return_data;
-
-	return cb_data.status;
+	h->inflight++;
+	f->hedges++;
+	return req;
 }
 
-static int fuse_nfs_release(const char *path, struct fuse_file_info *fi)
+//the fastest server up other than r
+static int nfs_pick_other(unsigned int r)
 {
-	struct sync_cb_data cb_data;
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
-
-	memset(&cb_data, 0, sizeof(struct sync_cb_data));
-
-	nfs_close_async(d.nfs, nfsfh, generic_cb, &cb_data);
-	wait_for_nfs_reply(d.nfs, &cb_data);
-
-	return 0;
+	unsigned int i;
+	int best = -1;
+
+	for (i = 0; i < nreplicas; i++)
+		if (i != r && !replicas[i].down &&
+			(best < 0 || replicas[i].rtt_us < replicas[best].rtt_us))
+			best = i;
+	return best;
 }
 
-static void read_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+static int nfs_hedged_read(struct nfs_file *f, char *buf, size_t size, off_t offset)
 {
-	struct sync_cb_data *cb_data = private_data;
+	struct nfs_hedge h = {.buf = buf, .status = -EIO};
+	struct nfs_hedge_req *req[2] = {NULL, NULL};
+	struct pollfd pfd[2];
+	struct nfs_hedge_req *polled[2];
+	struct timespec start;
+	uint64_t us = 0;
+	int i, n, r, wait_ms;
+
+	if ((r = nfs_pick()) < 0)
+		return -EIO;
+	nfs_clock(&start);
+	if (!(req[0] = nfs_hedge_send(&h, f, r, offset, size)))
+		return -ENOMEM;
+	req[0]->primary = 1;
+	hedge.reads++;
+	hedge.credit += __atomic_load_n(&nfs_opts.hedge_budget, __ATOMIC_RELAXED);
+	if (hedge.credit > NFS_HEDGE_BURST * 100)
+		hedge.credit = NFS_HEDGE_BURST * 100;
+
+	while (!h.finished)
+	{
+		us = nfs_elapsed_us(&start);
+		//a failed first copy is always sent again, a slow one within the budget
+		if (!req[1] && (req[0]->done ||
+						(hedge.threshold_us && us >= hedge.threshold_us && hedge.credit >= 100)) &&
+			(r = nfs_pick_other(req[0]->r)) >= 0 &&
+			(req[1] = nfs_hedge_send(&h, f, r, offset, size)) && !req[0]->done)
+		{
+			hedge.credit -= 100;
+			if (!(++hedge.hedged % 1024))
+				LOG("nfs hedge: %lu reads, %lu hedged, %lu won by the hedge\n",
+					hedge.reads, hedge.hedged, hedge.won);
+		}
+		if (!h.inflight)
+			break;
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+		for (i = n = 0; i < 2; i++)
+			if (req[i] && !req[i]->done)
+			{
+				pfd[n].fd = nfs_get_fd(replicas[req[i]->r].nfs);
+				pfd[n].events = nfs_which_events(replicas[req[i]->r].nfs);
+				pfd[n].revents = 0;
+				polled[n++] = req[i];
+			}
+		wait_ms = 100;
+		if (!req[1] && hedge.threshold_us > us && (hedge.threshold_us - us) / 1000 < 100)
+			wait_ms = (hedge.threshold_us - us) / 1000 + 1;
+		if (poll(pfd, n, wait_ms) < 0)
+			for (i = 0; i < n; i++)
+				pfd[i].revents = -1;
+		for (i = 0; i < n; i++)
+		{
+			struct nfs_context *nfs = replicas[polled[i]->r].nfs;
 
-	if (status < 0)
+			if (nfs_service(nfs, pfd[i].revents) < 0)
+			{
+				//destroying the context completes its calls, unless it is kept
+				nfs_context_broken(nfs);
+				if (!polled[i]->done)
+				{
+					polled[i]->done = 1, polled[i]->status = -EIO;
+					h.inflight--;
+				}
+			}
+		}
+	}
+
+	if (req[1] && h.winner == req[1] && !req[0]->done)
+		hedge.won++;
+	for (i = 0; i < 2; i++)
 	{
-		return;
+		if (!req[i])
+			continue;
+		if (!req[i]->done)
+		{
+			req[i]->h = NULL;
+			continue;
+		}
+		//each server by the time its own copy took, the threshold by the first
+		if (nfs_server_error(req[i]->status) && !replicas[req[i]->r].down)
+			nfs_replica_failed(req[i]->r, 0);
+		else if (!nfs_server_error(req[i]->status))
+		{
+			nfs_rtt_sample(req[i]->r, req[i]->us);
+			if (req[i]->primary)
+				nfs_hedge_sample(req[i]->us);
+		}
+		nfs_hedge_free(req[i]);
 	}
-	memcpy(cb_data->return_data, data, status);
+	return h.status;
 }
 
 static int fuse_nfs_read(const char *path, char *buf, size_t size,
 						 off_t offset, struct fuse_file_info *fi)
 {
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
+	struct nfs_file *f = (struct nfs_file *)fi->fh;
+	struct nfsfh *nfsfh;
 	struct sync_cb_data cb_data;
-	int ret;
+	struct timespec start;
+	unsigned int tries;
+	int ret, r;
 
 	LOG("fuse_nfs_read entered [%s]\n", path);
 
-	memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	cb_data.return_data = buf;
+	if (__atomic_load_n(&nfs_opts.hedge, __ATOMIC_RELAXED) && f->rdonly && nreplicas > 1)
+		return nfs_hedged_read(f, buf, size, offset);
 
-	ret = nfs_pread_async(d.nfs, nfsfh, offset, size, read_cb, &cb_data);
-	if (ret < 0)
+	memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.status = -EIO;
+	for (tries = 0; tries < nreplicas; tries++)
 	{
-		return ret;
+		//a file open for writing is read where it is written
+		if ((r = f->rdonly ? nfs_pick() : (int)f->home) < 0)
+			break;
+		if ((ret = nfs_file_fh(f, r, &nfsfh)) < 0)
+			return ret;
+		if (ret)
+			continue;
+
+		memset(&cb_data, 0, sizeof(struct sync_cb_data));
+		cb_data.return_data = buf;
+		nfs_clock(&start);
+
+		nfs_deadline(replicas[r].nfs, DEADLINE_READ);
+		ret = nfs_pread_async(replicas[r].nfs, nfsfh, offset, size, read_cb, &cb_data);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		wait_for_nfs_reply(replicas[r].nfs, &cb_data);
+		if (!nfs_replica_check(r, &cb_data, &start) || !f->rdonly)
+			break;
 	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
 
 	return cb_data.status;
 }
@@ -381,44 +1373,231 @@ static int fuse_nfs_read(const char *path, char *buf, size_t size,
 static int fuse_nfs_write(const char *path, const char *buf, size_t size,
 						  off_t offset, struct fuse_file_info *fi)
 {
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
+	struct nfsfh *nfsfh;
+	struct nfs_context *nfs;
 	struct sync_cb_data cb_data;
 	int ret;
 
 	LOG("fuse_nfs_write entered [%s]\n", path);
 
+	if (!(nfs = nfs_file_home((struct nfs_file *)fi->fh, &nfsfh)))
+		return -EIO;
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
-	ret = nfs_pwrite_async(d.nfs, nfsfh, offset, size, buf,
+	nfs_deadline(nfs, DEADLINE_WRITE);
+	ret = nfs_pwrite_async(nfs, nfsfh, offset, size, buf,
 						   generic_cb, &cb_data);
 	if (ret < 0)
 	{
 		return ret;
 	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
+	wait_for_nfs_reply(nfs, &cb_data);
 
 	return cb_data.status;
 }
 
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+//reads kept in flight by copy_file_range
+#define NFS_COPY_DEPTH 8
+
+struct nfs_copy;
+
+struct nfs_copy_slot
+{
+	struct nfs_copy *copy;
+	char *buf;
+	uint64_t pos, len;
+};
+
+struct nfs_copy
+{
+	struct sync_cb_data cb_data;
+	struct nfs_context *nfs;
+	struct nfsfh *in, *out;
+	uint64_t offset_in, offset_out;
+	uint64_t issued, size;
+	//first byte not copied: a short read or write, or a failure, ends the
+	//copy there, whatever the chunks behind it already wrote
+	uint64_t limit;
+	uint64_t chunk;
+	int inflight;
+	struct nfs_copy_slot slots[NFS_COPY_DEPTH];
+};
+
+static void copy_read_cb(int status, struct nfs_context *nfs, void *data, void *private_data);
+
+static void copy_stop(struct nfs_copy *c, uint64_t pos)
+{
+	if (pos < c->limit)
+		c->limit = pos;
+}
+
+/* start the next read on slot, the copy is done once nothing is in flight */
+static void copy_next(struct nfs_copy_slot *slot)
+{
+	struct nfs_copy *c = slot->copy;
+	uint64_t count = c->size - c->issued;
+
+	if (count > c->chunk)
+		count = c->chunk;
+	if (count && c->issued < c->limit)
+	{
+		slot->pos = c->issued;
+		slot->len = count;
+		nfs_deadline(c->nfs, DEADLINE_READ);
+		if (nfs_pread_async(c->nfs, c->in, c->offset_in + slot->pos, count,
+							copy_read_cb, slot) == 0)
+		{
+			c->issued += count;
+			c->inflight++;
+			return;
+		}
+		c->cb_data.status = -ENOMEM;
+		copy_stop(c, c->issued);
+	}
+	if (!c->inflight)
+		c->cb_data.is_finished = 1;
+}
+
+static void copy_write_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct nfs_copy_slot *slot = private_data;
+	struct nfs_copy *c = slot->copy;
+
+	c->inflight--;
+	if (status < 0)
+	{
+		c->cb_data.status = status;
+		copy_stop(c, slot->pos);
+	}
+	else if ((uint64_t)status < slot->len)
+		copy_stop(c, slot->pos + status);
+	copy_next(slot);
+}
+
+static void copy_read_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct nfs_copy_slot *slot = private_data;
+	struct nfs_copy *c = slot->copy;
+
+	c->inflight--;
+	if (status <= 0)
+	{
+		if (status < 0)
+			c->cb_data.status = status;
+		copy_stop(c, slot->pos);
+		copy_next(slot);
+		return;
+	}
+	//the end of the file, the chunks behind this one read nothing
+	if ((uint64_t)status < slot->len)
+		copy_stop(c, slot->pos + status);
+
+	//the write may still reference the buffer until it completes
+	memcpy(slot->buf, data, status);
+	slot->len = status;
+	nfs_deadline(nfs, DEADLINE_WRITE);
+	if (nfs_pwrite_async(nfs, c->out, c->offset_out + slot->pos, status, slot->buf,
+						 copy_write_cb, slot) == 0)
+	{
+		c->inflight++;
+		return;
+	}
+	c->cb_data.status = -ENOMEM;
+	copy_stop(c, slot->pos);
+	copy_next(slot);
+}
+
+/* NFSv3 has no COPY and libnfs exposes no v4.2 COPY/CLONE: the data is
+ * pumped through the daemon with reads and writes pipelined on the
+ * connection, not through the kernel and back.
+ */
+static ssize_t fuse_nfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+										off_t offset_in, const char *path_out,
+										struct fuse_file_info *fi_out, off_t offset_out,
+										size_t size, int flags)
+{
+	struct nfs_file *out = (struct nfs_file *)fi_out->fh;
+	struct nfs_copy c;
+	int i;
+
+	LOG("fuse_nfs_copy_file_range entered [%s] -> [%s]\n", path_in, path_out);
+
+	memset(&c, 0, sizeof(struct nfs_copy));
+	//both ends on the server the destination is written through
+	if (!(c.nfs = nfs_file_home(out, &c.out)) ||
+		nfs_file_fh((struct nfs_file *)fi_in->fh, out->home, &c.in))
+		return -EOPNOTSUPP;
+	c.offset_in = offset_in;
+	c.offset_out = offset_out;
+	c.size = size;
+	c.limit = size;
+	c.chunk = nfs_get_readmax(c.nfs);
+	if (c.chunk > nfs_get_writemax(c.nfs))
+		c.chunk = nfs_get_writemax(c.nfs);
+	if (!size)
+		return 0;
+
+	for (i = 0; i < NFS_COPY_DEPTH; i++)
+	{
+		c.slots[i].copy = &c;
+		c.slots[i].buf = iobuf_alloc(c.chunk);
+		if (!c.slots[i].buf)
+		{
+			c.cb_data.status = -ENOMEM;
+			c.limit = 0;
+		}
+	}
+	for (i = 0; i < NFS_COPY_DEPTH; i++)
+		copy_next(&c.slots[i]);
+	wait_for_nfs_reply(c.nfs, &c.cb_data);
+
+	for (i = 0; i < NFS_COPY_DEPTH; i++)
+		iobuf_free(c.slots[i].buf, c.chunk);
+
+	//every chunk below the limit was written in full: that prefix is what
+	//was copied, a failure is reported only when nothing was
+	if (c.limit > c.issued)
+		c.limit = c.issued;
+	if (!c.limit && c.cb_data.status < 0)
+		return c.cb_data.status;
+	return c.limit;
+}
+#endif
+
 static int fuse_nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	struct sync_cb_data cb_data;
+	struct nfs_file *f;
 	int ret = 0;
 
 	LOG("fuse_nfs_create entered [%s]\n", path);
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	fi->fh = 0;
+	if (!(f = nfs_file_new(path, primary, 0)))
+		return -ENOMEM;
+
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_creat_async(d.nfs, path, mode, open_cb, &cb_data);
 	if (ret < 0)
 	{
+		nfs_file_free(f);
 		return ret;
 	}
 	wait_for_nfs_reply(d.nfs, &cb_data);
+	if (cb_data.status < 0)
+	{
+		nfs_file_free(f);
+		return cb_data.status;
+	}
 
-	fi->fh = (uint64_t)cb_data.return_data;
+	f->fh[primary] = cb_data.return_data;
+	f->gen[primary] = replicas[primary].gen;
+	fi->fh = (uint64_t)f;
 
-	return cb_data.status;
+	return 0;
 }
 
 static int fuse_nfs_utime(const char *path, struct utimbuf *times)
@@ -430,6 +1609,7 @@ static int fuse_nfs_utime(const char *path, struct utimbuf *times)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_utime_async(d.nfs, path, times, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -450,6 +1630,7 @@ static int fuse_nfs_unlink(const char *path)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_unlink_async(d.nfs, path, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -469,6 +1650,7 @@ static int fuse_nfs_rmdir(const char *path)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_rmdir_async(d.nfs, path, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -488,6 +1670,7 @@ static int fuse_nfs_mkdir(const char *path, mode_t mode)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_mkdir_async(d.nfs, path, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -497,6 +1680,7 @@ static int fuse_nfs_mkdir(const char *path, mode_t mode)
 
 	cb_data.is_finished = 0;
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_chmod_async(d.nfs, path, mode, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -516,6 +1700,7 @@ static int fuse_nfs_mknod(const char *path, mode_t mode, dev_t rdev)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_mknod_async(d.nfs, path, mode, rdev, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -535,6 +1720,7 @@ static int fuse_nfs_symlink(const char *from, const char *to)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_symlink_async(d.nfs, from, to, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -554,6 +1740,7 @@ static int fuse_nfs_rename(const char *from, const char *to)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_rename_async(d.nfs, from, to, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -573,6 +1760,7 @@ static int fuse_nfs_link(const char *from, const char *to)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_link_async(d.nfs, from, to, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -592,6 +1780,7 @@ static int fuse_nfs_chmod(const char *path, mode_t mode)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_chmod_async(d.nfs, path, mode, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -611,6 +1800,7 @@ static int fuse_nfs_chown(const char *path, uid_t uid, gid_t gid)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_chown_async(d.nfs, path,
 						  map_reverse_uid(uid), map_reverse_gid(gid),
 						  generic_cb, &cb_data);
@@ -632,6 +1822,7 @@ static int fuse_nfs_truncate(const char *path, off_t size)
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
+	nfs_deadline(d.nfs, DEADLINE_META);
 	ret = nfs_truncate_async(d.nfs, path, size, generic_cb, &cb_data);
 	if (ret < 0)
 	{
@@ -645,20 +1836,24 @@ static int fuse_nfs_truncate(const char *path, off_t size)
 static int fuse_nfs_fsync(const char *path, int isdatasync,
 						  struct fuse_file_info *fi)
 {
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
+	struct nfsfh *nfsfh;
+	struct nfs_context *nfs;
 	struct sync_cb_data cb_data;
 	int ret;
 
 	LOG("fuse_nfs_fsync entered [%s]\n", path);
 
+	if (!(nfs = nfs_file_home((struct nfs_file *)fi->fh, &nfsfh)))
+		return -EIO;
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
 
-	ret = nfs_fsync_async(d.nfs, nfsfh, generic_cb, &cb_data);
+	nfs_deadline(nfs, DEADLINE_WRITE);
+	ret = nfs_fsync_async(nfs, nfsfh, generic_cb, &cb_data);
 	if (ret < 0)
 	{
 		return ret;
 	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
+	wait_for_nfs_reply(nfs, &cb_data);
 
 	return cb_data.status;
 }
@@ -681,22 +1876,35 @@ static void statvfs_cb(int status, struct nfs_context *nfs, void *data, void *pr
 static int
 fuse_nfs_statfs(const char *path, struct statvfs *stbuf)
 {
-	int ret;
+	int ret, r;
 	struct statvfs svfs;
+	struct timespec start;
+	unsigned int tries;
 
 	struct sync_cb_data cb_data;
 
 	LOG("fuse_nfs_statfs entered [%s]\n", path);
 
 	memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	cb_data.return_data = &svfs;
-
-	ret = nfs_statvfs_async(d.nfs, path, statvfs_cb, &cb_data);
-	if (ret < 0)
+	cb_data.status = -EIO;
+	for (tries = 0; tries < nreplicas && (r = nfs_pick()) >= 0; tries++)
 	{
-		return ret;
+		memset(&cb_data, 0, sizeof(struct sync_cb_data));
+		cb_data.return_data = &svfs;
+		nfs_clock(&start);
+
+		nfs_deadline(replicas[r].nfs, DEADLINE_META);
+		ret = nfs_statvfs_async(replicas[r].nfs, path, statvfs_cb, &cb_data);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		wait_for_nfs_reply(replicas[r].nfs, &cb_data);
+		if (!nfs_replica_check(r, &cb_data, &start))
+			break;
 	}
-	wait_for_nfs_reply(d.nfs, &cb_data);
+	if (cb_data.status < 0)
+		return cb_data.status;
 
 	stbuf->f_bsize = svfs.f_bsize;
 	//stbuf->f_frsize = svfs.f_frsize;
@@ -715,13 +1923,94 @@ fuse_nfs_statfs(const char *path, struct statvfs *stbuf)
 
 static void destroy()
 {
-	if (d.v_urls)
-		nfs_destroy_url(d.v_urls);
-	if (d.v_nfs)
-		nfs_destroy_context(d.v_nfs);
+	char stats[512];
+	unsigned int i;
+
+	if (hedge.reads)
+		LOG("nfs hedge: %lu reads, %lu hedged, %lu won by the hedge\n",
+			hedge.reads, hedge.hedged, hedge.won);
+	iobuf_stats(stats, sizeof(stats));
+	LOG("nfs iobuf:%s\n", stats);
+
+	for (i = 0; i < nreplicas; i++)
+	{
+		//a mount still running is waited for, up to its rpc timeout
+		if (replicas[i].revive)
+			nfs_revive_finish(&replicas[i]);
+		if (replicas[i].urls)
+			nfs_destroy_url(replicas[i].urls);
+		if (replicas[i].nfs && !replicas[i].broken)
+			nfs_destroy_context(replicas[i].nfs);
+		free(replicas[i].url);
+	}
+	nreplicas = 0;
+	d.v_nfs = NULL, d.v_urls = NULL;
+}
+
+/* Control socket. The state of the servers is read without a lock for the
+ * stats, everything else is left to the backend thread via nfs_ctl_pending.
+ */
+static int nfs_ctl_stats(char *buf, size_t size)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < nreplicas && len < size; i++)
+		len += snprintf(buf + len, size - len, "nfs: %s %s rtt=%luus%s\n", replicas[i].url,
+						!replicas[i].mounted ? "lost" : replicas[i].down ? "down" : "up",
+						(unsigned long)replicas[i].rtt_us, i == primary ? " writes" : "");
+	if (len < size)
+		len += snprintf(buf + len, size - len,
+						"nfs: hedge %lu reads, %lu hedged, %lu won by the hedge\n",
+						hedge.reads, hedge.hedged, hedge.won);
+	if (len < size)
+		len += snprintf(buf + len, size - len, "nfs: readahead=%d hedge=%u hedge_budget=%u\n",
+						__atomic_load_n(&nfs_opts.readahead_kb, __ATOMIC_RELAXED),
+						__atomic_load_n(&nfs_opts.hedge, __ATOMIC_RELAXED),
+						__atomic_load_n(&nfs_opts.hedge_budget, __ATOMIC_RELAXED));
+	return len;
+}
+
+static const struct fuse_opt nfs_tune_spec[] = {
+	{"nfs_hedge=%u", offsetof(struct nfs_opts, hedge), 0},
+	{"nfs_hedge_budget=%u", offsetof(struct nfs_opts, hedge_budget), 0},
+	{"nfs_readahead=%d", offsetof(struct nfs_opts, readahead_kb), 0},
+	FUSE_OPT_END};
+
+static int nfs_ctl_tune(struct fuse_args *args, int apply)
+{
+	struct nfs_opts t;
+
+	t.hedge = __atomic_load_n(&nfs_opts.hedge, __ATOMIC_RELAXED);
+	t.hedge_budget = __atomic_load_n(&nfs_opts.hedge_budget, __ATOMIC_RELAXED);
+	t.readahead_kb = __atomic_load_n(&nfs_opts.readahead_kb, __ATOMIC_RELAXED);
+	if (fuse_opt_parse(args, &t, nfs_tune_spec, NULL) == -1)
+		return -1;
+	if (!apply)
+		return 0;
+	if (t.hedge > 99)
+		t.hedge = 99;
+	__atomic_store_n(&nfs_opts.hedge, t.hedge, __ATOMIC_RELAXED);
+	__atomic_store_n(&nfs_opts.hedge_budget, t.hedge_budget, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&nfs_opts.readahead_kb, t.readahead_kb, __ATOMIC_RELAXED) != t.readahead_kb)
+		__atomic_or_fetch(&nfs_ctl_pending, NFS_CTL_READAHEAD, __ATOMIC_ACQ_REL);
+	return 0;
+}
+
+static int nfs_ctl_reconnect(void)
+{
+	__atomic_or_fetch(&nfs_ctl_pending, NFS_CTL_RECONNECT, __ATOMIC_ACQ_REL);
+	return 0;
 }
 
-struct fuse_operations nfs_oper = {
+//writes are sent before they return, nothing is buffered to flush
+static const struct ctl_backend nfs_ctl = {
+	.stats = nfs_ctl_stats,
+	.tune = nfs_ctl_tune,
+	.reconnect = nfs_ctl_reconnect,
+};
+
+struct fs_operations nfs_oper = {
 	.chmod = fuse_nfs_chmod,
 	.chown = fuse_nfs_chown,
 	.create = fuse_nfs_create,
@@ -743,6 +2032,9 @@ struct fuse_operations nfs_oper = {
 	.truncate = fuse_nfs_truncate,
 	.write = fuse_nfs_write,
 	.statfs = fuse_nfs_statfs,
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+	.copy_file_range = fuse_nfs_copy_file_range,
+#endif
 };
 
 //from lib/helper.c
@@ -773,10 +2065,53 @@ fuse option [fsname] format:
      >mount.fuse：
      	mount.fuse type#[source] destination [-t type] [-o opt[,opts...]]
      	mount.fuse -ofsname=/mnt/fusesubdir_src /mnt/fusesubdir_dest -t fusebind -o allow_other
+Custom options:
+    -o passthrough	   let the kernel read and write the underlying files
+    			   directly (Linux >= 6.9, libfuse >= 3.16, needs
+    			   CAP_SYS_ADMIN), only metadata goes through fusebind;
+    			   such writes bypass the fusenfs cache, keep cache=no
+    -o uring		   run open, stat, read, write and fsync through one
+    			   shared io_uring with the open fds registered
+    			   (needs a build with liburing)
+    -o uring_depth=N	   io_uring queue entries (default 256)
+    -o dirfds=N	   resolve paths with *at() calls from O_PATH fds of their
+    			   parent directories, N of them are kept, instead of
+    			   the subdir module walking every component; renames
+    			   made directly in the source are only seen after the
+    			   fd is evicted, 0 disables (default 0)
+    with cache=yes, listings read entries in large getdents64 batches and
+    fetch their attributes with batched statx (io_uring when built with
+    liburing) into the stat cache, e.g. -o cache=yes,cache_stat_timeout=1
+    copy_file_range (libfuse >= 3.4) is passed down to the source file
+    system, which reflinks on XFS and btrfs
+    fallocate (every mode) and SEEK_DATA/SEEK_HOLE (libfuse >= 3.8) are
+    passed down as well
 
 <fusenfs>
 Custom options:
     -o logfile=logfile	   log file path
+    -o nfs_timeout=N	   milliseconds before a call to the server fails,
+    			   0 waits forever (default 5000 with several
+    			   servers, libnfs' own otherwise)
+    several servers exporting the same data, nfs://srv1+srv2+srv3/export
+    (or with commas escaped as \\, inside -o),
+    share the reads (getattr, readdir, readlink, statfs and reads of files
+    opened read-only) by their latency; a server that fails is taken out for
+    30 s and those calls go to another one, the writes go to the first
+    server still answering
+    -o nfs_hedge=N	   with several servers, a read of a file open read-only
+    			   that takes longer than the Nth percentile of the
+    			   recent reads is sent to another server as well and
+    			   the first answer is used, 0 disables (default 0)
+    -o nfs_hedge_budget=N  percent of the reads that may be sent twice
+    			   (default 5); the counts are logged
+    -o nfs_readahead=N	   KB libnfs reads ahead of sequential reads, instead
+    			   of the url's readahead= in bytes
+    copy_file_range (libfuse >= 3.4) pipelines the reads and writes inside
+    fusenfs, libnfs has no NFSv4.2 COPY to leave it to the server
+    fallocate is not supported and SEEK_DATA/SEEK_HOLE see no holes,
+    libnfs has no NFSv4.2 ALLOCATE, DEALLOCATE or SEEK; posix_fallocate
+    falls back to writing the range
 fuse option [fsname] format:
       a URL-FORMAT, fsname=url
     	Libnfs uses RFC2224 style URLs extended with libnfs specific url arguments
@@ -805,6 +2140,30 @@ fuse option [fsname] format:
 <fusesmb>
 Custom options:
     -o logfile=logfile	   log file path
+    -o smb_depth=N	   requests kept in flight on the SMB session (default 16)
+    -o smb_wbuf=N	   KB of small sequential writes coalesced per open file
+    			   before they are sent, 0 disables (default 1024)
+    -o smb_sessions=N	   pool of connections to the share, each FUSE worker
+    			   uses one of them and large reads and writes are
+    			   striped across all (default 1, max 8)
+    -o smb_channels=N	   same as smb_sessions
+    -o smb_handle_timeout=N
+    			   seconds the handle of a closed file is kept open
+    			   for reuse by the next open, 0 disables (default 5)
+    -o smb_notify=N	   directories watched with CHANGE_NOTIFY once listed,
+    			   remote changes below them invalidate the cache so
+    			   a long cache_timeout stays coherent, 0 disables
+    			   (default 64)
+    -o smb_small_file=N	   KB read together with the open of a read-only file
+    			   in one compound when the cached attributes put it
+    			   within that size, it then needs no further round
+    			   trip, 0 disables (default 64)
+    copy_file_range (libfuse >= 3.4) is done by the server with
+    FSCTL_SRV_COPYCHUNK_WRITE, the data never crosses the network
+    SEEK_DATA/SEEK_HOLE (libfuse >= 3.8) come from the allocated ranges of
+    the file, fallocate punches or zeroes with FSCTL_SET_ZERO_DATA within
+    the end of the file; reserving space is not supported, posix_fallocate
+    writes the blocks itself
 fuse option [fsname] format:
     	The SMB URL format is currently a small subset of the URL format that is
     	defined/used by the Samba project.
@@ -836,6 +2195,71 @@ fuse option [fsname] format:
     	                : set credentials file path,format:
     	                  [domain]:username:password
     	  password=<***>: set password
+
+<cache>
+Custom options (all backends):
+    -o cache=yes|no	   cache attributes, directory listings, negative
+    			   lookups and symlink targets in fusenfs
+    			   default: yes for fusenfs/fusesmb, no for fusebind
+    -o cache_timeout=N	   seconds every cache entry stays valid (default 20)
+    -o cache_stat_timeout=N
+    -o cache_dir_timeout=N
+    -o cache_link_timeout=N
+    -o cache_negative_timeout=N
+    			   per cache override of cache_timeout, 0 disables it
+    -o cache_pages=yes|no  let the kernel keep the pages of a file across
+    			   opens while the server reports the same inode, size
+    			   and mtime, costs one GETATTR per open of a file
+    			   whose pages were kept before
+    			   default: the value of cache
+    -o warmup_threads=N	   parallel workers of a warm-up (default 16)
+    setfattr -n user.fusenfs.warmup [-v data=SIZE,glob=PATTERN] <dir> walks
+    <dir> in the background through the mount, listing every directory and
+    stat'ing every entry, and reads the regular files up to SIZE bytes (K/M/G)
+    whose name matches PATTERN; getfattr -n user.fusenfs.warmup reports the
+    progress, setfattr -x user.fusenfs.warmup stops it
+
+<mount>
+Custom options (fusenfs/fusesmb):
+    -o lazy_mount	   mount at once and connect to the server in the
+    			   background, retrying until it answers; calls made
+    			   meanwhile wait for the connection
+    -o lazy_timeout=N	   seconds after the mount calls wait for the server,
+    			   later ones fail with ETIMEDOUT until it is connected
+    			   (default 30)
+    -o deadline=N	   milliseconds a call waits for the server before it
+    			   fails with ETIMEDOUT, 0 waits forever (default: the
+    			   backend's nfs_timeout or url timeout=)
+    -o deadline_meta=N
+    -o deadline_read=N
+    -o deadline_write=N	   per class override of deadline: lookups and
+    			   namespace calls, reads, writes and fsync; an smb
+    			   call returns at its deadline, the request sent
+    			   stays on the session rounded up to whole seconds
+    -o intr		   an interrupted call (e.g. a killed process) returns
+    			   EINTR; smb calls return at once and the server's
+    			   late reply is dropped; fusenfs runs single
+    			   threaded and is bounded by the deadline alone
+    -o iobuf_hugepages=no|thp|hugetlb
+    			   backing of the pooled read/write buffers: plain
+    			   pages, transparent huge pages or reserved hugetlbfs
+    			   pages, falling back to thp (default thp)
+    -o ctl_socket=PATH	   accept fusenfsctl commands on a Unix socket at PATH,
+    			   owner only: stats, drop PREFIX, set OPT[,OPT...],
+    			   flush, reconnect ("fusenfsctl PATH help" lists them)
+
+<fuse3>
+Custom options (all backends, builds configured --with-fuse3):
+    -o writeback_cache=N   let the kernel cache and coalesce writes, 0
+    			   disables (default 1 for bind, 0 for nfs and smb:
+    			   the kernel then trusts its own size and mtime of
+    			   files, appends and truncates by other clients of
+    			   the export are not seen; off with passthrough)
+    -o max_pages=N	   pages per read/write request, up to 1 MB
+    			   (default 256)
+    directory operations run in parallel, listings carry the attributes
+    (READDIRPLUS) and with cache=yes the kernel keeps them; remote changes
+    seen by smb_notify are invalidated in the kernel as well
 )");
 }
 
@@ -856,6 +2280,25 @@ static int nfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *
 // 	return errc;
 // }
 
+/* fuse_opt splits the option at commas, those of a list of servers or of
+ * a url argument are escaped so that the fsname arrives in one piece
+ */
+static int fsname_add_arg(struct fuse_args *args, const char *opt)
+{
+	char *esc = malloc(strlen(opt) * 2 + 1), *p = esc;
+	int res;
+
+	if (!esc)
+		return -ENOMEM;
+	for (; *opt; *p++ = *opt++)
+		if (*opt == ',' || *opt == '\\')
+			*p++ = '\\';
+	*p = '\0';
+	res = fuse_opt_add_arg(args, esc);
+	free(esc);
+	return res;
+}
+
 static int set_fsname(struct fuse_args *args)
 {
 	int res = 0;
@@ -937,7 +2380,7 @@ static int set_fsname(struct fuse_args *args)
 	else
 		strcat(_opt, d.fsname);
 
-	res = fuse_opt_add_arg(args, _opt);
+	res = fsname_add_arg(args, _opt);
 
 out_free:
 	if (_opt)
@@ -966,23 +2409,99 @@ end:
 	return res;
 }
 
+/* mounts the export on every server, before fuse_main or from the lazy mount
+ * thread; one answering is enough, the others are retried later
+ */
+static int nfs_connect(void)
+{
+	unsigned int i, up = 0;
+
+	for (i = 0; i < nreplicas; i++)
+		if (replicas[i].mounted || !nfs_replica_mount(&replicas[i]))
+			up++;
+	if (!up)
+		return -EIO;
+	if (up < nreplicas)
+		fprintf(stderr, "nfs: only %u of %u servers mounted\n", up, nreplicas);
+	nfs_set_primary();
+	return 0;
+}
+
+//servers are listed with ',' or with '+', which fuse_opt does not split at
+static const char *nfs_replica_sep(const char *host, const char *end)
+{
+	for (; host < end; host++)
+		if (*host == ',' || *host == '+')
+			return host;
+	return NULL;
+}
+
+/* nfs://srv1+srv2/export?args: one url per server of the list */
+static int nfs_parse_replicas(const char *fsname)
+{
+	const char *host = strstr(fsname, "://"), *end, *next;
+	size_t pre, len;
+
+	if (!host || !(end = strchr(host += 3, '/')))
+		end = host = fsname + strlen(fsname);
+	pre = host - fsname;
+	do
+	{
+		if (nreplicas == NFS_MAX_REPLICAS)
+		{
+			fprintf(stderr, "nfs: at most %u servers\n", NFS_MAX_REPLICAS);
+			return -1;
+		}
+		if (!(next = nfs_replica_sep(host, end)))
+			next = end;
+		len = next - host;
+		if (!(replicas[nreplicas].url = malloc(pre + len + strlen(end) + 1)))
+			return -1;
+		sprintf(replicas[nreplicas].url, "%.*s%.*s%s", (int)pre, fsname, (int)len, host, end);
+		replicas[nreplicas++].rtt_us = NFS_REPLICA_RTT_US;
+		host = next + 1;
+	} while (next != end);
+	return 0;
+}
+
+static const struct fuse_opt nfs_opt_spec[] = {
+	{"nfs_timeout=%d", offsetof(struct nfs_opts, timeout_ms), 0},
+	{"nfs_hedge=%u", offsetof(struct nfs_opts, hedge), 0},
+	{"nfs_hedge_budget=%u", offsetof(struct nfs_opts, hedge_budget), 0},
+	{"nfs_readahead=%d", offsetof(struct nfs_opts, readahead_kb), 0},
+	FUSE_OPT_END};
+
 int _env_init_nfs(struct nfsdata *_d, struct fuse_args *args)
 {
+	unsigned int i;
 	int res = 0;
 
-	if (!(_d->v_nfs = nfs_init_context()))
+	if (fuse_opt_parse(args, &nfs_opts, nfs_opt_spec, NULL) == -1)
 	{
-		fprintf(stderr, "Failed to init context\n");
-		res = -3;
+		res = -2;
 		goto out_free;
 	}
+	if (nfs_opts.hedge > 99)
+		nfs_opts.hedge = 99;
 
-	if (!(_d->v_urls = nfs_parse_url_dir(_d->v_nfs, _d->fsname)))
+	_d->destory = destroy;
+	ctl_backend(&nfs_ctl);
+	owner_map(nfs_owner);
+	if (nfs_parse_replicas(_d->fsname))
 	{
-		fprintf(stderr, "Failed to parse url : %s\n", nfs_get_error(d.v_nfs));
 		res = -4;
 		goto out_free;
 	}
+	if (nfs_opts.timeout_ms == -1 && nreplicas > 1)
+		nfs_opts.timeout_ms = NFS_REPLICA_TIMEOUT_MS;
+	for (i = 0; i < nreplicas; i++)
+		if (nfs_replica_context(&replicas[i]))
+		{
+			res = -4;
+			goto out_free;
+		}
+	nfs_set_primary();
+	srandom(time(NULL) ^ getpid());
 
 	_d->custom_uid = -1U;
 	_d->custom_gid = -1U;
@@ -1000,14 +2519,11 @@ int _env_init_nfs(struct nfsdata *_d, struct fuse_args *args)
 		} while (++_sid, *++_p);
 	}
 
-	update_rpc_credentials();
-	if (nfs_mount(_d->v_nfs, _d->nfsurls->server, _d->nfsurls->path))
+	if (lazy_connect(nfs_connect))
 	{
-		fprintf(stderr, "Failed to mount nfs share : %s\n", nfs_get_error(d.v_nfs));
 		res = -5;
 		goto out_free;
 	}
-	_d->destory = destroy;
 
 out_free:
 	return res;
@@ -1089,6 +2605,47 @@ int main(int argc, char *argv[])
 
 	d.urllen = strlen(d.fsname);
 
+	//caching is on by default for the network backends only
+	if (cache_parse_options(&args, d.type != E_FSTYPE_BIND))
+	{
+		res = -9;
+		goto out_free;
+	}
+	if (lazy_parse_options(&args))
+	{
+		res = -11;
+		goto out_free;
+	}
+	if (deadline_parse_options(&args))
+	{
+		res = -12;
+		goto out_free;
+	}
+	if (warm_parse_options(&args))
+	{
+		res = -13;
+		goto out_free;
+	}
+	if (iobuf_parse_options(&args))
+	{
+		res = -14;
+		goto out_free;
+	}
+	if (ctl_parse_options(&args))
+	{
+		res = -15;
+		goto out_free;
+	}
+#if FUSE_USE_VERSION >= 30
+	//with the writeback cache the kernel keeps its own size and mtime of
+	//files, only a local tree has no other writers for it to miss
+	if (compat_parse_options(&args, d.type == E_FSTYPE_BIND))
+	{
+		res = -10;
+		goto out_free;
+	}
+#endif
+
 	if (d.type == E_FSTYPE_NFS)
 		res = _env_init_nfs(&d, &args);
 	else if (d.type == E_FSTYPE_SMB)
@@ -1114,8 +2671,8 @@ int main(int argc, char *argv[])
 		goto out_free;
 	}
 
-	//对于NFS和SMB目前始终开启单线程！
-	if (!d.flag_singlethread && d.type != E_FSTYPE_BIND &&
+	//对于NFS目前始终开启单线程！SMB 的 smb2_context 只由 smbengine 的事件循环线程访问
+	if (!d.flag_singlethread && d.type == E_FSTYPE_NFS &&
 		fuse_opt_add_arg(&args, "-s"))
 	{
 		res = -8;
@@ -1126,7 +2683,11 @@ int main(int argc, char *argv[])
 	LOG("=======================================\n");
 	LOG("Starting fuse_main()\n");
 show_help:
-	res = fuse_main(args.argc, args.argv, &nfs_oper, NULL);
+#if FUSE_USE_VERSION >= 30
+	res = fuse_main(args.argc, args.argv, compat_wrap(ctl_wrap(warm_wrap(owner_wrap(cache_wrap(lazy_wrap(&nfs_oper)))))), NULL);
+#else
+	res = fuse_main(args.argc, args.argv, ctl_wrap(warm_wrap(owner_wrap(cache_wrap(lazy_wrap(&nfs_oper))))), NULL);
+#endif
 	if (res2 == -1)
 	{
 		nfs_help();
@@ -0,0 +1,154 @@
+/*
+  fusenfs: declarations shared between the backend and middleware modules
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifndef FUSENFS_H_
+#define FUSENFS_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if FUSE_USE_VERSION >= 30
+#include <utime.h>
+
+/* The backends and the cache keep the FUSE 2 operation table, fusecompat.c
+ * maps it onto the libfuse3 one: fgetattr/ftruncate are getattr/truncate
+ * with a file, rename has flags, readdir fills with flags.
+ */
+typedef int (*fs_fill_dir_t)(void *buf, const char *name,
+							 const struct stat *stbuf, off_t off);
+
+struct fs_operations
+{
+	int (*getattr)(const char *, struct stat *);
+	int (*readlink)(const char *, char *, size_t);
+	int (*mknod)(const char *, mode_t, dev_t);
+	int (*mkdir)(const char *, mode_t);
+	int (*unlink)(const char *);
+	int (*rmdir)(const char *);
+	int (*symlink)(const char *, const char *);
+	int (*rename)(const char *, const char *);
+	int (*link)(const char *, const char *);
+	int (*chmod)(const char *, mode_t);
+	int (*chown)(const char *, uid_t, gid_t);
+	int (*truncate)(const char *, off_t);
+	int (*utime)(const char *, struct utimbuf *);
+	int (*open)(const char *, struct fuse_file_info *);
+	int (*read)(const char *, char *, size_t, off_t, struct fuse_file_info *);
+	int (*write)(const char *, const char *, size_t, off_t, struct fuse_file_info *);
+	int (*statfs)(const char *, struct statvfs *);
+	int (*flush)(const char *, struct fuse_file_info *);
+	int (*release)(const char *, struct fuse_file_info *);
+	int (*fsync)(const char *, int, struct fuse_file_info *);
+	int (*setxattr)(const char *, const char *, const char *, size_t, int);
+	int (*getxattr)(const char *, const char *, char *, size_t);
+	int (*listxattr)(const char *, char *, size_t);
+	int (*removexattr)(const char *, const char *);
+	int (*opendir)(const char *, struct fuse_file_info *);
+	int (*readdir)(const char *, void *, fs_fill_dir_t, off_t, struct fuse_file_info *);
+	int (*releasedir)(const char *, struct fuse_file_info *);
+	int (*fsyncdir)(const char *, int, struct fuse_file_info *);
+	void *(*init)(struct fuse_conn_info *conn);
+	void (*destroy)(void *);
+	int (*access)(const char *, int);
+	int (*create)(const char *, mode_t, struct fuse_file_info *);
+	int (*ftruncate)(const char *, off_t, struct fuse_file_info *);
+	int (*fgetattr)(const char *, struct stat *, struct fuse_file_info *);
+	int (*lock)(const char *, struct fuse_file_info *, int cmd, struct flock *);
+	int (*utimens)(const char *, const struct timespec tv[2]);
+	unsigned int flag_nullpath_ok : 1;
+	unsigned int flag_utime_omit_ok : 1;
+	int (*write_buf)(const char *, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *);
+	int (*read_buf)(const char *, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *);
+	int (*flock)(const char *, struct fuse_file_info *, int op);
+	int (*fallocate)(const char *, int, off_t, off_t, struct fuse_file_info *);
+	ssize_t (*copy_file_range)(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+							   const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+							   size_t size, int flags);
+	off_t (*lseek)(const char *, off_t off, int whence, struct fuse_file_info *);
+};
+#else
+typedef fuse_fill_dir_t fs_fill_dir_t;
+#define fs_operations fuse_operations
+#endif
+
+extern struct nfsdata d;
+extern struct fs_operations nfs_oper;
+void LOG(const char *__restrict __fmt, ...);
+
+/* fusenfs.c: deadlines of the calls to the server, by class of operation */
+enum deadline_class
+{
+	DEADLINE_META,
+	DEADLINE_READ,
+	DEADLINE_WRITE,
+};
+int deadline_parse_options(struct fuse_args *args);
+int deadline_tune(struct fuse_args *args, int apply);
+int deadline_ms(enum deadline_class c);
+int deadline_stats(char *buf, size_t size);
+
+/* fusenfs.c: attributes are cached as the server sent them, the backend's
+ * map turns the owner into the one the calling user sees when served
+ */
+void owner_map(void (*map)(struct stat *stbuf));
+struct fs_operations *owner_wrap(struct fs_operations *oper);
+
+/* fusenfs.c: readdir entries whose attributes are complete go through
+ * fill_dir_attr(), the fillers stacked above ask fill_dir_has_attr()
+ */
+int fill_dir_attr(fs_fill_dir_t filler, void *buf, const char *name,
+				  const struct stat *stbuf, off_t off);
+int fill_dir_has_attr(void);
+
+/* fusecache.c: caching middleware stacked on top of any backend table */
+int cache_parse_options(struct fuse_args *args, int on);
+struct fs_operations *cache_wrap(struct fs_operations *oper);
+void cache_invalidate(const char *path);
+void cache_invalidate_dir(const char *path);
+void cache_invalidate_prefix(const char *prefix);
+int cache_stat_enabled(void);
+int cache_dir_enabled(void);
+int cache_known_size(const char *path, off_t *size);
+void cache_drop(const char *prefix);
+int cache_tune(struct fuse_args *args, int apply);
+int cache_stats(char *buf, size_t size);
+
+/* fuselazy.c: mount first, connect to the server in the background */
+int lazy_parse_options(struct fuse_args *args);
+int lazy_connect(int (*connect)(void));
+struct fs_operations *lazy_wrap(struct fs_operations *oper);
+
+/* fusewarm.c: walk a subtree through the mount to fill the caches */
+int warm_parse_options(struct fuse_args *args);
+struct fs_operations *warm_wrap(struct fs_operations *oper);
+int warm_stats(char *buf, size_t size);
+
+/* fusectl.c: control socket of the mount, the backend registers its part */
+struct ctl_backend
+{
+	//one or more lines of counters and state
+	int (*stats)(char *buf, size_t size);
+	//options that can change while mounted, parsed like at startup; set
+	//runs it first with apply 0 to check them all, then with apply 1
+	int (*tune)(struct fuse_args *args, int apply);
+	//data buffered in the backend goes to the server
+	int (*flush)(void);
+	//lost servers or sessions are connected again now
+	int (*reconnect)(void);
+};
+int ctl_parse_options(struct fuse_args *args);
+void ctl_backend(const struct ctl_backend *backend);
+struct fs_operations *ctl_wrap(struct fs_operations *oper);
+
+/* fusecompat.c: libfuse3 table, kernel capabilities and notifications */
+#if FUSE_USE_VERSION >= 30
+int compat_parse_options(struct fuse_args *args, int writeback);
+struct fuse_operations *compat_wrap(struct fs_operations *oper);
+#endif
+void compat_invalidate(const char *path);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+  fusenfsctl: send a command to the control socket of a fusenfs mount
+
+  fusenfsctl SOCKET COMMAND [ARG...]
+
+  SOCKET is the ctl_socket= of the mount. The reply of the daemon is
+  printed as it comes, the exit status is 0 when it ends with "ok".
+  "fusenfsctl SOCKET help" lists the commands.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CTL_LINE_MAX 4096
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: fusenfsctl SOCKET COMMAND [ARG...]\n"
+			"    stats | drop PREFIX | set OPT[,OPT...] | flush | reconnect | help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	char line[CTL_LINE_MAX], buf[4096], last[8] = "";
+	size_t len = 0, llen = 0;
+	ssize_t n;
+	int i, fd;
+
+	if (argc < 3)
+	{
+		usage();
+		return 2;
+	}
+	if (strlen(argv[1]) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "fusenfsctl: socket path too long\n");
+		return 2;
+	}
+	strcpy(addr.sun_path, argv[1]);
+
+	for (i = 2; i < argc; i++)
+	{
+		size_t alen = strlen(argv[i]);
+		if (len + alen + 2 > sizeof(line))
+		{
+			fprintf(stderr, "fusenfsctl: command too long\n");
+			return 2;
+		}
+		if (i > 2)
+			line[len++] = ' ';
+		memcpy(line + len, argv[i], alen);
+		len += alen;
+	}
+	line[len++] = '\n';
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "fusenfsctl: %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	if (write(fd, line, len) != (ssize_t)len)
+	{
+		fprintf(stderr, "fusenfsctl: %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	shutdown(fd, SHUT_WR);
+
+	//the start of the current line, enough to tell "ok" from the rest
+	while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (buf[i] == '\n')
+			{
+				last[llen < sizeof(last) - 1 ? llen : sizeof(last) - 1] = '\0';
+				llen = 0;
+			}
+			else if (llen < sizeof(last) - 1)
+				last[llen++] = buf[i];
+			else
+				llen++;
+		}
+		if (n > 0)
+			fwrite(buf, 1, n, stdout);
+	}
+	close(fd);
+	return strcmp(last, "ok") ? 1 : 0;
+}
@@ -6,12 +6,14 @@
   See the file COPYING.LIB
 */
 
-#define FUSE_USE_VERSION 26
-
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
 #include <fuse_merge.h>
 #include <fuse.h>
 #include <stdio.h>
@@ -26,6 +28,7 @@
 #include <poll.h>
 #endif
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -37,13 +40,22 @@
 #include <win32/win32_compat.h>
 #endif
 
+#include "fusenfs.h"
+#include "smbengine.h"
+#include "iobuf.h"
+
 #ifndef DTTOIF
 /*安卓8.1系统dirent.h 不带这个宏定义*/
 #define DTTOIF(dirtype) ((dirtype) << 12)
 #endif
 
-extern struct nfsdata d;
-void LOG(const char *__restrict __fmt, ...);
+#define SMB_DEFAULT_DEPTH 16
+#define SMB_DEFAULT_WBUF_KB 1024
+#define SMB_MAX_SESSIONS 8
+#define SMB_DEFAULT_HANDLE_TIMEOUT 5
+#define SMB_MAX_PARKED 64
+#define SMB_DEFAULT_NOTIFY 64
+#define SMB_DEFAULT_SMALL_FILE_KB 64
 
 static void fill_stat(struct stat *stbuf, struct smb2_stat_64 *st)
 {
@@ -52,8 +64,6 @@ static void fill_stat(struct stat *stbuf, struct smb2_stat_64 *st)
 	stbuf->st_mode = st->st_mode;
 	stbuf->st_nlink = st->smb2_nlink;
 	stbuf->st_size = st->smb2_size;
-	stbuf->st_uid = fuse_get_context()->uid;
-	stbuf->st_gid = fuse_get_context()->gid;
 	//stbuf->st_rdev         = st->smb2_rdev;
 	//stbuf->st_blksize      = st->smb2_blksize;
 	//stbuf->st_blocks       = st->smb2_blocks;
@@ -75,6 +85,782 @@ static void fill_stat(struct stat *stbuf, struct smb2_stat_64 *st)
 #endif
 }
 
+//the share has no owners, everything belongs to the user asking
+static void smb_owner(struct stat *stbuf)
+{
+	stbuf->st_uid = fuse_get_context()->uid;
+	stbuf->st_gid = fuse_get_context()->gid;
+}
+
+struct smb_opts
+{
+	unsigned int depth;
+	unsigned int wbuf_kb;
+	unsigned int sessions;
+	unsigned int handle_timeout;
+	unsigned int notify;
+	unsigned int small_file_kb;
+};
+
+static struct smb_opts smb_opts = {
+	.depth = SMB_DEFAULT_DEPTH,
+	.wbuf_kb = SMB_DEFAULT_WBUF_KB,
+	.sessions = 1,
+	.handle_timeout = SMB_DEFAULT_HANDLE_TIMEOUT,
+	.notify = SMB_DEFAULT_NOTIFY,
+	.small_file_kb = SMB_DEFAULT_SMALL_FILE_KB,
+};
+
+/* The session pool: connections to the share, each with its own engine.
+ * session[0] starts on d.v_nfs. Every FUSE worker sends its requests
+ * through one session, an open file stays with the session that opened it
+ * and large reads and writes are striped across all of them.
+ */
+static struct smb_engine *session[SMB_MAX_SESSIONS];
+static struct smb2_context *session_smb2[SMB_MAX_SESSIONS];
+static unsigned int nsessions;
+//open files and directories of each session, a lost one waits for them
+static unsigned int session_handles[SMB_MAX_SESSIONS];
+
+static pthread_key_t session_key;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_session;
+
+/* one leg of a striped transfer */
+struct smb_stripe
+{
+	struct smb_engine *engine;
+	struct smb2fh *fh;
+};
+
+/* fi->fh of an open file */
+struct smb_file
+{
+	struct smb2fh *fh;
+	//session that opened fh
+	unsigned int sess;
+	char *path;
+	int flags;
+	pthread_mutex_t lock;
+	//handles on the other sessions, opened by the first large transfer
+	pthread_mutex_t chlock;
+	int chopen;
+	struct smb2fh *chfh[SMB_MAX_SESSIONS];
+	//small sequential writes not sent to the server yet
+	char *wbuf;
+	size_t wlen;
+	off_t woff;
+	//first failed write-behind, reported by flush/fsync
+	int werr;
+	//head of the file read by the open compound, fh is opened on demand
+	char *sbuf;
+	size_t slen;
+	uint64_t ssize;
+	//released but kept open for reuse until then
+	time_t parked_until;
+	//flushes writing it out without files_lock, release waits for them
+	unsigned int pins;
+	struct smb_file *next;
+	struct smb_file **pprev;
+};
+
+/* files holds the open files, parked the released ones whose handles are
+ * kept for smb_handle_timeout seconds
+ */
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t files_cond = PTHREAD_COND_INITIALIZER;
+static struct smb_file *files;
+static struct smb_file *parked;
+static unsigned int nparked;
+//open files holding an sbuf
+static unsigned int nsmall;
+
+static pthread_t reaper;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+static int reaper_started;
+static int reaper_stop;
+
+static inline struct smb_file *get_file(struct fuse_file_info *fi)
+{
+	return (struct smb_file *)fi->fh;
+}
+
+/* index of the session the calling worker is bound to, a dead one is
+ * passed over for the next live session
+ */
+static unsigned int smb_session_index(void)
+{
+	uintptr_t idx = (uintptr_t)pthread_getspecific(session_key);
+	unsigned int i;
+
+	if (!idx)
+	{
+		pthread_mutex_lock(&session_lock);
+		idx = next_session++ % nsessions + 1;
+		pthread_mutex_unlock(&session_lock);
+		pthread_setspecific(session_key, (void *)idx);
+	}
+	for (i = 0; i < nsessions; i++)
+	{
+		unsigned int k = (idx - 1 + i) % nsessions;
+		if (!smb_engine_dead(session[k]))
+			return k;
+	}
+	return idx - 1;
+}
+
+static inline struct smb_engine *smb_session(void)
+{
+	return session[smb_session_index()];
+}
+
+static time_t smb_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* called with files_lock held */
+static void smb_file_link(struct smb_file **list, struct smb_file *f)
+{
+	f->next = *list;
+	if (*list)
+		(*list)->pprev = &f->next;
+	f->pprev = list;
+	*list = f;
+}
+
+/* called with files_lock held */
+static void smb_file_unlink(struct smb_file *f)
+{
+	*f->pprev = f->next;
+	if (f->next)
+		f->next->pprev = f->pprev;
+	f->next = NULL;
+	f->pprev = NULL;
+}
+
+/* Split [offset, offset + size) into pieces of at most the smallest
+ * MaxRead/MaxWrite of the legs and send them round robin over the legs as
+ * one batch, so they are all in flight at the same time.
+ * Returns the number of bytes transferred up to the first short piece.
+ */
+static int smb_pipeline(enum smb_op op, const struct smb_stripe *s, int ns,
+						uint8_t *buf, size_t size, off_t offset)
+{
+	struct smb_req stack_reqs[8], *reqs = stack_reqs;
+	uint32_t chunk = 0, max;
+	int i, n, res;
+	size_t done = 0;
+
+	for (i = 0; i < ns; i++)
+	{
+		max = op == SMB_OP_READ ? smb_engine_max_read(s[i].engine)
+								: smb_engine_max_write(s[i].engine);
+		if (!chunk || max < chunk)
+			chunk = max;
+	}
+
+	n = (size + chunk - 1) / chunk;
+	if (!n)
+		return 0;
+	if (n > 8 && !(reqs = malloc(n * sizeof(struct smb_req))))
+		return -ENOMEM;
+	memset(reqs, 0, n * sizeof(struct smb_req));
+
+	for (i = 0; i < n; i++)
+	{
+		reqs[i].op = op;
+		reqs[i].engine = s[i % ns].engine;
+		reqs[i].fh = s[i % ns].fh;
+		reqs[i].buf = buf + (size_t)i * chunk;
+		reqs[i].count = size - (size_t)i * chunk < chunk ? size - (size_t)i * chunk : chunk;
+		reqs[i].offset = offset + (off_t)i * chunk;
+	}
+
+	res = smb_batch_run(reqs, n);
+
+	//a lost session must not fail the transfer, redo its pieces on the first leg
+	for (i = 0; !res && i < n; i++)
+	{
+		if (reqs[i].status == -EIO && reqs[i].engine != s[0].engine &&
+			smb_engine_dead(reqs[i].engine))
+		{
+			reqs[i].fh = s[0].fh;
+			smb_engine_call(s[0].engine, &reqs[i]);
+		}
+	}
+
+	for (i = 0; !res && i < n; i++)
+	{
+		if (reqs[i].status < 0)
+		{
+			if (!done)
+				res = reqs[i].status;
+			break;
+		}
+		done += reqs[i].status;
+		if ((uint32_t)reqs[i].status < reqs[i].count)
+			break;
+	}
+
+	if (reqs != stack_reqs)
+		free(reqs);
+	return res < 0 ? res : (int)done;
+}
+
+/* a file opened by READFILE gets its handle when it needs one */
+static int smb_file_handle(struct smb_file *f)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&f->chlock);
+	if (!f->fh)
+	{
+		struct smb_req req = {.op = SMB_OP_OPEN, .path = f->path + 1,
+							  .flags = f->flags & O_ACCMODE};
+		res = smb_engine_call(session[f->sess], &req);
+		if (res >= 0)
+		{
+			f->fh = req.result;
+			res = 0;
+		}
+	}
+	pthread_mutex_unlock(&f->chlock);
+	return res;
+}
+
+/* Fill s with the legs f can be striped over, its own session first. The
+ * file is opened on the other sessions the first time this is asked.
+ */
+static int smb_file_stripe(struct smb_file *f, struct smb_stripe *s)
+{
+	struct smb_req reqs[SMB_MAX_SESSIONS];
+	//a reconnect may add sessions meanwhile
+	unsigned int i, ns = __atomic_load_n(&nsessions, __ATOMIC_ACQUIRE);
+	int n = 1;
+
+	s[0].engine = session[f->sess];
+	s[0].fh = f->fh;
+	if (ns < 2)
+		return n;
+
+	pthread_mutex_lock(&f->chlock);
+	if (!f->chopen)
+	{
+		f->chopen = 1;
+		memset(reqs, 0, sizeof(reqs));
+		for (i = 0; i < ns; i++)
+		{
+			reqs[i].engine = session[i];
+			reqs[i].op = SMB_OP_OPEN;
+			reqs[i].path = f->path + 1;
+			//O_CREAT/O_TRUNC/O_EXCL were applied by the first open
+			reqs[i].flags = f->flags & O_ACCMODE;
+		}
+		//the session of fh takes no part, move the last one into its slot
+		reqs[f->sess] = reqs[ns - 1];
+		smb_batch_run(reqs, ns - 1);
+		for (i = 0; i < ns - 1; i++)
+		{
+			unsigned int k = i == f->sess ? ns - 1 : i;
+			if (reqs[i].status < 0)
+				LOG("smb session %u: open [%s] failed. %s\n", k, f->path,
+					strerror(-reqs[i].status));
+			else
+				f->chfh[k] = reqs[i].result;
+		}
+	}
+	for (i = 0; i < ns; i++)
+	{
+		if (f->chfh[i] && !smb_engine_dead(session[i]))
+		{
+			s[n].engine = session[i];
+			s[n].fh = f->chfh[i];
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&f->chlock);
+	return n;
+}
+
+/* read or write through f, striped when the transfer spans several pieces */
+static int smb_file_io(struct smb_file *f, enum smb_op op, uint8_t *buf,
+					   size_t size, off_t offset)
+{
+	struct smb_stripe s[SMB_MAX_SESSIONS];
+	struct smb_engine *e = session[f->sess];
+	uint32_t chunk = op == SMB_OP_READ ? smb_engine_max_read(e)
+									   : smb_engine_max_write(e);
+	int ns = 1, res;
+
+	if ((res = smb_file_handle(f)) < 0)
+		return res;
+
+	s[0].engine = e;
+	s[0].fh = f->fh;
+	if (size > chunk)
+		ns = smb_file_stripe(f, s);
+	return smb_pipeline(op, s, ns, buf, size, offset);
+}
+
+/* called with f->lock held */
+static int smb_file_flush_wbuf(struct smb_file *f)
+{
+	int res;
+
+	if (!f->wlen)
+		return 0;
+	res = smb_file_io(f, SMB_OP_WRITE, (uint8_t *)f->wbuf, f->wlen, f->woff);
+	if (res >= 0 && (size_t)res < f->wlen)
+		res = -EIO;
+	f->wlen = 0;
+	if (res < 0)
+	{
+		if (!f->werr)
+			f->werr = res;
+		return res;
+	}
+	return 0;
+}
+
+static int smb_file_sync(struct smb_file *f)
+{
+	int res;
+
+	pthread_mutex_lock(&f->lock);
+	res = smb_file_flush_wbuf(f);
+	pthread_mutex_unlock(&f->lock);
+	return res;
+}
+
+/* Metadata of a file must include what is still in its write buffers:
+ * write out those of the open files of path, of all with NULL. The files
+ * are pinned under files_lock and synced after it is dropped, opens and
+ * releases of other files do not wait for the server.
+ */
+static int smb_flush_path(const char *path)
+{
+	struct smb_file *f, **list = NULL, **grown;
+	size_t n = 0, size = 0, i;
+	int res = 0, err;
+
+	pthread_mutex_lock(&files_lock);
+	for (f = files; f; f = f->next)
+	{
+		if (!f->wlen || (path && strcmp(f->path, path)))
+			continue;
+		if (n == size)
+		{
+			size = size ? size * 2 : 16;
+			if (!(grown = realloc(list, size * sizeof(*list))))
+			{
+				res = -ENOMEM;
+				break;
+			}
+			list = grown;
+		}
+		f->pins++;
+		list[n++] = f;
+	}
+	pthread_mutex_unlock(&files_lock);
+
+	for (i = 0; i < n; i++)
+	{
+		if ((err = smb_file_sync(list[i])) < 0 && !res)
+			res = err;
+	}
+
+	pthread_mutex_lock(&files_lock);
+	for (i = 0; i < n; i++)
+		list[i]->pins--;
+	if (n)
+		pthread_cond_broadcast(&files_cond);
+	pthread_mutex_unlock(&files_lock);
+	free(list);
+	return res;
+}
+
+/* contents of path change locally, the READFILE heads of it are stale */
+static void smb_drop_small(const char *path)
+{
+	struct smb_file *f;
+
+	pthread_mutex_lock(&files_lock);
+	for (f = files; nsmall && f; f = f->next)
+	{
+		if (f->sbuf && !strcmp(f->path, path))
+		{
+			pthread_mutex_lock(&f->lock);
+			iobuf_free(f->sbuf, f->slen);
+			f->sbuf = NULL;
+			nsmall--;
+			pthread_mutex_unlock(&f->lock);
+		}
+	}
+	pthread_mutex_unlock(&files_lock);
+}
+
+/* one op request per open handle of f on a live session */
+static int smb_file_handles(struct smb_file *f, enum smb_op op, struct smb_req *reqs)
+{
+	unsigned int i;
+	int n = 0;
+
+	memset(reqs, 0, SMB_MAX_SESSIONS * sizeof(struct smb_req));
+	pthread_mutex_lock(&f->chlock);
+	if (f->fh)
+	{
+		reqs[n].engine = session[f->sess];
+		reqs[n].op = op;
+		reqs[n++].fh = f->fh;
+	}
+	for (i = 0; i < nsessions; i++)
+	{
+		//pieces of a lost session were redone on the session of fh
+		if (f->chfh[i] && !smb_engine_dead(session[i]))
+		{
+			reqs[n].engine = session[i];
+			reqs[n].op = op;
+			reqs[n++].fh = f->chfh[i];
+		}
+	}
+	pthread_mutex_unlock(&f->chlock);
+	return n;
+}
+
+static void smb_file_close(struct smb_file *f)
+{
+	struct smb_req reqs[SMB_MAX_SESSIONS];
+	int n = smb_file_handles(f, SMB_OP_CLOSE, reqs);
+	smb_batch_run(reqs, n);
+
+	__atomic_sub_fetch(&session_handles[f->sess], 1, __ATOMIC_RELEASE);
+	pthread_mutex_destroy(&f->chlock);
+	pthread_mutex_destroy(&f->lock);
+	iobuf_free(f->sbuf, f->slen);
+	iobuf_free(f->wbuf, (size_t)smb_opts.wbuf_kb * 1024);
+	free(f->path);
+	free(f);
+}
+
+/* close a chain of files linked through next */
+static void smb_file_close_list(struct smb_file *list)
+{
+	struct smb_file *f;
+
+	while ((f = list))
+	{
+		list = f->next;
+		smb_file_close(f);
+	}
+}
+
+/* Keep the handles of a released file open for reuse by the next open of
+ * the same path. Returns 0 when f has to be closed instead.
+ */
+static int smb_park(struct smb_file *f)
+{
+	struct smb_file *p, *oldest = NULL;
+	unsigned int timeout = __atomic_load_n(&smb_opts.handle_timeout, __ATOMIC_RELAXED);
+
+	if (!timeout || f->werr || !f->fh || smb_engine_dead(session[f->sess]))
+		return 0;
+
+	pthread_mutex_lock(&files_lock);
+	if (!reaper_started || reaper_stop)
+	{
+		pthread_mutex_unlock(&files_lock);
+		return 0;
+	}
+	f->parked_until = smb_now() + timeout;
+	smb_file_link(&parked, f);
+	if (++nparked > SMB_MAX_PARKED)
+	{
+		for (p = parked; p; p = p->next)
+		{
+			if (!oldest || p->parked_until <= oldest->parked_until)
+				oldest = p;
+		}
+		smb_file_unlink(oldest);
+		nparked--;
+	}
+	pthread_mutex_unlock(&files_lock);
+
+	if (oldest)
+		smb_file_close(oldest);
+	return 1;
+}
+
+/* take a parked file of path whose handle allows accmode back into use */
+static struct smb_file *smb_unpark(const char *path, int accmode)
+{
+	struct smb_file *f;
+
+	pthread_mutex_lock(&files_lock);
+	for (f = parked; f; f = f->next)
+	{
+		int mode = f->flags & O_ACCMODE;
+		if ((mode == accmode || mode == O_RDWR) && !strcmp(f->path, path))
+		{
+			smb_file_unlink(f);
+			nparked--;
+			smb_file_link(&files, f);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&files_lock);
+	return f;
+}
+
+/* Close the parked handles of path and, with subtree, of everything below
+ * it. Our own unlink and rename would hit their share mode otherwise.
+ */
+static void smb_drop_parked(const char *path, int subtree)
+{
+	struct smb_file *f, *next, *list = NULL;
+	size_t len = strlen(path);
+
+	pthread_mutex_lock(&files_lock);
+	for (f = parked; f; f = next)
+	{
+		next = f->next;
+		if (!strcmp(f->path, path) ||
+			(subtree && !strncmp(f->path, path, len) && f->path[len] == '/'))
+		{
+			smb_file_unlink(f);
+			nparked--;
+			f->next = list;
+			list = f;
+		}
+	}
+	pthread_mutex_unlock(&files_lock);
+	smb_file_close_list(list);
+}
+
+/* closes parked handles once their time is up */
+static void *smb_reaper(void *arg)
+{
+	struct smb_file *f, *next, *list;
+	struct timespec ts;
+	time_t now;
+
+	pthread_mutex_lock(&files_lock);
+	for (;;)
+	{
+		if (!reaper_stop)
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&reaper_cond, &files_lock, &ts);
+		}
+
+		list = NULL;
+		now = smb_now();
+		for (f = parked; f; f = next)
+		{
+			next = f->next;
+			if (reaper_stop || f->parked_until <= now)
+			{
+				smb_file_unlink(f);
+				nparked--;
+				f->next = list;
+				list = f;
+			}
+		}
+		if (list)
+		{
+			pthread_mutex_unlock(&files_lock);
+			smb_file_close_list(list);
+			pthread_mutex_lock(&files_lock);
+		}
+		if (reaper_stop && !parked)
+			break;
+	}
+	pthread_mutex_unlock(&files_lock);
+	return NULL;
+}
+
+#ifdef HAVE_SMB2_NOTIFY_CHANGE
+/* MS-SMB2 completion filter and MS-FSCC FILE_NOTIFY_INFORMATION actions */
+#define SMB_NOTIFY_FILTER 0x1f //FILE_NAME|DIR_NAME|ATTRIBUTES|SIZE|LAST_WRITE
+#define SMB_NOTIFY_MODIFIED 3
+
+/* A CHANGE_NOTIFY watch on a listed directory. The server reports every
+ * change below it, so what the cache holds for it can stay valid longer.
+ */
+struct smb_watch
+{
+	struct smb_req req;
+	char *path;
+	//last listing of the directory, the least recent watch is evicted
+	time_t used;
+	//withdrawn and no longer counted, freed once the server ended it
+	int evicted;
+	struct smb_watch *next;
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct smb_watch *watches;
+static unsigned int nwatches;
+
+static void smb_watch_free(struct smb_watch *w)
+{
+	struct smb_watch **wp;
+
+	pthread_mutex_lock(&watch_lock);
+	for (wp = &watches; *wp; wp = &(*wp)->next)
+	{
+		if (*wp == w)
+		{
+			*wp = w->next;
+			if (!w->evicted)
+				nwatches--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&watch_lock);
+	free(w->path);
+	free(w);
+}
+
+/* runs on the loop thread of the session the watch is armed on */
+static void smb_watch_event(struct smb_req *req, int status, void *command_data)
+{
+	struct smb_watch *w = (struct smb_watch *)req;
+	struct smb_change *c;
+	size_t dlen = strcmp(w->path, "/") ? strlen(w->path) : 0;
+	char *path;
+
+	if (status < 0)
+	{
+		//removed directory or lost session, changes may have gone unseen
+		LOG("smb notify on [%s] ended. %s\n", w->path, strerror(-status));
+		if (status != -ECANCELED)
+		{
+			cache_invalidate_prefix(w->path);
+			compat_invalidate(w->path);
+		}
+		smb_watch_free(w);
+		return;
+	}
+	if (!command_data)
+	{
+		//too many changes for the reply, the server only says something changed
+		cache_invalidate_prefix(w->path);
+		compat_invalidate(w->path);
+		return;
+	}
+
+	for (c = command_data; c; c = c->next)
+	{
+		path = malloc(dlen + strlen(c->name) + 2);
+		if (!path)
+		{
+			cache_invalidate_prefix(w->path);
+			compat_invalidate(w->path);
+			break;
+		}
+		memcpy(path, w->path, dlen);
+		path[dlen] = '/';
+		strcpy(path + dlen + 1, c->name);
+		LOG("smb notify [%s] action %u\n", path, c->action);
+
+		if (c->action == SMB_NOTIFY_MODIFIED)
+			cache_invalidate(path);
+		else
+		{
+			cache_invalidate_prefix(path);
+			//the kernel may keep the listing of the directory
+			compat_invalidate(w->path);
+		}
+		//pages of the file in the kernel, with the writeback cache too
+		compat_invalidate(path);
+		free(path);
+	}
+}
+
+/* Watch a directory that was just listed. At smb_notify watches the one
+ * listed least recently is withdrawn for it.
+ */
+static void smb_watch_dir(const char *path, unsigned int sess)
+{
+	struct smb_watch *w, *oldest = NULL;
+	time_t now = smb_now();
+
+	pthread_mutex_lock(&watch_lock);
+	for (w = watches; w; w = w->next)
+	{
+		if (w->evicted)
+			continue;
+		if (!strcmp(w->path, path))
+			break;
+		if (!oldest || w->used < oldest->used)
+			oldest = w;
+	}
+	if (w)
+	{
+		w->used = now;
+		pthread_mutex_unlock(&watch_lock);
+		return;
+	}
+	if (nwatches >= smb_opts.notify && oldest)
+	{
+		LOG("smb notify on [%s] evicted for [%s]\n", oldest->path, path);
+		oldest->evicted = 1;
+		nwatches--;
+		//watch_lock keeps it from being freed meanwhile
+		smb_engine_unwatch(oldest->req.engine, &oldest->req);
+	}
+	if (!(w = calloc(1, sizeof(struct smb_watch))) || !(w->path = strdup(path)))
+	{
+		pthread_mutex_unlock(&watch_lock);
+		free(w);
+		return;
+	}
+	w->used = now;
+	w->req.op = SMB_OP_NOTIFY;
+	w->req.path = w->path + 1;
+	w->req.flags = SMB_NOTIFY_FILTER;
+	w->req.notify = smb_watch_event;
+	//armed under watch_lock, an eviction finds it on its engine
+	if (smb_engine_watch(session[sess], &w->req) < 0)
+	{
+		pthread_mutex_unlock(&watch_lock);
+		free(w->path);
+		free(w);
+		return;
+	}
+	w->next = watches;
+	watches = w;
+	nwatches++;
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/* after the engines are gone no callback can run any more */
+static void smb_watch_free_all(void)
+{
+	struct smb_watch *w;
+
+	while ((w = watches))
+	{
+		watches = w->next;
+		free(w->path);
+		free(w);
+	}
+	nwatches = 0;
+}
+#else
+static inline void smb_watch_dir(const char *path, unsigned int sess)
+{
+}
+
+static inline void smb_watch_free_all(void)
+{
+}
+#endif
+
 static int fuse_nfs_getattr(const char *path, struct stat *stbuf)
 {
 	LOG("fuse_nfs_getattr entered [%s]\n", path);
@@ -82,7 +868,10 @@ static int fuse_nfs_getattr(const char *path, struct stat *stbuf)
 	struct smb2_stat_64 st;
 	memset(&st, 0, sizeof(st));
 
-	int res = smb2_stat(d.v_nfs, path + 1, &st);
+	smb_flush_path(path);
+
+	struct smb_req req = {.op = SMB_OP_STAT, .path = path + 1, .data = &st};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 		return res;
 
@@ -95,10 +884,17 @@ static int fuse_nfs_fgetattr(const char *path, struct stat *stbuf,
 {
 	LOG("fuse_nfs_fgetattr entered [%s]\n", path);
 
+	struct smb_file *f = get_file(fi);
 	struct smb2_stat_64 st;
 	memset(&st, 0, sizeof(st));
 
-	int res = smb2_fstat(d.v_nfs, (void *)fi->fh, &st);
+	smb_file_sync(f);
+
+	int res = smb_file_handle(f);
+	if (res < 0)
+		return res;
+	struct smb_req req = {.op = SMB_OP_FSTAT, .fh = f->fh, .data = &st};
+	res = smb_engine_call(session[f->sess], &req);
 	if (res < 0)
 		return res;
 
@@ -114,51 +910,86 @@ static int fuse_nfs_access(const char *path, int mask)
 static int fuse_nfs_readlink(const char *path, char *buf, size_t size)
 {
 	LOG("fuse_nfs_readlink entered [%s]\n", path);
-	int res = smb2_readlink(d.v_nfs, path + 1, buf, size - 1);
+	struct smb_req req = {.op = SMB_OP_READLINK, .path = path + 1,
+						  .buf = (uint8_t *)buf, .count = size};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 	{
-		printf("Error: %s (%s)\n", smb2_get_error(d.v_nfs), strerror(-errno));
+		LOG("smb2_readlink failed. %s\n", strerror(-res));
 		return res;
 	}
-	buf[res] = 0;
 	return 0;
 }
 
+/* fi->fh of an open directory, it is closed by the session that opened it */
+struct smb_dir
+{
+	struct smb2dir *dir;
+	unsigned int sess;
+};
+
 static int fuse_nfs_opendir(const char *path, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_opendir entered [%s]\n", path);
-	struct smb2dir *nfsdir;
-
-	nfsdir = smb2_opendir(d.v_nfs, path + 1);
-	if (!nfsdir)
+	struct smb_dir *dh = malloc(sizeof(struct smb_dir));
+	if (!dh)
+		return -ENOMEM;
+
+	struct smb_req req = {.op = SMB_OP_OPENDIR, .path = path + 1};
+	dh->sess = smb_session_index();
+	__atomic_add_fetch(&session_handles[dh->sess], 1, __ATOMIC_ACQUIRE);
+	int res = smb_engine_call(session[dh->sess], &req);
+	if (res < 0)
 	{
-		printf("smb2_opendir failed. %s\n", smb2_get_error(d.v_nfs));
-		return -errno;
+		LOG("smb2_opendir failed. %s\n", strerror(-res));
+		__atomic_sub_fetch(&session_handles[dh->sess], 1, __ATOMIC_RELEASE);
+		free(dh);
+		return res;
 	}
-	fi->fh = (uint64_t)nfsdir;
+	dh->dir = req.result;
+	fi->fh = (uint64_t)dh;
+
+	if (smb_opts.notify)
+		smb_watch_dir(path, dh->sess);
 	return 0;
 }
 
-static int fuse_nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+/* smb2_opendir() already fetched the whole listing, walking it is local.
+ * The enumeration carries the attributes of every entry, when they are
+ * complete they are passed on with fill_dir_attr() so the cache keeps them.
+ */
+static int fuse_nfs_readdir(const char *path, void *buf, fs_fill_dir_t filler,
 							off_t offset, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_readdir entered [%s]\n", path);
+	struct smb_dir *dh = (struct smb_dir *)fi->fh;
+	struct smb2_context *smb2 = session_smb2[dh->sess];
 
-	if (offset != smb2_telldir(d.v_nfs, (void *)fi->fh))
-		smb2_seekdir(d.v_nfs, (void *)fi->fh, offset);
+	if (offset != smb2_telldir(smb2, dh->dir))
+		smb2_seekdir(smb2, dh->dir, offset);
 
 	struct stat st;
-	memset(&st, 0, sizeof(st));
 	struct smb2dirent *nfsdirent;
-	while ((nfsdirent = smb2_readdir(d.v_nfs, (void *)fi->fh)))
+	while ((nfsdirent = smb2_readdir(smb2, dh->dir)))
 	{
-		st.st_ino = nfsdirent->st.smb2_ino;
+		memset(&st, 0, sizeof(st));
+		fill_stat(&st, &nfsdirent->st);
+		if (st.st_mode & S_IFMT)
+		{
+			//the enumeration has no link count
+			if (!st.st_nlink)
+				st.st_nlink = 1;
+			if (fill_dir_attr(filler, buf, nfsdirent->name, &st, smb2_telldir(smb2, dh->dir)))
+				break;
+			continue;
+		}
+
+		//no mode in the entry, only the type is known
 		switch (nfsdirent->st.smb2_type)
 		{
 		case SMB2_TYPE_LINK:
 			st.st_mode = DTTOIF(DT_LNK);
 			break;
-			break;
 		case SMB2_TYPE_DIRECTORY:
 			st.st_mode = DTTOIF(DT_DIR);
 			break;
@@ -167,8 +998,7 @@ static int fuse_nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			st.st_mode = DTTOIF(DT_REG);
 			break;
 		}
-
-		if (filler(buf, nfsdirent->name, &st, smb2_telldir(d.v_nfs, (void *)fi->fh)))
+		if (filler(buf, nfsdirent->name, &st, smb2_telldir(smb2, dh->dir)))
 			break;
 	}
 	return 0;
@@ -176,14 +1006,21 @@ static int fuse_nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 static int fuse_nfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
-	smb2_closedir(d.v_nfs, (void *)fi->fh);
+	struct smb_dir *dh = (struct smb_dir *)fi->fh;
+
+	//smb2_closedir() unlinks the directory from its context
+	struct smb_req req = {.op = SMB_OP_CLOSEDIR, .data = dh->dir};
+	smb_engine_call(session[dh->sess], &req);
+	__atomic_sub_fetch(&session_handles[dh->sess], 1, __ATOMIC_RELEASE);
+	free(dh);
 	return 0;
 }
 
 static int fuse_nfs_mkdir(const char *path, mode_t mode)
 {
 	LOG("fuse_nfs_mkdir entered [%s]\n", path);
-	int res = smb2_mkdir(d.v_nfs, path + 1);
+	struct smb_req req = {.op = SMB_OP_MKDIR, .path = path + 1};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 		return res;
 
@@ -193,7 +1030,9 @@ static int fuse_nfs_mkdir(const char *path, mode_t mode)
 static int fuse_nfs_unlink(const char *path)
 {
 	LOG("fuse_nfs_unlink entered [%s]\n", path);
-	int res = smb2_unlink(d.v_nfs, path + 1);
+	smb_drop_parked(path, 0);
+	struct smb_req req = {.op = SMB_OP_UNLINK, .path = path + 1};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 		return res;
 
@@ -203,7 +1042,9 @@ static int fuse_nfs_unlink(const char *path)
 static int fuse_nfs_rmdir(const char *path)
 {
 	LOG("fuse_nfs_mknod entered [%s]\n", path);
-	int res = smb2_rmdir(d.v_nfs, path + 1);
+	smb_drop_parked(path, 1);
+	struct smb_req req = {.op = SMB_OP_RMDIR, .path = path + 1};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 		return res;
 
@@ -218,7 +1059,11 @@ static int fuse_nfs_rmdir(const char *path)
 static int fuse_nfs_rename(const char *from, const char *to)
 {
 	LOG("fuse_nfs_rename entered [%s -> %s]\n", from, to);
-	int res = smb2_rename(d.v_nfs, from + 1, to + 1);
+	smb_flush_path(from);
+	smb_drop_parked(from, 1);
+	smb_drop_parked(to, 1);
+	struct smb_req req = {.op = SMB_OP_RENAME, .path = from + 1, .path2 = to + 1};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 		return res;
 
@@ -243,7 +1088,10 @@ static int fuse_nfs_chown(const char *path, uid_t uid, gid_t gid)
 static int fuse_nfs_truncate(const char *path, off_t size)
 {
 	LOG("fuse_nfs_truncate entered [%s]\n", path);
-	int res = smb2_truncate(d.v_nfs, path + 1, size);
+	smb_flush_path(path);
+	smb_drop_small(path);
+	struct smb_req req = {.op = SMB_OP_TRUNCATE, .path = path + 1, .offset = size};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 		return res;
 
@@ -254,7 +1102,14 @@ static int fuse_nfs_ftruncate(const char *path, off_t size,
 							  struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_ftruncate entered [%s]\n", path);
-	int res = smb2_ftruncate(d.v_nfs, (void *)fi->fh, size);
+	struct smb_file *f = get_file(fi);
+	smb_file_sync(f);
+	smb_drop_small(path);
+	int res = smb_file_handle(f);
+	if (res < 0)
+		return res;
+	struct smb_req req = {.op = SMB_OP_FTRUNCATE, .fh = f->fh, .offset = size};
+	res = smb_engine_call(session[f->sess], &req);
 	if (res < 0)
 		return res;
 
@@ -266,41 +1121,194 @@ static int fuse_nfs_utimens(const char *path, const struct timespec ts[2])
 	return 0;
 }
 
-static int fuse_nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static struct smb_file *smb_file_new(const char *path, int flags)
 {
-	LOG("fuse_nfs_create entered [%s]\n", path);
-	uint64_t rp = (uint64_t)smb2_open(d.v_nfs, path + 1, fi->flags);
-	if (!rp)
-		return -errno;
+	struct smb_file *f = calloc(1, sizeof(struct smb_file));
+	if (!f)
+		return NULL;
+	f->path = strdup(path);
+	if (!f->path)
+	{
+		free(f);
+		return NULL;
+	}
+	f->flags = flags;
+	f->sess = smb_session_index();
+	__atomic_add_fetch(&session_handles[f->sess], 1, __ATOMIC_ACQUIRE);
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_mutex_init(&f->chlock, NULL);
+	return f;
+}
+
+static void smb_file_add(struct smb_file *f, struct fuse_file_info *fi)
+{
+	pthread_mutex_lock(&files_lock);
+	smb_file_link(&files, f);
+	if (f->sbuf)
+		nsmall++;
+	pthread_mutex_unlock(&files_lock);
+
+	fi->fh = (uint64_t)f;
+}
+
+static int smb_file_open(const char *path, struct fuse_file_info *fi)
+{
+	struct smb_file *f = smb_file_new(path, fi->flags);
+	if (!f)
+		return -ENOMEM;
+
+	struct smb_req req = {.op = SMB_OP_OPEN, .path = path + 1, .flags = fi->flags};
+	int res = smb_engine_call(session[f->sess], &req);
+	if (res < 0)
+	{
+		smb_file_close(f);
+		return res;
+	}
+	f->fh = req.result;
+
+	smb_file_add(f, fi);
+	return 0;
+}
+
+/* Read-only opens of a file the cache knows to be at most smb_small_file KB
+ * fetch it in a CREATE+READ+CLOSE compound: it is then served without any
+ * further round trip, a read past what is buffered opens its handle.
+ */
+static int smb_file_readfile(const char *path, struct fuse_file_info *fi)
+{
+	struct smb_file *f = smb_file_new(path, fi->flags);
+	size_t size = (size_t)__atomic_load_n(&smb_opts.small_file_kb, __ATOMIC_RELAXED) * 1024;
+	uint64_t fsize;
+	char *buf;
+
+	if (!f)
+		return -ENOMEM;
+	if (size > smb_engine_max_read(session[f->sess]))
+		size = smb_engine_max_read(session[f->sess]);
+	if (!(buf = iobuf_alloc(size)))
+	{
+		smb_file_close(f);
+		return -ENOMEM;
+	}
+
+	struct smb_req req = {.op = SMB_OP_READFILE, .path = path + 1,
+						  .buf = (uint8_t *)buf, .count = size, .data = &fsize};
+	int res = smb_engine_call(session[f->sess], &req);
+	if (res < 0)
+	{
+		iobuf_free(buf, size);
+		smb_file_close(f);
+		return res;
+	}
+
+	f->slen = res;
+	f->ssize = fsize;
+	//a head that fails to move to a smaller buffer is simply not kept
+	f->sbuf = iobuf_shrink(buf, size, f->slen);
 
-	fi->fh = rp;
+	smb_file_add(f, fi);
 	return 0;
 }
 
+static int fuse_nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	LOG("fuse_nfs_create entered [%s]\n", path);
+	return smb_file_open(path, fi);
+}
+
 static int fuse_nfs_open(const char *path, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_open entered [%s]\n", path);
-	uint64_t rp = (uint64_t)smb2_open(d.v_nfs, path + 1, fi->flags);
-	if (!rp)
-		return -errno;
+	struct smb_file *f;
 
-	fi->fh = rp;
-	return 0;
+	if (!(fi->flags & (O_CREAT | O_EXCL | O_TRUNC)) &&
+		(f = smb_unpark(path, fi->flags & O_ACCMODE)))
+	{
+		LOG("fuse_nfs_open reusing the handle of [%s]\n", path);
+		//other clients may have written through their own handles meanwhile,
+		//whether the pages are kept is up to the cache's check
+		fi->fh = (uint64_t)f;
+		return 0;
+	}
+
+	//a file of unknown or larger size takes the plain open, its reads would
+	//not be served from the buffered head anyway
+	off_t size;
+	unsigned int small_kb = __atomic_load_n(&smb_opts.small_file_kb, __ATOMIC_RELAXED);
+	if (small_kb && (fi->flags & O_ACCMODE) == O_RDONLY &&
+		!(fi->flags & (O_CREAT | O_EXCL | O_TRUNC)) &&
+		!cache_known_size(path, &size) && size <= (off_t)small_kb * 1024)
+		return smb_file_readfile(path, fi);
+	return smb_file_open(path, fi);
 }
 
 static int fuse_nfs_read(const char *path, char *buf, size_t size,
 						 off_t offset, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_read entered [%s]\n", path);
-	int res = smb2_pread(d.v_nfs, (void *)fi->fh, (void *)buf, size, offset);
-	return res;
+	struct smb_file *f = get_file(fi);
+
+	pthread_mutex_lock(&f->lock);
+	int res = smb_file_flush_wbuf(f);
+	if (res < 0)
+	{
+		pthread_mutex_unlock(&f->lock);
+		return res;
+	}
+
+	//the head read at open covers it, or the whole file was read
+	if (f->sbuf && (f->slen == f->ssize || offset + size <= f->slen))
+	{
+		res = 0;
+		if ((uint64_t)offset < f->slen)
+		{
+			res = f->slen - offset < size ? f->slen - offset : size;
+			memcpy(buf, f->sbuf + offset, res);
+		}
+		pthread_mutex_unlock(&f->lock);
+		return res;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return smb_file_io(f, SMB_OP_READ, (uint8_t *)buf, size, offset);
 }
 
 static int fuse_nfs_write(const char *path, const char *buf, size_t size,
 						  off_t offset, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_write entered [%s]\n", path);
-	int res = smb2_pwrite(d.v_nfs, (void *)fi->fh, (void *)buf, size, offset);
+	struct smb_file *f = get_file(fi);
+	size_t wsize = (size_t)smb_opts.wbuf_kb * 1024;
+	int res;
+
+	smb_drop_small(path);
+
+	pthread_mutex_lock(&f->lock);
+	if (f->wlen && (offset != f->woff + (off_t)f->wlen || f->wlen + size > wsize) &&
+		(res = smb_file_flush_wbuf(f)) < 0)
+		goto out;
+
+	if (!f->wbuf && size < wsize)
+		f->wbuf = iobuf_alloc(wsize);
+	if (!f->wbuf || size >= wsize)
+	{
+		res = smb_file_io(f, SMB_OP_WRITE, (uint8_t *)buf, size, offset);
+		goto out;
+	}
+
+	if (!f->wlen)
+		f->woff = offset;
+	memcpy(f->wbuf + f->wlen, buf, size);
+	f->wlen += size;
+	res = size;
+	if (f->wlen == wsize)
+	{
+		int err = smb_file_flush_wbuf(f);
+		if (err < 0)
+			res = err;
+	}
+out:
+	pthread_mutex_unlock(&f->lock);
 	return res;
 }
 
@@ -311,7 +1319,8 @@ static int fuse_nfs_statfs(const char *path, struct statvfs *stbuf)
 	struct smb2_statvfs smb2svfs;
 	memset(&smb2svfs, 0, sizeof(smb2svfs));
 
-	int res = smb2_statvfs(d.v_nfs, path + 1, &smb2svfs);
+	struct smb_req req = {.op = SMB_OP_STATVFS, .path = path + 1, .data = &smb2svfs};
+	int res = smb_engine_call(smb_session(), &req);
 	if (res < 0)
 		return res;
 
@@ -333,41 +1342,361 @@ static int fuse_nfs_statfs(const char *path, struct statvfs *stbuf)
 static int fuse_nfs_flush(const char *path, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_flush entered [%s]\n", path);
-	int res = smb2_close(d.v_nfs, smb2_dupfh((void *)fi->fh));
+	struct smb_file *f = get_file(fi);
+
+	pthread_mutex_lock(&f->lock);
+	int res = smb_file_flush_wbuf(f);
+	if (!res && f->werr)
+		res = f->werr;
+	f->werr = 0;
+	pthread_mutex_unlock(&f->lock);
 	if (res < 0)
 		return res;
 
+	//close(2) of one descriptor, the handle stays open until release
 	return 0;
 }
 
 static int fuse_nfs_release(const char *path, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_release entered [%s]\n", path);
-	smb2_close(d.v_nfs, (void *)fi->fh);
+	struct smb_file *f = get_file(fi);
+
+	pthread_mutex_lock(&files_lock);
+	smb_file_unlink(f);
+	if (f->sbuf)
+	{
+		nsmall--;
+		iobuf_free(f->sbuf, f->slen);
+		f->sbuf = NULL;
+	}
+	//a flush may still be writing it out
+	while (f->pins)
+		pthread_cond_wait(&files_cond, &files_lock);
+	pthread_mutex_unlock(&files_lock);
+
+	smb_file_sync(f);
+	if (!smb_park(f))
+		smb_file_close(f);
 	return 0;
 }
 
 static int fuse_nfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
 	LOG("fuse_nfs_fsync entered [%s]\n", path);
-	int res = smb2_fsync(d.v_nfs, (void *)fi->fh);
+	struct smb_file *f = get_file(fi);
+
+	pthread_mutex_lock(&f->lock);
+	int res = smb_file_flush_wbuf(f);
+	if (!res && f->werr)
+		res = f->werr;
+	f->werr = 0;
+	pthread_mutex_unlock(&f->lock);
 	if (res < 0)
 		return res;
 
+	//data striped over the other sessions went through their handles
+	struct smb_req reqs[SMB_MAX_SESSIONS];
+	int i, n = smb_file_handles(f, SMB_OP_FSYNC, reqs);
+	smb_batch_run(reqs, n);
+	for (i = 0; i < n; i++)
+	{
+		if (reqs[i].status < 0)
+			return reqs[i].status;
+	}
+
 	return 0;
 }
 
+#define SMB_FSCTL_SET_SPARSE 0x000900c4
+#define SMB_FSCTL_SET_ZERO_DATA 0x000980c8
+#define SMB_FSCTL_QUERY_ALLOCATED_RANGES 0x000940cf
+#define SMB_FSCTL_SRV_REQUEST_RESUME_KEY 0x00140078
+#define SMB_FSCTL_SRV_COPYCHUNK_WRITE 0x001480f2
+//within the limits of every server (Windows: 256 chunks of 1 MB, 16 MB total)
+#define SMB_COPYCHUNK_COUNT 16
+#define SMB_COPYCHUNK_SIZE (1024 * 1024)
+//FILE_ALLOCATED_RANGE_BUFFERs returned per QUERY_ALLOCATED_RANGES
+#define SMB_ALLOCATED_RANGES 256
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE 0x10
+#endif
+
+static void smb_put_le32(uint8_t *p, uint32_t v)
+{
+	int i;
+	for (i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void smb_put_le64(uint8_t *p, uint64_t v)
+{
+	smb_put_le32(p, v);
+	smb_put_le32(p + 4, v >> 32);
+}
+
+static uint32_t smb_get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t smb_get_le64(const uint8_t *p)
+{
+	return smb_get_le32(p) | (uint64_t)smb_get_le32(p + 4) << 32;
+}
+
+/* Zeroing goes to the server as FSCTL_SET_ZERO_DATA, a punched file is made
+ * sparse first so the range is deallocated. Nothing reserves space: libsmb2
+ * cannot encode FileAllocationInformation and a file may have holes below
+ * its end, so a plain allocation, or a zeroing that would move the end, is
+ * -EOPNOTSUPP before anything is sent and glibc writes the blocks itself.
+ */
+static int fuse_nfs_fallocate(const char *path, int mode, off_t offset,
+							  off_t length, struct fuse_file_info *fi)
+{
+	LOG("fuse_nfs_fallocate entered [%s] mode %d\n", path, mode);
+	struct smb_file *f = get_file(fi);
+	struct smb2_stat_64 st;
+	uint8_t zero[16];
+	int res;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE) ||
+		!(mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)))
+		return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+
+	smb_file_sync(f);
+	smb_drop_small(path);
+	if ((res = smb_file_handle(f)) < 0)
+		return res;
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE))
+	{
+		//the file is left alone when the end would have to move
+		struct smb_req req = {.op = SMB_OP_FSTAT, .fh = f->fh, .data = &st};
+		if ((res = smb_engine_call(session[f->sess], &req)) < 0)
+			return res;
+		if ((uint64_t)(offset + length) > st.smb2_size)
+			return -EOPNOTSUPP;
+	}
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+	{
+		//an empty FILE_SET_SPARSE_BUFFER means SetSparse = TRUE
+		struct smb_req sreq = {.op = SMB_OP_IOCTL, .fh = f->fh,
+							   .flags = SMB_FSCTL_SET_SPARSE};
+		if ((res = smb_engine_call(session[f->sess], &sreq)) < 0)
+			goto out;
+	}
+
+	//FILE_ZERO_DATA_INFORMATION: FileOffset, BeyondFinalZero
+	smb_put_le64(zero, offset);
+	smb_put_le64(zero + 8, offset + length);
+	struct smb_req zreq = {.op = SMB_OP_IOCTL, .fh = f->fh,
+						   .flags = SMB_FSCTL_SET_ZERO_DATA,
+						   .buf = zero, .count = sizeof(zero)};
+	res = smb_engine_call(session[f->sess], &zreq);
+
+out:
+	if (res == -EINVAL || res == -ENOSYS || res == -ENOTSUP)
+		return -EOPNOTSUPP;
+	return res < 0 ? res : 0;
+}
+
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+/* SEEK_DATA/SEEK_HOLE from FSCTL_QUERY_ALLOCATED_RANGES, so sparse aware
+ * tools skip the holes instead of reading zeros over the wire. A server
+ * without sparse files reports the whole file as data.
+ */
+static off_t fuse_nfs_lseek(const char *path, off_t off, int whence,
+							struct fuse_file_info *fi)
+{
+	LOG("fuse_nfs_lseek entered [%s] %d\n", path, whence);
+	struct smb_file *f = get_file(fi);
+	uint8_t in[16], out[SMB_ALLOCATED_RANGES * 16];
+	struct smb2_stat_64 st;
+	uint64_t pos = off;
+	int res, i, n;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return -EINVAL;
+
+	smb_file_sync(f);
+	if ((res = smb_file_handle(f)) < 0)
+		return res;
+	struct smb_req req = {.op = SMB_OP_FSTAT, .fh = f->fh, .data = &st};
+	if ((res = smb_engine_call(session[f->sess], &req)) < 0)
+		return res;
+	if (off < 0 || pos >= st.smb2_size)
+		return -ENXIO;
+
+	for (;;)
+	{
+		smb_put_le64(in, pos);
+		smb_put_le64(in + 8, st.smb2_size - pos);
+		struct smb_req qreq = {.op = SMB_OP_IOCTL, .fh = f->fh,
+							   .flags = SMB_FSCTL_QUERY_ALLOCATED_RANGES,
+							   .buf = in, .count = sizeof(in),
+							   .data = out, .offset = sizeof(out)};
+		if ((res = smb_engine_call(session[f->sess], &qreq)) < 0)
+			return whence == SEEK_DATA ? off : (off_t)st.smb2_size;
+		n = res / 16;
+
+		if (whence == SEEK_DATA)
+		{
+			if (!n)
+				return -ENXIO;
+			return smb_get_le64(out) > pos ? (off_t)smb_get_le64(out) : (off_t)pos;
+		}
+
+		//the hole starts where the run of allocated ranges ends
+		for (i = 0; i < n; i++)
+		{
+			uint64_t start = smb_get_le64(out + i * 16);
+			uint64_t end = start + smb_get_le64(out + i * 16 + 8);
+
+			if (start > pos)
+				return pos;
+			if (end > pos)
+				pos = end;
+		}
+		if (n < SMB_ALLOCATED_RANGES || pos >= st.smb2_size)
+			return pos < st.smb2_size ? (off_t)pos : (off_t)st.smb2_size;
+	}
+}
+#endif
+
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+
+/* Server side copy with FSCTL_SRV_COPYCHUNK_WRITE: the server copies from
+ * the open identified by the resume key of fi_in, nothing crosses the
+ * wire. Without server support the kernel falls back to read and write.
+ */
+static ssize_t fuse_nfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+										off_t offset_in, const char *path_out,
+										struct fuse_file_info *fi_out, off_t offset_out,
+										size_t size, int flags)
+{
+	LOG("fuse_nfs_copy_file_range entered [%s] -> [%s]\n", path_in, path_out);
+	struct smb_file *in = get_file(fi_in), *out = get_file(fi_out);
+	//SRV_COPYCHUNK_COPY: 24 byte key, count, reserved, then the chunks
+	uint8_t copy[32 + SMB_COPYCHUNK_COUNT * 24], resp[32];
+	struct smb2_stat_64 st;
+	ssize_t copied = 0;
+	int res;
+
+	smb_flush_path(path_in);
+	smb_file_sync(out);
+	smb_drop_small(path_out);
+	if ((res = smb_file_handle(in)) < 0 || (res = smb_file_handle(out)) < 0)
+		return res;
+
+	//chunks reaching past the end of the source fail as a whole
+	struct smb_req req = {.op = SMB_OP_FSTAT, .fh = in->fh, .data = &st};
+	if ((res = smb_engine_call(session[in->sess], &req)) < 0)
+		return res;
+	if ((uint64_t)offset_in >= st.smb2_size)
+		return 0;
+	if (size > st.smb2_size - offset_in)
+		size = st.smb2_size - offset_in;
+
+	struct smb_req kreq = {.op = SMB_OP_IOCTL, .fh = in->fh,
+						   .flags = SMB_FSCTL_SRV_REQUEST_RESUME_KEY,
+						   .data = resp, .offset = sizeof(resp)};
+	res = smb_engine_call(session[in->sess], &kreq);
+	if (res >= 0 && res < 24)
+		res = -EIO;
+	if (res >= 0)
+		memcpy(copy, resp, 24);
+
+	while (res >= 0 && (size_t)copied < size)
+	{
+		size_t left = size - copied, want = 0;
+		uint32_t n;
+
+		for (n = 0; n < SMB_COPYCHUNK_COUNT && left; n++)
+		{
+			uint32_t len = left < SMB_COPYCHUNK_SIZE ? left : SMB_COPYCHUNK_SIZE;
+			uint8_t *c = copy + 32 + n * 24;
+
+			smb_put_le64(c, offset_in + copied + want);
+			smb_put_le64(c + 8, offset_out + copied + want);
+			smb_put_le32(c + 16, len);
+			smb_put_le32(c + 20, 0);
+			want += len;
+			left -= len;
+		}
+		smb_put_le32(copy + 24, n);
+		smb_put_le32(copy + 28, 0);
+
+		struct smb_req creq = {.op = SMB_OP_IOCTL, .fh = out->fh,
+							   .flags = SMB_FSCTL_SRV_COPYCHUNK_WRITE,
+							   .buf = copy, .count = 32 + n * 24,
+							   .data = resp, .offset = sizeof(resp)};
+		res = smb_engine_call(session[out->sess], &creq);
+		if (res >= 0 && res < 12)
+			res = -EIO;
+		if (res < 0)
+			break;
+		//ChunksWritten, ChunkBytesWritten, TotalBytesWritten
+		copied += smb_get_le32(resp + 8);
+		if (smb_get_le32(resp + 8) < want)
+			break;
+	}
+
+	if (copied)
+		return copied;
+	if (res == -EINVAL || res == -ENOSYS || res == -ENOTSUP || res == -EOPNOTSUPP)
+		return -EOPNOTSUPP;
+	return res < 0 ? res : 0;
+}
+#endif
+
 static int fuse_nfs_setxattr(const char *path, const char *name, const char *value,
 							 size_t size, int flags)
 {
 	return 0;
 }
 
-extern struct fuse_operations nfs_oper;
+/* the event loop thread has to be created after fuse_main() daemonized */
+static void *fuse_nfs_init(struct fuse_conn_info *conn)
+{
+	unsigned int i;
+
+	for (i = 0; i < nsessions; i++)
+	{
+		int res = smb_engine_start(session[i]);
+		if (res < 0)
+			LOG("failed to start the smb engine of session %u: %s\n", i, strerror(-res));
+	}
+
+	if (smb_opts.handle_timeout)
+	{
+		pthread_mutex_lock(&files_lock);
+		reaper_started = !pthread_create(&reaper, NULL, smb_reaper, NULL);
+		pthread_mutex_unlock(&files_lock);
+	}
+	return NULL;
+}
+
 static void set_oper_smb()
 {
-	memset(&nfs_oper,0,sizeof(struct fuse_operations));
+	memset(&nfs_oper,0,sizeof(struct fs_operations));
 
+	nfs_oper.init = fuse_nfs_init;
 	nfs_oper.getattr = fuse_nfs_getattr;
 	nfs_oper.fgetattr = fuse_nfs_fgetattr;
 	nfs_oper.access = fuse_nfs_access;
@@ -398,23 +1727,333 @@ static void set_oper_smb()
 	nfs_oper.release = fuse_nfs_release;
 	nfs_oper.fsync = fuse_nfs_fsync;
 	nfs_oper.setxattr = fuse_nfs_setxattr;
+	nfs_oper.fallocate = fuse_nfs_fallocate;
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_LSEEK
+	nfs_oper.lseek = fuse_nfs_lseek;
+#endif
+#ifdef HAVE_STRUCT_FUSE_OPERATIONS_COPY_FILE_RANGE
+	nfs_oper.copy_file_range = fuse_nfs_copy_file_range;
+#endif
 }
 
 static void destroy()
 {
+	char stats[512];
+	unsigned int i;
+
+	//the reaper closes whatever is still parked on its way out
+	pthread_mutex_lock(&files_lock);
+	reaper_stop = 1;
+	pthread_cond_signal(&reaper_cond);
+	pthread_mutex_unlock(&files_lock);
+	if (reaper_started)
+		pthread_join(reaper, NULL);
+
+	//a lazy mount that never connected has its context outside the pool
+	if (!session_smb2[0] && d.v_nfs)
+		smb2_destroy_context(d.v_nfs);
+	for (i = 0; i < SMB_MAX_SESSIONS; i++)
+	{
+		//a dead engine may still have requests queued inside the context
+		int dead = session[i] && smb_engine_dead(session[i]);
+
+		smb_engine_stop(session[i]);
+		if (session_smb2[i] && !dead)
+		{
+			smb2_disconnect_share(session_smb2[i]);
+			smb2_destroy_context(session_smb2[i]);
+		}
+		session_smb2[i] = NULL;
+		smb_engine_free(session[i]);
+		session[i] = NULL;
+	}
+	nsessions = 0;
+	smb_watch_free_all();
 	if (d.v_urls)
 		smb2_destroy_url(d.v_urls);
-	if (d.v_nfs)
+
+	iobuf_stats(stats, sizeof(stats));
+	LOG("smb iobuf:%s\n", stats);
+}
+
+/* another connection and session to the share of the mount url */
+static struct smb2_context *smb_connect_session(const char *url)
+{
+	struct smb2_context *smb2;
+	struct smb2_url *u;
+
+	if (!(smb2 = smb2_init_context()))
+		return NULL;
+	if (!(u = smb2_parse_url(smb2, url)))
+	{
+		smb2_destroy_context(smb2);
+		return NULL;
+	}
+
+	smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+	if (smb2_connect_share(smb2, u->server, u->share, u->user))
+	{
+		LOG("Failed to connect smb session : %s\n", smb2_get_error(smb2));
+		smb2_destroy_url(u);
+		smb2_destroy_context(smb2);
+		return NULL;
+	}
+	smb2_destroy_url(u);
+	return smb2;
+}
+
+/* the timeout= url argument libsmb2 applied to the contexts, 0 if none */
+static int smb_url_timeout(const char *url)
+{
+	const char *arg = strchr(url, '?');
+	int secs = 0;
+
+	while (arg)
+	{
+		if (!strncmp(arg + 1, "timeout=", 8))
+			secs = atoi(arg + 9);
+		arg = strchr(arg + 1, '&');
+	}
+	return secs;
+}
+
+/* connects the session pool, before fuse_main or from the lazy mount thread */
+static int smb_connect(void)
+{
+	struct smb2_context *smb2;
+	struct smb2_url *u;
+	int timeout = smb_url_timeout(d.fsname);
+
+	smb2_set_security_mode(d.v_nfs, SMB2_NEGOTIATE_SIGNING_ENABLED);
+	if (smb2_connect_share(d.v_nfs, d.smburls->server, d.smburls->share, d.smburls->user))
 	{
-		smb2_disconnect_share(d.v_nfs);
+		fprintf(stderr, "Failed to mount smb share : %s\n", smb2_get_error(d.v_nfs));
+		LOG("Failed to mount smb share : %s\n", smb2_get_error(d.v_nfs));
+
+		//the next attempt starts from a new context, the url arguments are set on it
+		if (!(smb2 = smb2_init_context()))
+			return -ENOMEM;
+		if (!(u = smb2_parse_url(smb2, d.fsname)))
+		{
+			smb2_destroy_context(smb2);
+			return -EINVAL;
+		}
+		smb2_destroy_url(d.v_urls);
 		smb2_destroy_context(d.v_nfs);
+		d.v_nfs = smb2, d.v_urls = u;
+		return -EIO;
+	}
+
+	if (!(session[0] = smb_engine_new(d.v_nfs, smb_opts.depth)))
+	{
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		return -ENOMEM;
+	}
+	smb_engine_set_timeout(session[0], timeout);
+	session_smb2[0] = d.v_nfs;
+	nsessions = 1;
+
+	if (smb_opts.sessions > SMB_MAX_SESSIONS)
+		smb_opts.sessions = SMB_MAX_SESSIONS;
+	while (nsessions < smb_opts.sessions)
+	{
+		if (!(smb2 = smb_connect_session(d.fsname)))
+			break;
+		if (!(session[nsessions] = smb_engine_new(smb2, smb_opts.depth)))
+		{
+			smb2_disconnect_share(smb2);
+			smb2_destroy_context(smb2);
+			break;
+		}
+		smb_engine_set_timeout(session[nsessions], timeout);
+		session_smb2[nsessions++] = smb2;
+	}
+	if (nsessions < smb_opts.sessions)
+		fprintf(stderr, "smb: only %u of %u sessions connected\n", nsessions, smb_opts.sessions);
+
+	LOG("smb session: max read %u, max write %u, depth %u, sessions %u\n",
+		smb_engine_max_read(session[0]), smb_engine_max_write(session[0]), smb_opts.depth,
+		nsessions);
+	return 0;
+}
+
+/* Control socket */
+static int smb_ctl_stats(char *buf, size_t size)
+{
+	unsigned int i, n = __atomic_load_n(&nsessions, __ATOMIC_ACQUIRE), nfiles = 0;
+	size_t len = 0;
+	struct smb_file *f;
+
+	for (i = 0; i < n && len < size; i++)
+		len += snprintf(buf + len, size - len, "smb: session %u %s max read %u, max write %u\n", i,
+						smb_engine_dead(session[i]) ? "lost" : "up",
+						smb_engine_max_read(session[i]), smb_engine_max_write(session[i]));
+
+	pthread_mutex_lock(&files_lock);
+	for (f = files; f; f = f->next)
+		nfiles++;
+	if (len < size)
+		len += snprintf(buf + len, size - len, "smb: %u open, %u parked, %u small file heads\n",
+						nfiles, nparked, nsmall);
+	pthread_mutex_unlock(&files_lock);
+	if (len < size)
+		len += snprintf(buf + len, size - len, "smb: small_file=%u handle_timeout=%u\n",
+						__atomic_load_n(&smb_opts.small_file_kb, __ATOMIC_RELAXED),
+						__atomic_load_n(&smb_opts.handle_timeout, __ATOMIC_RELAXED));
+	return len;
+}
+
+//smb_wbuf sizes the buffers already allocated and stays as mounted
+static const struct fuse_opt smb_tune_spec[] = {
+	{"smb_handle_timeout=%u", offsetof(struct smb_opts, handle_timeout), 0},
+	{"smb_small_file=%u", offsetof(struct smb_opts, small_file_kb), 0},
+	FUSE_OPT_END};
+
+static int smb_ctl_tune(struct fuse_args *args, int apply)
+{
+	struct smb_opts t;
+
+	t.handle_timeout = __atomic_load_n(&smb_opts.handle_timeout, __ATOMIC_RELAXED);
+	t.small_file_kb = __atomic_load_n(&smb_opts.small_file_kb, __ATOMIC_RELAXED);
+	if (fuse_opt_parse(args, &t, smb_tune_spec, NULL) == -1)
+		return -1;
+	if (apply)
+	{
+		__atomic_store_n(&smb_opts.handle_timeout, t.handle_timeout, __ATOMIC_RELAXED);
+		__atomic_store_n(&smb_opts.small_file_kb, t.small_file_kb, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/* write buffers of all open files go to the server */
+static int smb_ctl_flush(void)
+{
+	return smb_flush_path(NULL);
+}
+
+/* handles other files hold on a lost session for their stripes belong to
+ * its old context, they are forgotten before the slot is connected again
+ */
+static void smb_file_forget_session(unsigned int sess)
+{
+	struct smb_file *lists[2], *f;
+	int i;
+
+	pthread_mutex_lock(&files_lock);
+	lists[0] = files, lists[1] = parked;
+	for (i = 0; i < 2; i++)
+		for (f = lists[i]; f; f = f->next)
+		{
+			pthread_mutex_lock(&f->chlock);
+			f->chfh[sess] = NULL;
+			pthread_mutex_unlock(&f->chlock);
+		}
+	pthread_mutex_unlock(&files_lock);
+}
+
+/* A lost session whose files and directories are all closed is connected
+ * again in its own slot. One that still has some keeps them, a new session
+ * is added beside it while the pool has room; new opens and stripes pass
+ * over the lost one.
+ */
+static int smb_ctl_reconnect(void)
+{
+	struct smb2_context *smb2;
+	struct smb_engine *e;
+	unsigned int i, lost = 0;
+	int res = 0;
+
+	pthread_mutex_lock(&session_lock);
+	if (!nsessions)
+	{
+		//the lazy mount is still connecting
+		pthread_mutex_unlock(&session_lock);
+		return -ENOTCONN;
+	}
+	for (i = 0; i < nsessions; i++)
+	{
+		if (!smb_engine_dead(session[i]))
+			continue;
+		lost++;
+		if (__atomic_load_n(&session_handles[i], __ATOMIC_ACQUIRE))
+			continue;
+		//nothing of the old context is in use, the slot is connected again
+		if (!(smb2 = smb_connect_session(d.fsname)))
+		{
+			res = -EIO;
+			break;
+		}
+		smb_file_forget_session(i);
+		smb_engine_set_timeout(session[i], smb_url_timeout(d.fsname));
+		if ((res = smb_engine_revive(session[i], smb2)) < 0)
+		{
+			smb2_disconnect_share(smb2);
+			smb2_destroy_context(smb2);
+			break;
+		}
+		session_smb2[i] = smb2;
+		lost--;
+		LOG("smb session %u: connected again\n", i);
+	}
+	//those still holding files get a new session beside them while there is room
+	for (; !res && lost && nsessions < SMB_MAX_SESSIONS; lost--)
+	{
+		if (!(smb2 = smb_connect_session(d.fsname)))
+		{
+			res = -EIO;
+			break;
+		}
+		if (!(e = smb_engine_new(smb2, smb_opts.depth)))
+			res = -ENOMEM;
+		else
+		{
+			smb_engine_set_timeout(e, smb_url_timeout(d.fsname));
+			if ((res = smb_engine_start(e)) < 0)
+				smb_engine_free(e);
+		}
+		if (res < 0)
+		{
+			smb2_disconnect_share(smb2);
+			smb2_destroy_context(smb2);
+			break;
+		}
+		session[nsessions] = e;
+		session_smb2[nsessions] = smb2;
+		__atomic_store_n(&nsessions, nsessions + 1, __ATOMIC_RELEASE);
+		LOG("smb session %u: connected to replace a lost one\n", nsessions - 1);
 	}
+	pthread_mutex_unlock(&session_lock);
+	//no slot left for all of them
+	return res < 0 ? res : lost ? -ENOSPC : 0;
 }
 
+static const struct ctl_backend smb_ctl = {
+	.stats = smb_ctl_stats,
+	.tune = smb_ctl_tune,
+	.flush = smb_ctl_flush,
+	.reconnect = smb_ctl_reconnect,
+};
+
+static const struct fuse_opt smb_opt_spec[] = {
+	{"smb_depth=%u", offsetof(struct smb_opts, depth), 0},
+	{"smb_wbuf=%u", offsetof(struct smb_opts, wbuf_kb), 0},
+	{"smb_sessions=%u", offsetof(struct smb_opts, sessions), 0},
+	{"smb_channels=%u", offsetof(struct smb_opts, sessions), 0},
+	{"smb_handle_timeout=%u", offsetof(struct smb_opts, handle_timeout), 0},
+	{"smb_notify=%u", offsetof(struct smb_opts, notify), 0},
+	{"smb_small_file=%u", offsetof(struct smb_opts, small_file_kb), 0},
+	FUSE_OPT_END};
+
 int _env_init_smb(struct nfsdata *_d, struct fuse_args *args)
 {
 	int res = 0;
 
+	if (fuse_opt_parse(args, &smb_opts, smb_opt_spec, NULL) == -1)
+	{
+		res = -2;
+		goto out_free;
+	}
+
 	if (!(_d->v_nfs = smb2_init_context()))
 	{
 		fprintf(stderr, "Failed to init context\n");
@@ -429,16 +2068,31 @@ int _env_init_smb(struct nfsdata *_d, struct fuse_args *args)
 		goto out_free;
 	}
 	
-	smb2_set_security_mode(d.v_nfs, SMB2_NEGOTIATE_SIGNING_ENABLED);
-	if (smb2_connect_share(d.v_nfs, d.smburls->server, d.smburls->share, d.smburls->user))
+	if (pthread_key_create(&session_key, NULL))
+	{
+		res = -3;
+		goto out_free;
+	}
+
+	_d->destory = destroy;
+	ctl_backend(&smb_ctl);
+	owner_map(smb_owner);
+	if (lazy_connect(smb_connect))
 	{
-		fprintf(stderr, "Failed to mount nfs share : %s\n", smb2_get_error(d.v_nfs));
 		res = -5;
 		goto out_free;
 	}
 
+#if FUSE_USE_VERSION < 30
+	//requests are split at MaxWrite anyway, let the kernel send more per call
+	if (fuse_opt_add_arg(args, "-obig_writes"))
+	{
+		res = -6;
+		goto out_free;
+	}
+#endif
+
 	set_oper_smb();
-	_d->destory = destroy;
 out_free:
 	return res;
-}
\ No newline at end of file
+}
@@ -0,0 +1,451 @@
+/*
+  fusenfs-warm module: warm the caches for a directory tree on request
+
+  setfattr -n user.fusenfs.warmup [-v "data=SIZE,glob=PATTERN"] <dir>
+  starts a walk of <dir> in the background and returns at once. Worker
+  threads list every directory and stat every entry through the mount
+  point itself, so the kernel sends READDIR(PLUS), LOOKUP and GETATTR like
+  for any application and every cache on the way, the kernel's and
+  fusenfs', is filled. With data= the regular files up to SIZE bytes (K, M
+  and G suffixes), and matching PATTERN if given, are read as well.
+  getfattr -n user.fusenfs.warmup on any path reports the progress,
+  setfattr -x user.fusenfs.warmup stops the walk.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fusenfs.h"
+
+#define WARM_XATTR "user.fusenfs.warmup"
+#define WARM_DEFAULT_THREADS 16
+#define WARM_MAX_THREADS 64
+#define WARM_READ_SIZE (128 * 1024)
+//directories between two progress lines in the log
+#define WARM_LOG_EVERY 1000
+
+enum warm_state
+{
+	WARM_IDLE,
+	WARM_RUNNING,
+	WARM_DONE,
+	WARM_STOPPED,
+};
+
+//a directory still to be listed, path below the mount point
+struct warm_dir
+{
+	struct warm_dir *next;
+	char path[];
+};
+
+struct warm
+{
+	unsigned int threads;
+	char *mountpoint;
+	struct fs_operations *next_oper;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	enum warm_state state;
+	struct warm_dir *queue;
+	struct warm_dir **queue_tail;
+	//workers listing a directory, which may queue more
+	unsigned int busy;
+	unsigned int running;
+	pthread_t thread[WARM_MAX_THREADS];
+	unsigned int nthreads;
+
+	//what the current walk reads
+	uint64_t data_max;
+	char glob[NAME_MAX + 1];
+
+	uint64_t dirs;
+	uint64_t entries;
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t errors;
+	time_t started;
+	time_t finished;
+};
+
+static struct warm warm = {
+	.threads = WARM_DEFAULT_THREADS,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct fs_operations warm_oper;
+
+/* called with warm.lock held */
+static int warm_queue(const char *path)
+{
+	struct warm_dir *dir = malloc(sizeof(struct warm_dir) + strlen(path) + 1);
+
+	if (!dir)
+		return -ENOMEM;
+	strcpy(dir->path, path);
+	dir->next = NULL;
+	*warm.queue_tail = dir;
+	warm.queue_tail = &dir->next;
+	pthread_cond_signal(&warm.cond);
+	return 0;
+}
+
+static void warm_count(uint64_t *ctr, uint64_t n)
+{
+	pthread_mutex_lock(&warm.lock);
+	*ctr += n;
+	pthread_mutex_unlock(&warm.lock);
+}
+
+static int warm_stopped(void)
+{
+	int res;
+
+	pthread_mutex_lock(&warm.lock);
+	res = warm.state == WARM_STOPPED;
+	pthread_mutex_unlock(&warm.lock);
+	return res;
+}
+
+static void warm_read(int dirfd, const char *name, char *buf)
+{
+	uint64_t total = 0;
+	ssize_t n;
+	int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+
+	if (fd < 0)
+	{
+		warm_count(&warm.errors, 1);
+		return;
+	}
+	while ((n = read(fd, buf, WARM_READ_SIZE)) > 0)
+		total += n;
+	close(fd);
+
+	pthread_mutex_lock(&warm.lock);
+	warm.files++;
+	warm.bytes += total;
+	if (n < 0)
+		warm.errors++;
+	pthread_mutex_unlock(&warm.lock);
+}
+
+static void warm_list(const char *path, char *buf)
+{
+	char full[PATH_MAX], child[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	uint64_t entries = 0;
+	DIR *dir;
+
+	snprintf(full, sizeof(full), "%s%s", warm.mountpoint, path);
+	if (!(dir = opendir(full)))
+	{
+		warm_count(&warm.errors, 1);
+		return;
+	}
+
+	while (!warm_stopped() && (de = readdir(dir)))
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		entries++;
+		if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		{
+			warm_count(&warm.errors, 1);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "",
+						 de->d_name) >= (int)sizeof(child))
+				continue;
+			pthread_mutex_lock(&warm.lock);
+			if (warm_queue(child))
+				warm.errors++;
+			pthread_mutex_unlock(&warm.lock);
+		}
+		else if (S_ISREG(st.st_mode) && buf && warm.data_max && (uint64_t)st.st_size <= warm.data_max &&
+				 (!warm.glob[0] || !fnmatch(warm.glob, de->d_name, 0)))
+			warm_read(dirfd(dir), de->d_name, buf);
+	}
+	closedir(dir);
+
+	pthread_mutex_lock(&warm.lock);
+	warm.entries += entries;
+	if (!(++warm.dirs % WARM_LOG_EVERY))
+		LOG("warmup: %lu directories, %lu entries, %lu files read (%lu bytes)\n",
+			(unsigned long)warm.dirs, (unsigned long)warm.entries,
+			(unsigned long)warm.files, (unsigned long)warm.bytes);
+	pthread_mutex_unlock(&warm.lock);
+}
+
+static void *warm_worker(void *arg)
+{
+	struct warm_dir *dir;
+	char *buf = malloc(WARM_READ_SIZE);
+
+	pthread_mutex_lock(&warm.lock);
+	for (;;)
+	{
+		while (!warm.queue && warm.busy && warm.state == WARM_RUNNING)
+			pthread_cond_wait(&warm.cond, &warm.lock);
+		if (!warm.queue || warm.state != WARM_RUNNING)
+			break;
+
+		dir = warm.queue;
+		if (!(warm.queue = dir->next))
+			warm.queue_tail = &warm.queue;
+		warm.busy++;
+		pthread_mutex_unlock(&warm.lock);
+
+		warm_list(dir->path, buf);
+		free(dir);
+
+		pthread_mutex_lock(&warm.lock);
+		warm.busy--;
+		//the last one out wakes the others to leave
+		if (!warm.busy && !warm.queue)
+			pthread_cond_broadcast(&warm.cond);
+	}
+
+	if (!--warm.running)
+	{
+		while ((dir = warm.queue))
+		{
+			warm.queue = dir->next;
+			free(dir);
+		}
+		warm.queue_tail = &warm.queue;
+		if (warm.state == WARM_RUNNING)
+			warm.state = WARM_DONE;
+		warm.finished = time(NULL);
+		LOG("warmup %s: %lu directories, %lu entries, %lu files read (%lu bytes), %lu errors in %ld s\n",
+			warm.state == WARM_DONE ? "done" : "stopped", (unsigned long)warm.dirs,
+			(unsigned long)warm.entries, (unsigned long)warm.files, (unsigned long)warm.bytes,
+			(unsigned long)warm.errors, (long)(warm.finished - warm.started));
+	}
+	pthread_mutex_unlock(&warm.lock);
+	free(buf);
+	return NULL;
+}
+
+static uint64_t warm_size(const char *s)
+{
+	char *end;
+	uint64_t n = strtoull(s, &end, 10);
+
+	switch (*end)
+	{
+	case 'g':
+	case 'G':
+		n *= 1024;
+		//fall through
+	case 'm':
+	case 'M':
+		n *= 1024;
+		//fall through
+	case 'k':
+	case 'K':
+		n *= 1024;
+	}
+	return n;
+}
+
+/* value: comma separated data=SIZE and glob=PATTERN, both optional */
+static int warm_start(const char *path, const char *value, size_t size)
+{
+	char args[PATH_MAX], *arg, *save;
+	unsigned int i, n;
+
+	if (!warm.mountpoint)
+		return -ENOTSUP;
+	if (size >= sizeof(args))
+		return -EINVAL;
+	memcpy(args, value, size);
+	args[size] = '\0';
+
+	pthread_mutex_lock(&warm.lock);
+	if (warm.running)
+	{
+		pthread_mutex_unlock(&warm.lock);
+		return -EBUSY;
+	}
+	//the workers of the previous walk have all left
+	for (i = 0; i < warm.nthreads; i++)
+		pthread_join(warm.thread[i], NULL);
+	warm.nthreads = 0;
+
+	warm.data_max = 0;
+	warm.glob[0] = '\0';
+	for (arg = strtok_r(args, ",", &save); arg; arg = strtok_r(NULL, ",", &save))
+	{
+		if (!strncmp(arg, "data=", 5))
+			warm.data_max = warm_size(arg + 5);
+		else if (!strncmp(arg, "glob=", 5))
+			snprintf(warm.glob, sizeof(warm.glob), "%s", arg + 5);
+		else if (*arg)
+		{
+			pthread_mutex_unlock(&warm.lock);
+			return -EINVAL;
+		}
+	}
+
+	warm.dirs = warm.entries = warm.files = warm.bytes = warm.errors = 0;
+	warm.started = time(NULL);
+	warm.finished = 0;
+	warm.queue_tail = &warm.queue;
+	if (warm_queue(path))
+	{
+		pthread_mutex_unlock(&warm.lock);
+		return -ENOMEM;
+	}
+	warm.state = WARM_RUNNING;
+
+	n = warm.threads > WARM_MAX_THREADS ? WARM_MAX_THREADS : warm.threads ? warm.threads : 1;
+	for (i = 0; i < n; i++)
+		if (!pthread_create(&warm.thread[warm.nthreads], NULL, warm_worker, NULL))
+			warm.nthreads++, warm.running++;
+	if (!warm.nthreads)
+	{
+		free(warm.queue);
+		warm.queue = NULL;
+		warm.queue_tail = &warm.queue;
+		warm.state = WARM_IDLE;
+		pthread_mutex_unlock(&warm.lock);
+		return -EAGAIN;
+	}
+	LOG("warmup of [%s] started, %u threads, data up to %lu bytes%s%s\n", path, warm.nthreads,
+		(unsigned long)warm.data_max, warm.glob[0] ? " matching " : "", warm.glob);
+	pthread_mutex_unlock(&warm.lock);
+	return 0;
+}
+
+static int warm_progress(char *value, size_t size)
+{
+	static const char *const states[] = {"idle", "running", "done", "stopped"};
+	char buf[256];
+	int len;
+
+	pthread_mutex_lock(&warm.lock);
+	len = snprintf(buf, sizeof(buf),
+				   "%s dirs=%lu entries=%lu files=%lu bytes=%lu errors=%lu secs=%ld\n",
+				   states[warm.state], (unsigned long)warm.dirs, (unsigned long)warm.entries,
+				   (unsigned long)warm.files, (unsigned long)warm.bytes, (unsigned long)warm.errors,
+				   warm.state == WARM_IDLE ? 0L : (long)((warm.finished ? warm.finished : time(NULL)) - warm.started));
+	pthread_mutex_unlock(&warm.lock);
+
+	if (!size)
+		return len;
+	if ((size_t)len > size)
+		return -ERANGE;
+	memcpy(value, buf, len);
+	return len;
+}
+
+int warm_stats(char *buf, size_t size)
+{
+	return warm_progress(buf, size);
+}
+
+static int warm_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	if (!strcmp(name, WARM_XATTR))
+		return warm_start(path, value, size);
+	return warm.next_oper->setxattr ? warm.next_oper->setxattr(path, name, value, size, flags) : -ENOTSUP;
+}
+
+static int warm_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	if (!strcmp(name, WARM_XATTR))
+		return warm_progress(value, size);
+	return warm.next_oper->getxattr ? warm.next_oper->getxattr(path, name, value, size) : -ENOTSUP;
+}
+
+static int warm_removexattr(const char *path, const char *name)
+{
+	if (strcmp(name, WARM_XATTR))
+		return warm.next_oper->removexattr ? warm.next_oper->removexattr(path, name) : -ENOTSUP;
+
+	pthread_mutex_lock(&warm.lock);
+	if (warm.state == WARM_RUNNING)
+		warm.state = WARM_STOPPED;
+	pthread_cond_broadcast(&warm.cond);
+	pthread_mutex_unlock(&warm.lock);
+	return 0;
+}
+
+static void warm_destroy(void *private_data)
+{
+	/* The workers are not joined: one blocked in a call on the mount that
+	 * is going away returns with an error and leaves on its own.
+	 */
+	pthread_mutex_lock(&warm.lock);
+	if (warm.state == WARM_RUNNING)
+		warm.state = WARM_STOPPED;
+	pthread_cond_broadcast(&warm.cond);
+	pthread_mutex_unlock(&warm.lock);
+
+	if (warm.next_oper->destroy)
+		warm.next_oper->destroy(private_data);
+}
+
+struct fs_operations *warm_wrap(struct fs_operations *oper)
+{
+	if (!warm.mountpoint)
+		return oper;
+
+	warm.next_oper = oper;
+	warm_oper = *oper;
+	warm_oper.setxattr = warm_setxattr;
+	warm_oper.getxattr = warm_getxattr;
+	warm_oper.removexattr = warm_removexattr;
+	warm_oper.destroy = warm_destroy;
+	return &warm_oper;
+}
+
+static const struct fuse_opt warm_opts[] = {
+	{"warmup_threads=%u", offsetof(struct warm, threads), 0},
+	FUSE_OPT_END};
+
+//the walk goes through the mount point, made absolute before fuse changes directory
+static int warm_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	if (key == FUSE_OPT_KEY_NONOPT && !warm.mountpoint)
+		warm.mountpoint = realpath(arg, NULL);
+	return 1;
+}
+
+int warm_parse_options(struct fuse_args *args)
+{
+	return fuse_opt_parse(args, &warm, warm_opts, warm_opt_proc);
+}
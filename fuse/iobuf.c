@@ -0,0 +1,324 @@
+/*
+  fusenfs buffers: pooled I/O buffers for the data paths of the backends
+
+  Buffers of one size class are cut from 2 MB regions that are mapped once
+  and never given back, so the daemon's footprint follows its peak use
+  instead of fragmenting the heap. A freed buffer goes to a small cache of
+  its thread first and to the class's shared list when that is full.
+  Regions are backed by transparent huge pages by default, or by hugetlbfs
+  pages with iobuf_hugepages=hugetlb.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "fusenfs.h"
+#include "iobuf.h"
+
+#define IOBUF_MIN_SHIFT 12
+#define IOBUF_MAX_SHIFT 20
+#define IOBUF_CLASSES (IOBUF_MAX_SHIFT - IOBUF_MIN_SHIFT + 1)
+#define IOBUF_REGION_SIZE (2 * 1024 * 1024)
+//buffers a thread keeps per class before it hands them back
+#define IOBUF_THREAD_CACHE 8
+
+enum iobuf_huge
+{
+	IOBUF_HUGE_NO,
+	IOBUF_HUGE_THP,
+	IOBUF_HUGE_HUGETLB,
+};
+
+//a free buffer holds the link to the next one
+struct iobuf_free
+{
+	struct iobuf_free *next;
+};
+
+struct iobuf_class
+{
+	pthread_mutex_t lock;
+	struct iobuf_free *free;
+	unsigned int regions;
+	unsigned int hugetlb;
+	//buffers handed out and not freed yet
+	unsigned long used;
+};
+
+struct iobuf_cache
+{
+	struct iobuf_free *free[IOBUF_CLASSES];
+	unsigned int n[IOBUF_CLASSES];
+};
+
+struct iobuf
+{
+	unsigned int huge;
+	struct iobuf_class classes[IOBUF_CLASSES];
+	unsigned long large;
+	pthread_key_t key;
+	pthread_once_t once;
+};
+
+static struct iobuf iobuf = {
+	.huge = IOBUF_HUGE_THP,
+	.once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct iobuf_cache *iobuf_tcache;
+
+static int iobuf_class(size_t size)
+{
+	int c = 0;
+
+	while (c < IOBUF_CLASSES && ((size_t)1 << (IOBUF_MIN_SHIFT + c)) < size)
+		c++;
+	return c;
+}
+
+/* a thread that ends returns what it cached */
+static void iobuf_thread_exit(void *arg)
+{
+	struct iobuf_cache *tc = arg;
+	struct iobuf_free *b;
+	int c;
+
+	for (c = 0; c < IOBUF_CLASSES; c++)
+	{
+		pthread_mutex_lock(&iobuf.classes[c].lock);
+		while ((b = tc->free[c]))
+		{
+			tc->free[c] = b->next;
+			b->next = iobuf.classes[c].free;
+			iobuf.classes[c].free = b;
+		}
+		pthread_mutex_unlock(&iobuf.classes[c].lock);
+	}
+	free(tc);
+}
+
+static void iobuf_init(void)
+{
+	int c;
+
+	for (c = 0; c < IOBUF_CLASSES; c++)
+		pthread_mutex_init(&iobuf.classes[c].lock, NULL);
+	pthread_key_create(&iobuf.key, iobuf_thread_exit);
+}
+
+static struct iobuf_cache *iobuf_cache(void)
+{
+	if (!iobuf_tcache && (iobuf_tcache = calloc(1, sizeof(struct iobuf_cache))))
+		pthread_setspecific(iobuf.key, iobuf_tcache);
+	return iobuf_tcache;
+}
+
+static void *iobuf_map(int *hugetlb)
+{
+	void *p;
+	char *base;
+	uintptr_t skew;
+
+	*hugetlb = 0;
+#ifdef MAP_HUGETLB
+	if (iobuf.huge == IOBUF_HUGE_HUGETLB)
+	{
+		p = mmap(NULL, IOBUF_REGION_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			*hugetlb = 1;
+			return p;
+		}
+		//no huge pages reserved, fall back to transparent ones
+	}
+#endif
+	if (iobuf.huge == IOBUF_HUGE_NO)
+	{
+		p = mmap(NULL, IOBUF_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
+	}
+
+	//a transparent huge page needs a 2 MB aligned region
+	p = mmap(NULL, 2 * IOBUF_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	base = p;
+	skew = (uintptr_t)base & (IOBUF_REGION_SIZE - 1);
+	if (skew)
+	{
+		munmap(base, IOBUF_REGION_SIZE - skew);
+		base += IOBUF_REGION_SIZE - skew;
+		munmap(base + IOBUF_REGION_SIZE, skew);
+	}
+	else
+		munmap(base + IOBUF_REGION_SIZE, IOBUF_REGION_SIZE);
+#ifdef MADV_HUGEPAGE
+	madvise(base, IOBUF_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+	return base;
+}
+
+/* called with the class lock held */
+static int iobuf_grow(int c)
+{
+	struct iobuf_class *cl = &iobuf.classes[c];
+	size_t size = (size_t)1 << (IOBUF_MIN_SHIFT + c);
+	size_t off;
+	char *region;
+	int hugetlb;
+
+	if (!(region = iobuf_map(&hugetlb)))
+		return -ENOMEM;
+	for (off = IOBUF_REGION_SIZE; off >= size; off -= size)
+	{
+		struct iobuf_free *b = (struct iobuf_free *)(region + off - size);
+		b->next = cl->free;
+		cl->free = b;
+	}
+	cl->regions++;
+	cl->hugetlb += hugetlb;
+	LOG("iobuf: region %u of %zu KB buffers mapped%s\n", cl->regions, size / 1024,
+		hugetlb ? " on huge pages" : "");
+	return 0;
+}
+
+void *iobuf_alloc(size_t size)
+{
+	struct iobuf_cache *tc;
+	struct iobuf_class *cl;
+	struct iobuf_free *b;
+	int c = iobuf_class(size);
+
+	if (c == IOBUF_CLASSES)
+	{
+		__atomic_add_fetch(&iobuf.large, 1, __ATOMIC_RELAXED);
+		return malloc(size);
+	}
+	pthread_once(&iobuf.once, iobuf_init);
+	cl = &iobuf.classes[c];
+
+	if ((tc = iobuf_cache()) && (b = tc->free[c]))
+	{
+		tc->free[c] = b->next;
+		tc->n[c]--;
+	}
+	else
+	{
+		pthread_mutex_lock(&cl->lock);
+		if (!cl->free && iobuf_grow(c))
+		{
+			pthread_mutex_unlock(&cl->lock);
+			return NULL;
+		}
+		b = cl->free;
+		cl->free = b->next;
+		pthread_mutex_unlock(&cl->lock);
+	}
+	__atomic_add_fetch(&cl->used, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void iobuf_free(void *buf, size_t size)
+{
+	struct iobuf_cache *tc;
+	struct iobuf_class *cl;
+	struct iobuf_free *b = buf;
+	int c = iobuf_class(size);
+
+	if (!buf)
+		return;
+	if (c == IOBUF_CLASSES)
+	{
+		__atomic_sub_fetch(&iobuf.large, 1, __ATOMIC_RELAXED);
+		free(buf);
+		return;
+	}
+	pthread_once(&iobuf.once, iobuf_init);
+	cl = &iobuf.classes[c];
+	__atomic_sub_fetch(&cl->used, 1, __ATOMIC_RELAXED);
+
+	if ((tc = iobuf_cache()) && tc->n[c] < IOBUF_THREAD_CACHE)
+	{
+		b->next = tc->free[c];
+		tc->free[c] = b;
+		tc->n[c]++;
+		return;
+	}
+	pthread_mutex_lock(&cl->lock);
+	b->next = cl->free;
+	cl->free = b;
+	pthread_mutex_unlock(&cl->lock);
+}
+
+/* buf of size holds len bytes: the buffer to free with len from now on,
+ * buf itself or a smaller one, NULL (buf freed) when none could be had
+ */
+void *iobuf_shrink(void *buf, size_t size, size_t len)
+{
+	void *small;
+
+	if (iobuf_class(len) == iobuf_class(size))
+		return buf;
+	if ((small = iobuf_alloc(len)))
+		memcpy(small, buf, len);
+	iobuf_free(buf, size);
+	return small;
+}
+
+/* one line: regions mapped and buffers in use per class */
+int iobuf_stats(char *buf, size_t size)
+{
+	size_t len = 0;
+	unsigned int regions = 0;
+	int c;
+
+	for (c = 0; c < IOBUF_CLASSES; c++)
+	{
+		struct iobuf_class *cl = &iobuf.classes[c];
+		unsigned long used = __atomic_load_n(&cl->used, __ATOMIC_RELAXED);
+		unsigned int r = __atomic_load_n(&cl->regions, __ATOMIC_RELAXED);
+
+		regions += r;
+		if (r && len < size)
+			len += snprintf(buf + len, size - len, " %uK:%lu/%lu", 1U << (IOBUF_MIN_SHIFT - 10 + c),
+							used, (unsigned long)r * (IOBUF_REGION_SIZE >> (IOBUF_MIN_SHIFT + c)));
+	}
+	if (len < size)
+		len += snprintf(buf + len, size - len, " large:%lu regions:%u (%u MB)",
+						__atomic_load_n(&iobuf.large, __ATOMIC_RELAXED), regions,
+						regions * (IOBUF_REGION_SIZE >> 20));
+	return len < size ? (int)len : (int)size - 1;
+}
+
+static const struct fuse_opt iobuf_opts[] = {
+	{"iobuf_hugepages=no", offsetof(struct iobuf, huge), IOBUF_HUGE_NO},
+	{"iobuf_hugepages=thp", offsetof(struct iobuf, huge), IOBUF_HUGE_THP},
+	{"iobuf_hugepages=hugetlb", offsetof(struct iobuf, huge), IOBUF_HUGE_HUGETLB},
+	FUSE_OPT_END};
+
+int iobuf_parse_options(struct fuse_args *args)
+{
+	return fuse_opt_parse(args, &iobuf, iobuf_opts, NULL);
+}
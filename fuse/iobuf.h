@@ -0,0 +1,26 @@
+/*
+  fusenfs buffers: pooled I/O buffers for the data paths of the backends
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifndef IOBUF_H_
+#define IOBUF_H_
+
+#include <stddef.h>
+
+struct fuse_args;
+
+/* Buffers come in power of two sizes from 4 KB to 1 MB, larger ones are
+ * plain malloc. iobuf_free and iobuf_shrink take the size the buffer was
+ * asked for (or shrunk to), which selects its pool. The occupancy is one
+ * line of text from iobuf_stats.
+ */
+void *iobuf_alloc(size_t size);
+void iobuf_free(void *buf, size_t size);
+void *iobuf_shrink(void *buf, size_t size, size_t len);
+int iobuf_stats(char *buf, size_t size);
+int iobuf_parse_options(struct fuse_args *args);
+
+#endif
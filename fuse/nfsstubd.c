@@ -0,0 +1,2051 @@
+/*
+  nfsstubd: a small NFSv3 server to benchmark and test fusenfs against
+
+  nfsstubd [-a ADDR] [-p PORT] [-P] [-x EXPORT] [-l [PROC=]MS] [-j MS]
+           [-b KBPS] [-e PROC=ERROR[:PERCENT]] [-s SEED] -m | DIR
+
+  Serves DIR, or with -m a fresh directory on tmpfs that is removed on
+  exit, as EXPORT ("/export" by default) on ADDR (127.0.0.1 by default).
+  Portmap v2, MOUNT v3 and NFS v3 are all answered on the one TCP port
+  (PORT, any free one by default), so neither root nor rpcbind is needed:
+  the url printed at start gives that port for both services, e.g.
+
+    fusenfs nfs://127.0.0.1/export?nfsport=40123&mountport=40123 /mnt
+
+  -P also answers the portmapper on port 111, for clients that cannot be
+  given the ports; this needs root.
+
+  The knobs, to make runs repeatable:
+    -l MS, -l PROC=MS	delay the replies (to PROC: read, write, getattr...
+    			or all) by MS milliseconds, fractions allowed; the
+    			calls behind are served meanwhile, so pipelined
+    			calls overlap as on a real server
+    -j MS		add a random 0..MS to each delay
+    -b KBPS		a link of KBPS KB/s each way, shared by all clients:
+    			calls and replies wait for it by their size
+    -e PROC=ERROR[:PERCENT]
+    			fail PROC (or all) with ERROR on PERCENT % of the
+    			calls (100 by default); ERROR is an nfs3 status, as
+    			number or name (io, jukebox, stale, acces, nospc...),
+    			drop to send no reply, close to drop the connection
+    -s SEED		seed of the jitter and of the errors, 1 by default
+
+  Credentials are not checked: every call acts as the user running
+  nfsstubd. Writes are never synced and COMMIT does nothing. The calls
+  per procedure are printed on SIGUSR1 and at exit.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PMAP_PROG 100000
+#define NFS_PROG 100003
+#define MOUNT_PROG 100005
+#define IPPROTO_TCP_PMAP 6
+
+#define STUB_MAX_IO (1024 * 1024)
+//a write of STUB_MAX_IO and its header
+#define STUB_MAX_RECORD (STUB_MAX_IO + 4096)
+#define STUB_FH_MAGIC 0x4e535442
+#define STUB_FH_SIZE 12
+#define STUB_NODE_BUCKETS 65536
+#define STUB_MAX_RULES 32
+#define STUB_MAX_LISTEN 2
+//error injection: no reply, or the connection dropped
+#define STUB_DROP -1
+#define STUB_CLOSE -2
+
+enum nfsstat3
+{
+	NFS3_OK = 0,
+	NFS3ERR_PERM = 1,
+	NFS3ERR_NOENT = 2,
+	NFS3ERR_IO = 5,
+	NFS3ERR_NXIO = 6,
+	NFS3ERR_ACCES = 13,
+	NFS3ERR_EXIST = 17,
+	NFS3ERR_XDEV = 18,
+	NFS3ERR_NODEV = 19,
+	NFS3ERR_NOTDIR = 20,
+	NFS3ERR_ISDIR = 21,
+	NFS3ERR_INVAL = 22,
+	NFS3ERR_FBIG = 27,
+	NFS3ERR_NOSPC = 28,
+	NFS3ERR_ROFS = 30,
+	NFS3ERR_MLINK = 31,
+	NFS3ERR_NAMETOOLONG = 63,
+	NFS3ERR_NOTEMPTY = 66,
+	NFS3ERR_DQUOT = 69,
+	NFS3ERR_STALE = 70,
+	NFS3ERR_BADHANDLE = 10001,
+	NFS3ERR_NOT_SYNC = 10002,
+	NFS3ERR_BAD_COOKIE = 10003,
+	NFS3ERR_NOTSUPP = 10004,
+	NFS3ERR_TOOSMALL = 10005,
+	NFS3ERR_SERVERFAULT = 10006,
+	NFS3ERR_BADTYPE = 10007,
+	NFS3ERR_JUKEBOX = 10008,
+};
+
+enum rpc_accept_stat
+{
+	RPC_SUCCESS = 0,
+	RPC_PROG_UNAVAIL = 1,
+	RPC_PROG_MISMATCH = 2,
+	RPC_PROC_UNAVAIL = 3,
+	RPC_GARBAGE_ARGS = 4,
+};
+
+struct xdr_in
+{
+	const unsigned char *p, *end;
+	int bad;
+};
+
+struct xdr_out
+{
+	unsigned char *buf;
+	size_t len, size;
+	int bad;
+};
+
+struct stub_node
+{
+	uint64_t ino;
+	char *path;
+	struct stub_node *next;
+};
+
+struct stub_reply
+{
+	struct stub_reply *next;
+	uint64_t due;
+	unsigned char *buf;
+	size_t len;
+};
+
+struct stub_conn
+{
+	int fd;
+	uint64_t rand;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	//replies by the time they are due
+	struct stub_reply *replies;
+	int closing;
+	int dead;
+	pthread_t writer;
+};
+
+struct stub_call
+{
+	struct stub_conn *conn;
+	struct xdr_in in;
+	struct xdr_out out;
+	uint32_t prog, vers, proc;
+	//where the accept_stat of the reply is
+	size_t accept;
+	uint64_t delay;
+};
+
+struct stub_rule
+{
+	int proc;
+	int error;
+	double percent;
+};
+
+struct stub_proc
+{
+	const char *name;
+	int (*fn)(struct stub_call *c);
+	//words of a failed result after its status: no attributes
+	int fail_words;
+};
+
+struct stub
+{
+	const char *root;
+	const char *export;
+	const char *addr;
+	int rootfd;
+	uint64_t rootino;
+	uint64_t fsid;
+	int memory;
+	unsigned short port;
+	int portmap;
+	unsigned char verf[8];
+	unsigned int seed;
+	unsigned int conns;
+
+	double latency_ms[22];
+	double jitter_ms;
+	double kbps;
+	struct stub_rule rules[STUB_MAX_RULES];
+	int nrules;
+
+	pthread_mutex_t nodes_lock;
+	struct stub_node *nodes[STUB_NODE_BUCKETS];
+
+	pthread_mutex_t link_lock;
+	uint64_t in_free, out_free;
+
+	unsigned long calls[22], injected[22];
+	unsigned long long bytes_read, bytes_written;
+
+	volatile sig_atomic_t stop, dump;
+};
+
+static struct stub stub = {
+	.export = "/export",
+	.addr = "127.0.0.1",
+	.rootfd = -1,
+	.seed = 1,
+	.nodes_lock = PTHREAD_MUTEX_INITIALIZER,
+	.link_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts = {.tv_sec = t / 1000000000ULL, .tv_nsec = t % 1000000000ULL};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* xorshift64*, one state per connection so a run replays the same way */
+static double stub_random(struct stub_conn *conn)
+{
+	conn->rand ^= conn->rand >> 12;
+	conn->rand ^= conn->rand << 25;
+	conn->rand ^= conn->rand >> 27;
+	return (double)((conn->rand * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+/* ---- xdr ---- */
+
+static uint32_t get_u32(struct xdr_in *x)
+{
+	uint32_t v;
+
+	if (x->bad || x->end - x->p < 4)
+	{
+		x->bad = 1;
+		return 0;
+	}
+	v = (uint32_t)x->p[0] << 24 | (uint32_t)x->p[1] << 16 | (uint32_t)x->p[2] << 8 | x->p[3];
+	x->p += 4;
+	return v;
+}
+
+static uint64_t get_u64(struct xdr_in *x)
+{
+	uint64_t hi = get_u32(x);
+
+	return hi << 32 | get_u32(x);
+}
+
+static const unsigned char *get_fixed(struct xdr_in *x, size_t len)
+{
+	const unsigned char *p = x->p;
+	size_t padded = (len + 3) & ~(size_t)3;
+
+	if (x->bad || (size_t)(x->end - x->p) < padded)
+	{
+		x->bad = 1;
+		return NULL;
+	}
+	x->p += padded;
+	return p;
+}
+
+static const unsigned char *get_opaque(struct xdr_in *x, uint32_t *len, uint32_t max)
+{
+	uint32_t n = get_u32(x);
+
+	*len = 0;
+	if (n > max)
+		x->bad = 1;
+	if (x->bad)
+		return NULL;
+	*len = n;
+	return get_fixed(x, n);
+}
+
+/* a string of up to size - 1 bytes, with the NUL added */
+static void get_string(struct xdr_in *x, char *buf, size_t size)
+{
+	uint32_t len;
+	const unsigned char *p = get_opaque(x, &len, size - 1);
+
+	if (p && memchr(p, '\0', len))
+		x->bad = 1;
+	if (x->bad)
+	{
+		buf[0] = '\0';
+		return;
+	}
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+}
+
+static unsigned char *put_space(struct xdr_out *o, size_t n)
+{
+	unsigned char *p;
+
+	if (o->bad)
+		return NULL;
+	if (o->len + n > o->size)
+	{
+		size_t size = o->size ? o->size : 1024;
+
+		while (size < o->len + n)
+			size *= 2;
+		if (!(p = realloc(o->buf, size)))
+		{
+			o->bad = 1;
+			return NULL;
+		}
+		o->buf = p;
+		o->size = size;
+	}
+	p = o->buf + o->len;
+	o->len += n;
+	return p;
+}
+
+static void set_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void put_u32(struct xdr_out *o, uint32_t v)
+{
+	unsigned char *p = put_space(o, 4);
+
+	if (p)
+		set_u32(p, v);
+}
+
+static void put_u64(struct xdr_out *o, uint64_t v)
+{
+	put_u32(o, v >> 32);
+	put_u32(o, v);
+}
+
+static void put_fixed(struct xdr_out *o, const void *data, size_t len)
+{
+	size_t padded = (len + 3) & ~(size_t)3;
+	unsigned char *p = put_space(o, padded);
+
+	if (!p)
+		return;
+	memcpy(p, data, len);
+	memset(p + len, 0, padded - len);
+}
+
+static void put_opaque(struct xdr_out *o, const void *data, size_t len)
+{
+	put_u32(o, len);
+	put_fixed(o, data, len);
+}
+
+static void put_string(struct xdr_out *o, const char *s)
+{
+	put_opaque(o, s, strlen(s));
+}
+
+/* ---- handles: the inode number, mapped to the last path it was seen at ---- */
+
+static struct stub_node **node_slot(uint64_t ino)
+{
+	struct stub_node **n = &stub.nodes[(ino * 0x9e3779b97f4a7c15ULL) >> 48];
+
+	while (*n && (*n)->ino != ino)
+		n = &(*n)->next;
+	return n;
+}
+
+static void node_set(uint64_t ino, const char *path)
+{
+	struct stub_node **n, *node;
+	char *copy;
+
+	pthread_mutex_lock(&stub.nodes_lock);
+	n = node_slot(ino);
+	if (*n && !strcmp((*n)->path, path))
+	{
+		pthread_mutex_unlock(&stub.nodes_lock);
+		return;
+	}
+	if (!(copy = strdup(path)))
+	{
+		pthread_mutex_unlock(&stub.nodes_lock);
+		return;
+	}
+	if ((node = *n))
+		free(node->path);
+	else if ((node = calloc(1, sizeof(*node))))
+	{
+		node->ino = ino;
+		*n = node;
+	}
+	else
+	{
+		free(copy);
+		pthread_mutex_unlock(&stub.nodes_lock);
+		return;
+	}
+	node->path = copy;
+	pthread_mutex_unlock(&stub.nodes_lock);
+}
+
+static int node_path(uint64_t ino, char *path)
+{
+	struct stub_node **n;
+	int ret = -1;
+
+	pthread_mutex_lock(&stub.nodes_lock);
+	if (*(n = node_slot(ino)))
+	{
+		strcpy(path, (*n)->path);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&stub.nodes_lock);
+	return ret;
+}
+
+/* what was below from is now below to */
+static void node_rename(const char *from, const char *to)
+{
+	size_t flen = strlen(from), tlen = strlen(to);
+	unsigned int i;
+
+	pthread_mutex_lock(&stub.nodes_lock);
+	for (i = 0; i < STUB_NODE_BUCKETS; i++)
+	{
+		struct stub_node *n;
+
+		for (n = stub.nodes[i]; n; n = n->next)
+		{
+			char *path;
+			size_t len = strlen(n->path);
+
+			if (len <= flen || strncmp(n->path, from, flen) || n->path[flen] != '/' ||
+				tlen + len - flen >= PATH_MAX || !(path = malloc(tlen + len - flen + 1)))
+				continue;
+			memcpy(path, to, tlen);
+			strcpy(path + tlen, n->path + flen);
+			free(n->path);
+			n->path = path;
+		}
+	}
+	pthread_mutex_unlock(&stub.nodes_lock);
+}
+
+static void put_fh(struct xdr_out *o, uint64_t ino)
+{
+	unsigned char fh[STUB_FH_SIZE];
+
+	set_u32(fh, STUB_FH_MAGIC);
+	set_u32(fh + 4, ino >> 32);
+	set_u32(fh + 8, ino);
+	put_opaque(o, fh, sizeof(fh));
+}
+
+static int nfs3_errno(int err)
+{
+	switch (err)
+	{
+	case EPERM:
+		return NFS3ERR_PERM;
+	case ENOENT:
+		return NFS3ERR_NOENT;
+	case ENXIO:
+		return NFS3ERR_NXIO;
+	case EACCES:
+		return NFS3ERR_ACCES;
+	case EEXIST:
+		return NFS3ERR_EXIST;
+	case EXDEV:
+		return NFS3ERR_XDEV;
+	case ENODEV:
+		return NFS3ERR_NODEV;
+	case ENOTDIR:
+		return NFS3ERR_NOTDIR;
+	case EISDIR:
+		return NFS3ERR_ISDIR;
+	case EINVAL:
+		return NFS3ERR_INVAL;
+	case EFBIG:
+		return NFS3ERR_FBIG;
+	case ENOSPC:
+		return NFS3ERR_NOSPC;
+	case EROFS:
+		return NFS3ERR_ROFS;
+	case EMLINK:
+		return NFS3ERR_MLINK;
+	case ENAMETOOLONG:
+		return NFS3ERR_NAMETOOLONG;
+	case ENOTEMPTY:
+		return NFS3ERR_NOTEMPTY;
+	case EDQUOT:
+		return NFS3ERR_DQUOT;
+	case ESTALE:
+		return NFS3ERR_STALE;
+	case EOPNOTSUPP:
+		return NFS3ERR_NOTSUPP;
+	default:
+		return NFS3ERR_IO;
+	}
+}
+
+/* the path and attributes of a handle, taken from the call */
+static int fh_get(struct stub_call *c, char *path, struct stat *st)
+{
+	uint32_t len;
+	const unsigned char *fh = get_opaque(&c->in, &len, 64);
+	uint64_t ino;
+
+	if (!fh)
+		return NFS3ERR_BADHANDLE;
+	if (len != STUB_FH_SIZE || ((uint32_t)fh[0] << 24 | fh[1] << 16 | fh[2] << 8 | fh[3]) != STUB_FH_MAGIC)
+		return NFS3ERR_BADHANDLE;
+	ino = (uint64_t)fh[4] << 56 | (uint64_t)fh[5] << 48 | (uint64_t)fh[6] << 40 | (uint64_t)fh[7] << 32 |
+		  (uint64_t)fh[8] << 24 | fh[9] << 16 | fh[10] << 8 | fh[11];
+	//gone, or the path is another file now
+	if (node_path(ino, path) || fstatat(stub.rootfd, path, st, AT_SYMLINK_NOFOLLOW) || st->st_ino != ino)
+		return NFS3ERR_STALE;
+	return NFS3_OK;
+}
+
+static void path_parent(const char *path, char *parent)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (!slash)
+		strcpy(parent, ".");
+	else
+	{
+		memcpy(parent, path, slash - path);
+		parent[slash - path] = '\0';
+	}
+}
+
+static int path_join(const char *dir, const char *name, char *path)
+{
+	int len = strcmp(dir, ".") ? snprintf(path, PATH_MAX, "%s/%s", dir, name)
+							   : snprintf(path, PATH_MAX, "%s", name);
+
+	return len >= PATH_MAX ? NFS3ERR_NAMETOOLONG : NFS3_OK;
+}
+
+/* a directory handle and a name in it: diropargs3 */
+static int dirop_get(struct stub_call *c, char *dir, char *name, char *path, struct stat *dst)
+{
+	int err = fh_get(c, dir, dst);
+
+	get_string(&c->in, name, NAME_MAX + 2);
+	if (err)
+		return err;
+	if (!S_ISDIR(dst->st_mode))
+		return NFS3ERR_NOTDIR;
+	if (strlen(name) > NAME_MAX)
+		return NFS3ERR_NAMETOOLONG;
+	if (!name[0] || strchr(name, '/'))
+		return NFS3ERR_ACCES;
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return NFS3ERR_EXIST;
+	return path_join(dir, name, path);
+}
+
+static void put_fattr(struct xdr_out *o, const struct stat *st)
+{
+	uint32_t type;
+
+	switch (st->st_mode & S_IFMT)
+	{
+	case S_IFREG:
+		type = 1;
+		break;
+	case S_IFDIR:
+		type = 2;
+		break;
+	case S_IFBLK:
+		type = 3;
+		break;
+	case S_IFCHR:
+		type = 4;
+		break;
+	case S_IFLNK:
+		type = 5;
+		break;
+	case S_IFSOCK:
+		type = 6;
+		break;
+	default:
+		type = 7;
+		break;
+	}
+	put_u32(o, type);
+	put_u32(o, st->st_mode & 07777);
+	put_u32(o, st->st_nlink);
+	put_u32(o, st->st_uid);
+	put_u32(o, st->st_gid);
+	put_u64(o, st->st_size);
+	put_u64(o, (uint64_t)st->st_blocks * 512);
+	put_u32(o, major(st->st_rdev));
+	put_u32(o, minor(st->st_rdev));
+	put_u64(o, stub.fsid);
+	put_u64(o, st->st_ino);
+	put_u32(o, st->st_atim.tv_sec);
+	put_u32(o, st->st_atim.tv_nsec);
+	put_u32(o, st->st_mtim.tv_sec);
+	put_u32(o, st->st_mtim.tv_nsec);
+	put_u32(o, st->st_ctim.tv_sec);
+	put_u32(o, st->st_ctim.tv_nsec);
+}
+
+static void put_post_st(struct xdr_out *o, const struct stat *st)
+{
+	put_u32(o, 1);
+	put_fattr(o, st);
+}
+
+static void put_post_attr(struct xdr_out *o, const char *path)
+{
+	struct stat st;
+
+	if (fstatat(stub.rootfd, path, &st, AT_SYMLINK_NOFOLLOW))
+		put_u32(o, 0);
+	else
+		put_post_st(o, &st);
+}
+
+/* wcc_data without the attributes before */
+static void put_wcc(struct xdr_out *o, const char *path)
+{
+	put_u32(o, 0);
+	put_post_attr(o, path);
+}
+
+struct stub_sattr
+{
+	int set_mode, set_uid, set_gid, set_size;
+	uint32_t mode, uid, gid;
+	uint64_t size;
+	struct timespec times[2];
+};
+
+static void sattr_get(struct xdr_in *x, struct stub_sattr *sa)
+{
+	int i;
+
+	if ((sa->set_mode = get_u32(x)))
+		sa->mode = get_u32(x);
+	if ((sa->set_uid = get_u32(x)))
+		sa->uid = get_u32(x);
+	if ((sa->set_gid = get_u32(x)))
+		sa->gid = get_u32(x);
+	if ((sa->set_size = get_u32(x)))
+		sa->size = get_u64(x);
+	for (i = 0; i < 2; i++)
+	{
+		sa->times[i].tv_sec = 0;
+		switch (get_u32(x))
+		{
+		case 1:
+			sa->times[i].tv_nsec = UTIME_NOW;
+			break;
+		case 2:
+			sa->times[i].tv_sec = get_u32(x);
+			sa->times[i].tv_nsec = get_u32(x);
+			break;
+		default:
+			sa->times[i].tv_nsec = UTIME_OMIT;
+			break;
+		}
+	}
+}
+
+static int sattr_apply(const char *path, const struct stub_sattr *sa, const struct stat *st)
+{
+	if ((sa->set_uid || sa->set_gid) &&
+		fchownat(stub.rootfd, path, sa->set_uid ? sa->uid : (uid_t)-1, sa->set_gid ? sa->gid : (gid_t)-1,
+				 AT_SYMLINK_NOFOLLOW))
+		return nfs3_errno(errno);
+	if (sa->set_mode && !S_ISLNK(st->st_mode) && fchmodat(stub.rootfd, path, sa->mode & 07777, 0))
+		return nfs3_errno(errno);
+	if (sa->set_size)
+	{
+		int fd, ret;
+
+		if (!S_ISREG(st->st_mode))
+			return S_ISDIR(st->st_mode) ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+		if ((fd = openat(stub.rootfd, path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+			return nfs3_errno(errno);
+		ret = ftruncate(fd, sa->size) ? nfs3_errno(errno) : NFS3_OK;
+		close(fd);
+		if (ret)
+			return ret;
+	}
+	if ((sa->times[0].tv_nsec != UTIME_OMIT || sa->times[1].tv_nsec != UTIME_OMIT) &&
+		utimensat(stub.rootfd, path, sa->times, AT_SYMLINK_NOFOLLOW))
+		return nfs3_errno(errno);
+	return NFS3_OK;
+}
+
+/* the result of the calls that make a node: its handle, its attributes
+ * and the directory's
+ */
+static int put_created(struct stub_call *c, const char *path, const char *dir)
+{
+	struct stat st;
+
+	if (fstatat(stub.rootfd, path, &st, AT_SYMLINK_NOFOLLOW))
+		return nfs3_errno(errno);
+	node_set(st.st_ino, path);
+	put_u32(&c->out, 1);
+	put_fh(&c->out, st.st_ino);
+	put_post_st(&c->out, &st);
+	put_wcc(&c->out, dir);
+	return NFS3_OK;
+}
+
+/* ---- nfs v3 procedures: they add their result after the status ---- */
+
+static int nfs3_getattr(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int err;
+
+	if ((err = fh_get(c, path, &st)))
+		return err;
+	put_fattr(&c->out, &st);
+	return NFS3_OK;
+}
+
+static int nfs3_setattr(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct stub_sattr sa;
+	struct timespec guard = {0, 0};
+	int err = fh_get(c, path, &st), check;
+
+	sattr_get(&c->in, &sa);
+	if ((check = get_u32(&c->in)))
+	{
+		guard.tv_sec = get_u32(&c->in);
+		guard.tv_nsec = get_u32(&c->in);
+	}
+	if (err)
+		return err;
+	if (check && (guard.tv_sec != st.st_ctim.tv_sec || guard.tv_nsec != st.st_ctim.tv_nsec))
+		return NFS3ERR_NOT_SYNC;
+	if ((err = sattr_apply(path, &sa, &st)))
+		return err;
+	put_wcc(&c->out, path);
+	return NFS3_OK;
+}
+
+static int nfs3_lookup(struct stub_call *c)
+{
+	char dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 2];
+	struct stat dst, st;
+	int err = fh_get(c, dir, &dst);
+
+	get_string(&c->in, name, sizeof(name));
+	if (err)
+		return err;
+	if (!S_ISDIR(dst.st_mode))
+		return NFS3ERR_NOTDIR;
+	if (!strcmp(name, "."))
+		strcpy(path, dir);
+	else if (!strcmp(name, ".."))
+		path_parent(dir, path);
+	else if (strlen(name) > NAME_MAX)
+		return NFS3ERR_NAMETOOLONG;
+	else if (!name[0] || strchr(name, '/'))
+		return NFS3ERR_NOENT;
+	else if ((err = path_join(dir, name, path)))
+		return err;
+	if (fstatat(stub.rootfd, path, &st, AT_SYMLINK_NOFOLLOW))
+		return nfs3_errno(errno);
+	node_set(st.st_ino, path);
+	put_fh(&c->out, st.st_ino);
+	put_post_st(&c->out, &st);
+	put_post_st(&c->out, &dst);
+	return NFS3_OK;
+}
+
+static int nfs3_access(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint32_t want, ok = 0;
+	int err = fh_get(c, path, &st);
+
+	want = get_u32(&c->in);
+	if (err)
+		return err;
+	if (S_ISLNK(st.st_mode))
+		ok = 0x01;
+	else
+	{
+		if (!faccessat(stub.rootfd, path, R_OK, AT_EACCESS))
+			ok |= 0x01;
+		if (!faccessat(stub.rootfd, path, W_OK, AT_EACCESS))
+			ok |= 0x04 | 0x08 | 0x10;
+		if (!faccessat(stub.rootfd, path, X_OK, AT_EACCESS))
+			ok |= S_ISDIR(st.st_mode) ? 0x02 : 0x20;
+	}
+	put_post_st(&c->out, &st);
+	put_u32(&c->out, want & ok);
+	return NFS3_OK;
+}
+
+static int nfs3_readlink(struct stub_call *c)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+	struct stat st;
+	ssize_t n;
+	int err;
+
+	if ((err = fh_get(c, path, &st)))
+		return err;
+	if (!S_ISLNK(st.st_mode))
+		return NFS3ERR_INVAL;
+	if ((n = readlinkat(stub.rootfd, path, target, sizeof(target))) < 0)
+		return nfs3_errno(errno);
+	put_post_st(&c->out, &st);
+	put_opaque(&c->out, target, n);
+	return NFS3_OK;
+}
+
+static int nfs3_read(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t off;
+	uint32_t count;
+	unsigned char *data;
+	size_t at;
+	ssize_t n;
+	int err = fh_get(c, path, &st), fd;
+
+	off = get_u64(&c->in);
+	count = get_u32(&c->in);
+	if (err)
+		return err;
+	if (!S_ISREG(st.st_mode))
+		return S_ISDIR(st.st_mode) ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+	if (count > STUB_MAX_IO)
+		count = STUB_MAX_IO;
+	if ((fd = openat(stub.rootfd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		return nfs3_errno(errno);
+
+	put_post_st(&c->out, &st);
+	at = c->out.len;
+	put_u32(&c->out, 0);
+	put_u32(&c->out, 0);
+	put_u32(&c->out, 0);
+	if (!(data = put_space(&c->out, (count + 3) & ~3U)))
+	{
+		close(fd);
+		return NFS3ERR_SERVERFAULT;
+	}
+	n = pread(fd, data, count, off);
+	err = n < 0 ? nfs3_errno(errno) : NFS3_OK;
+	close(fd);
+	if (err)
+		return err;
+
+	memset(data + n, 0, ((n + 3) & ~3) - n);
+	c->out.len = (data - c->out.buf) + ((n + 3) & ~3);
+	set_u32(c->out.buf + at, n);
+	set_u32(c->out.buf + at + 4, off + n >= (uint64_t)st.st_size);
+	set_u32(c->out.buf + at + 8, n);
+	__atomic_add_fetch(&stub.bytes_read, n, __ATOMIC_RELAXED);
+	return NFS3_OK;
+}
+
+static int nfs3_write(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t off;
+	uint32_t count, stable, len;
+	const unsigned char *data;
+	ssize_t n;
+	int err = fh_get(c, path, &st), fd;
+
+	off = get_u64(&c->in);
+	count = get_u32(&c->in);
+	stable = get_u32(&c->in);
+	data = get_opaque(&c->in, &len, STUB_MAX_IO);
+	if (err)
+		return err;
+	if (!data)
+		return NFS3ERR_INVAL;
+	if (!S_ISREG(st.st_mode))
+		return S_ISDIR(st.st_mode) ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+	if (stable > 2)
+		return NFS3ERR_INVAL;
+	if ((fd = openat(stub.rootfd, path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		return nfs3_errno(errno);
+	n = pwrite(fd, data, count < len ? count : len, off);
+	err = n < 0 ? nfs3_errno(errno) : NFS3_OK;
+	close(fd);
+	if (err)
+		return err;
+
+	__atomic_add_fetch(&stub.bytes_written, n, __ATOMIC_RELAXED);
+	put_wcc(&c->out, path);
+	put_u32(&c->out, n);
+	//nothing is synced, the client gets the stability it asked for
+	put_u32(&c->out, stable);
+	put_fixed(&c->out, stub.verf, sizeof(stub.verf));
+	return NFS3_OK;
+}
+
+static int nfs3_create(struct stub_call *c)
+{
+	char dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 2];
+	struct stat dst, st;
+	struct stub_sattr sa = {0};
+	const unsigned char *verf = NULL;
+	uint32_t how;
+	int err = dirop_get(c, dir, name, path, &dst), fd;
+
+	if ((how = get_u32(&c->in)) == 2)
+		verf = get_fixed(&c->in, 8);
+	else
+		sattr_get(&c->in, &sa);
+	if (err)
+		return err;
+	if (how > 2)
+		return NFS3ERR_INVAL;
+
+	fd = openat(stub.rootfd, path, O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC | (how ? O_EXCL : 0),
+				sa.set_mode ? sa.mode & 07777 : 0644);
+	if (verf)
+	{
+		//the verifier is kept in the times, so a retransmission finds it
+		struct timespec times[2] = {
+			{(uint32_t)verf[0] << 24 | verf[1] << 16 | verf[2] << 8 | verf[3], 0},
+			{(uint32_t)verf[4] << 24 | verf[5] << 16 | verf[6] << 8 | verf[7], 0},
+		};
+
+		if (fd < 0)
+		{
+			if (errno != EEXIST || fstatat(stub.rootfd, path, &st, AT_SYMLINK_NOFOLLOW))
+				return nfs3_errno(errno);
+			if (st.st_atim.tv_sec != times[0].tv_sec || st.st_mtim.tv_sec != times[1].tv_sec)
+				return NFS3ERR_EXIST;
+		}
+		else if (futimens(fd, times))
+			err = nfs3_errno(errno);
+	}
+	else if (fd < 0)
+		return nfs3_errno(errno);
+	else if (!fstat(fd, &st))
+		err = sattr_apply(path, &sa, &st);
+	if (fd >= 0)
+		close(fd);
+	if (err)
+		return err;
+	return put_created(c, path, dir);
+}
+
+static int nfs3_mkdir(struct stub_call *c)
+{
+	char dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 2];
+	struct stat dst, st;
+	struct stub_sattr sa;
+	int err = dirop_get(c, dir, name, path, &dst);
+
+	sattr_get(&c->in, &sa);
+	if (err)
+		return err;
+	if (mkdirat(stub.rootfd, path, sa.set_mode ? sa.mode & 07777 : 0755))
+		return nfs3_errno(errno);
+	sa.set_mode = 0;
+	if (!fstatat(stub.rootfd, path, &st, AT_SYMLINK_NOFOLLOW) && (err = sattr_apply(path, &sa, &st)))
+		return err;
+	return put_created(c, path, dir);
+}
+
+static int nfs3_symlink(struct stub_call *c)
+{
+	char dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 2], target[PATH_MAX];
+	struct stat dst;
+	struct stub_sattr sa;
+	int err = dirop_get(c, dir, name, path, &dst);
+
+	sattr_get(&c->in, &sa);
+	get_string(&c->in, target, sizeof(target));
+	if (err)
+		return err;
+	if (symlinkat(target, stub.rootfd, path))
+		return nfs3_errno(errno);
+	return put_created(c, path, dir);
+}
+
+static int nfs3_mknod(struct stub_call *c)
+{
+	char dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 2];
+	struct stat dst;
+	struct stub_sattr sa = {0};
+	uint32_t type, maj = 0, min = 0;
+	mode_t fmt;
+	int err = dirop_get(c, dir, name, path, &dst);
+
+	switch ((type = get_u32(&c->in)))
+	{
+	case 3:
+	case 4:
+		sattr_get(&c->in, &sa);
+		maj = get_u32(&c->in);
+		min = get_u32(&c->in);
+		fmt = type == 3 ? S_IFBLK : S_IFCHR;
+		break;
+	case 6:
+	case 7:
+		sattr_get(&c->in, &sa);
+		fmt = type == 6 ? S_IFSOCK : S_IFIFO;
+		break;
+	default:
+		return err ? err : NFS3ERR_BADTYPE;
+	}
+	if (err)
+		return err;
+	if (mknodat(stub.rootfd, path, fmt | (sa.set_mode ? sa.mode & 07777 : 0644), makedev(maj, min)))
+		return nfs3_errno(errno);
+	return put_created(c, path, dir);
+}
+
+static int nfs3_unlink(struct stub_call *c, int flags)
+{
+	char dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 2];
+	struct stat dst;
+	int err;
+
+	if ((err = dirop_get(c, dir, name, path, &dst)))
+		return err;
+	if (unlinkat(stub.rootfd, path, flags))
+		return nfs3_errno(errno);
+	put_wcc(&c->out, dir);
+	return NFS3_OK;
+}
+
+static int nfs3_remove(struct stub_call *c)
+{
+	return nfs3_unlink(c, 0);
+}
+
+static int nfs3_rmdir(struct stub_call *c)
+{
+	return nfs3_unlink(c, AT_REMOVEDIR);
+}
+
+static int nfs3_rename(struct stub_call *c)
+{
+	char fdir[PATH_MAX], from[PATH_MAX], tdir[PATH_MAX], to[PATH_MAX], name[NAME_MAX + 2];
+	struct stat fst, tst, st;
+	int err = dirop_get(c, fdir, name, from, &fst), terr;
+
+	terr = dirop_get(c, tdir, name, to, &tst);
+	if (err || (err = terr))
+		return err;
+	if (renameat(stub.rootfd, from, stub.rootfd, to))
+		return nfs3_errno(errno);
+	if (!fstatat(stub.rootfd, to, &st, AT_SYMLINK_NOFOLLOW))
+	{
+		node_set(st.st_ino, to);
+		if (S_ISDIR(st.st_mode))
+			node_rename(from, to);
+	}
+	put_wcc(&c->out, fdir);
+	put_wcc(&c->out, tdir);
+	return NFS3_OK;
+}
+
+static int nfs3_link(struct stub_call *c)
+{
+	char file[PATH_MAX], dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 2];
+	struct stat st, dst;
+	int err = fh_get(c, file, &st), derr;
+
+	derr = dirop_get(c, dir, name, path, &dst);
+	if (err || (err = derr))
+		return err;
+	if (linkat(stub.rootfd, file, stub.rootfd, path, 0))
+		return nfs3_errno(errno);
+	put_post_attr(&c->out, file);
+	put_wcc(&c->out, dir);
+	return NFS3_OK;
+}
+
+/* the cookie of an entry is its position in the directory, which holds
+ * as long as the directory is not changed
+ */
+static int nfs3_readdir_common(struct stub_call *c, int plus)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	struct stat dst, st;
+	struct dirent *e;
+	uint64_t cookie, idx = 0;
+	uint32_t count;
+	size_t limit;
+	int err = fh_get(c, dir, &dst), fd, n = 0, eof = 1;
+	DIR *d;
+
+	cookie = get_u64(&c->in);
+	get_fixed(&c->in, 8);
+	count = get_u32(&c->in);
+	if (plus)
+		count = get_u32(&c->in);
+	if (err)
+		return err;
+	if (!S_ISDIR(dst.st_mode))
+		return NFS3ERR_NOTDIR;
+	if ((fd = openat(stub.rootfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return nfs3_errno(errno);
+	if (!(d = fdopendir(fd)))
+	{
+		err = nfs3_errno(errno);
+		close(fd);
+		return err;
+	}
+
+	//room for the end of the list and eof
+	limit = c->out.len + (count > STUB_MAX_IO ? STUB_MAX_IO : count) - 8;
+	put_post_st(&c->out, &dst);
+	put_u64(&c->out, 0);
+	while ((e = readdir(d)))
+	{
+		size_t mark = c->out.len;
+
+		if (++idx <= cookie)
+			continue;
+		if (!strcmp(e->d_name, "."))
+			strcpy(path, dir);
+		else if (!strcmp(e->d_name, ".."))
+			path_parent(dir, path);
+		else if (path_join(dir, e->d_name, path))
+			continue;
+		if (fstatat(stub.rootfd, path, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+
+		put_u32(&c->out, 1);
+		put_u64(&c->out, st.st_ino);
+		put_string(&c->out, e->d_name);
+		put_u64(&c->out, idx);
+		if (plus)
+		{
+			node_set(st.st_ino, path);
+			put_post_st(&c->out, &st);
+			put_u32(&c->out, 1);
+			put_fh(&c->out, st.st_ino);
+		}
+		if (c->out.len > limit)
+		{
+			c->out.len = mark;
+			eof = 0;
+			break;
+		}
+		n++;
+	}
+	closedir(d);
+	if (!n && !eof)
+		return NFS3ERR_TOOSMALL;
+	put_u32(&c->out, 0);
+	put_u32(&c->out, eof);
+	return NFS3_OK;
+}
+
+static int nfs3_readdir(struct stub_call *c)
+{
+	return nfs3_readdir_common(c, 0);
+}
+
+static int nfs3_readdirplus(struct stub_call *c)
+{
+	return nfs3_readdir_common(c, 1);
+}
+
+static int nfs3_fsstat(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct statvfs sv;
+	int err;
+
+	if ((err = fh_get(c, path, &st)))
+		return err;
+	if (fstatvfs(stub.rootfd, &sv))
+		return nfs3_errno(errno);
+	put_post_st(&c->out, &st);
+	put_u64(&c->out, (uint64_t)sv.f_blocks * sv.f_frsize);
+	put_u64(&c->out, (uint64_t)sv.f_bfree * sv.f_frsize);
+	put_u64(&c->out, (uint64_t)sv.f_bavail * sv.f_frsize);
+	put_u64(&c->out, sv.f_files);
+	put_u64(&c->out, sv.f_ffree);
+	put_u64(&c->out, sv.f_favail);
+	put_u32(&c->out, 0);
+	return NFS3_OK;
+}
+
+static int nfs3_fsinfo(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int err;
+
+	if ((err = fh_get(c, path, &st)))
+		return err;
+	put_post_st(&c->out, &st);
+	put_u32(&c->out, STUB_MAX_IO);
+	put_u32(&c->out, STUB_MAX_IO);
+	put_u32(&c->out, 4096);
+	put_u32(&c->out, STUB_MAX_IO);
+	put_u32(&c->out, STUB_MAX_IO);
+	put_u32(&c->out, 4096);
+	put_u32(&c->out, 65536);
+	put_u64(&c->out, INT64_MAX);
+	put_u32(&c->out, 0);
+	put_u32(&c->out, 1);
+	//FSF3_LINK | FSF3_SYMLINK | FSF3_HOMOGENEOUS | FSF3_CANSETTIME
+	put_u32(&c->out, 0x1b);
+	return NFS3_OK;
+}
+
+static int nfs3_pathconf(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int err;
+
+	if ((err = fh_get(c, path, &st)))
+		return err;
+	put_post_st(&c->out, &st);
+	put_u32(&c->out, 32000);
+	put_u32(&c->out, NAME_MAX);
+	put_u32(&c->out, 1);
+	put_u32(&c->out, 1);
+	put_u32(&c->out, 0);
+	put_u32(&c->out, 1);
+	return NFS3_OK;
+}
+
+static int nfs3_commit(struct stub_call *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int err = fh_get(c, path, &st);
+
+	get_u64(&c->in);
+	get_u32(&c->in);
+	if (err)
+		return err;
+	put_wcc(&c->out, path);
+	put_fixed(&c->out, stub.verf, sizeof(stub.verf));
+	return NFS3_OK;
+}
+
+static const struct stub_proc nfs3_procs[] = {
+	{"null", NULL, 0},
+	{"getattr", nfs3_getattr, 0},
+	{"setattr", nfs3_setattr, 2},
+	{"lookup", nfs3_lookup, 1},
+	{"access", nfs3_access, 1},
+	{"readlink", nfs3_readlink, 1},
+	{"read", nfs3_read, 1},
+	{"write", nfs3_write, 2},
+	{"create", nfs3_create, 2},
+	{"mkdir", nfs3_mkdir, 2},
+	{"symlink", nfs3_symlink, 2},
+	{"mknod", nfs3_mknod, 2},
+	{"remove", nfs3_remove, 2},
+	{"rmdir", nfs3_rmdir, 2},
+	{"rename", nfs3_rename, 4},
+	{"link", nfs3_link, 3},
+	{"readdir", nfs3_readdir, 1},
+	{"readdirplus", nfs3_readdirplus, 1},
+	{"fsstat", nfs3_fsstat, 1},
+	{"fsinfo", nfs3_fsinfo, 1},
+	{"pathconf", nfs3_pathconf, 1},
+	{"commit", nfs3_commit, 2},
+};
+
+#define NFS3_PROCS ((int)(sizeof(nfs3_procs) / sizeof(nfs3_procs[0])))
+
+/* ---- rpc ---- */
+
+static void rpc_accept(struct stub_call *c, uint32_t stat)
+{
+	c->out.len = c->accept;
+	put_u32(&c->out, stat);
+}
+
+static void rpc_mismatch(struct stub_call *c, uint32_t vers)
+{
+	rpc_accept(c, RPC_PROG_MISMATCH);
+	put_u32(&c->out, vers);
+	put_u32(&c->out, vers);
+}
+
+/* the first rule for proc that fires: an nfs3 status, STUB_DROP or STUB_CLOSE */
+static int stub_inject(struct stub_conn *conn, uint32_t proc)
+{
+	int i;
+
+	for (i = 0; i < stub.nrules; i++)
+	{
+		const struct stub_rule *r = &stub.rules[i];
+
+		//"all" leaves the pings alone
+		if (r->proc < 0 ? proc != 0 : (uint32_t)r->proc == proc)
+			if (r->percent >= 100 || stub_random(conn) * 100 < r->percent)
+			{
+				__atomic_add_fetch(&stub.injected[proc], 1, __ATOMIC_RELAXED);
+				return r->error;
+			}
+	}
+	return 0;
+}
+
+static int nfs3_call(struct stub_call *c)
+{
+	const struct stub_proc *p;
+	size_t mark;
+	int status;
+
+	if (c->proc >= (uint32_t)NFS3_PROCS)
+	{
+		rpc_accept(c, RPC_PROC_UNAVAIL);
+		return 0;
+	}
+	p = &nfs3_procs[c->proc];
+	__atomic_add_fetch(&stub.calls[c->proc], 1, __ATOMIC_RELAXED);
+	c->delay = stub.latency_ms[c->proc] * 1e6;
+	if (stub.jitter_ms)
+		c->delay += stub_random(c->conn) * stub.jitter_ms * 1e6;
+
+	if ((status = stub_inject(c->conn, c->proc)) < 0)
+		return status;
+	if (!p->fn)
+		return 0;
+	mark = c->out.len;
+	put_u32(&c->out, NFS3_OK);
+	if (!status)
+		status = p->fn(c);
+	if (c->in.bad)
+		rpc_accept(c, RPC_GARBAGE_ARGS);
+	else if (status)
+	{
+		int i;
+
+		c->out.len = mark;
+		put_u32(&c->out, status);
+		for (i = 0; i < p->fail_words; i++)
+			put_u32(&c->out, 0);
+	}
+	return 0;
+}
+
+static void export_name(const char *path, char *name)
+{
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	memcpy(name, path, len);
+	name[len] = '\0';
+}
+
+static int mount3_call(struct stub_call *c)
+{
+	char path[1025], name[1025];
+
+	switch (c->proc)
+	{
+	case 0:
+	case 4:
+		break;
+	case 1:
+		get_string(&c->in, path, sizeof(path));
+		if (c->in.bad)
+			break;
+		export_name(path, name);
+		if (strcmp(name, stub.export))
+		{
+			put_u32(&c->out, 2);
+			break;
+		}
+		put_u32(&c->out, 0);
+		put_fh(&c->out, stub.rootino);
+		//AUTH_UNIX
+		put_u32(&c->out, 1);
+		put_u32(&c->out, 1);
+		break;
+	case 2:
+		put_u32(&c->out, 0);
+		break;
+	case 3:
+		get_string(&c->in, path, sizeof(path));
+		break;
+	case 5:
+		put_u32(&c->out, 1);
+		put_string(&c->out, stub.export);
+		put_u32(&c->out, 0);
+		put_u32(&c->out, 0);
+		break;
+	default:
+		rpc_accept(c, RPC_PROC_UNAVAIL);
+		return 0;
+	}
+	if (c->in.bad)
+		rpc_accept(c, RPC_GARBAGE_ARGS);
+	return 0;
+}
+
+static int pmap2_call(struct stub_call *c)
+{
+	static const uint32_t progs[][2] = {{PMAP_PROG, 2}, {MOUNT_PROG, 3}, {NFS_PROG, 3}};
+	uint32_t prog, vers, prot;
+	unsigned int i, port = 0;
+
+	switch (c->proc)
+	{
+	case 0:
+		break;
+	case 3:
+		prog = get_u32(&c->in);
+		vers = get_u32(&c->in);
+		prot = get_u32(&c->in);
+		get_u32(&c->in);
+		for (i = 0; i < sizeof(progs) / sizeof(progs[0]); i++)
+			if (prog == progs[i][0] && vers == progs[i][1] && prot == IPPROTO_TCP_PMAP)
+				port = stub.port;
+		put_u32(&c->out, port);
+		break;
+	case 4:
+		for (i = 0; i < sizeof(progs) / sizeof(progs[0]); i++)
+		{
+			put_u32(&c->out, 1);
+			put_u32(&c->out, progs[i][0]);
+			put_u32(&c->out, progs[i][1]);
+			put_u32(&c->out, IPPROTO_TCP_PMAP);
+			put_u32(&c->out, stub.port);
+		}
+		put_u32(&c->out, 0);
+		break;
+	default:
+		rpc_accept(c, RPC_PROC_UNAVAIL);
+		return 0;
+	}
+	if (c->in.bad)
+		rpc_accept(c, RPC_GARBAGE_ARGS);
+	return 0;
+}
+
+/* one record in, its reply in c->out: 0, STUB_DROP for no reply or
+ * STUB_CLOSE to drop the connection
+ */
+static int rpc_call(struct stub_call *c)
+{
+	uint32_t xid, len;
+
+	xid = get_u32(&c->in);
+	if (get_u32(&c->in) != 0 || c->in.bad)
+		return STUB_CLOSE;
+	//record mark, filled in when sent
+	put_u32(&c->out, 0);
+	put_u32(&c->out, xid);
+	put_u32(&c->out, 1);
+	if (get_u32(&c->in) != 2)
+	{
+		//MSG_DENIED, RPC_MISMATCH
+		put_u32(&c->out, 1);
+		put_u32(&c->out, 0);
+		put_u32(&c->out, 2);
+		put_u32(&c->out, 2);
+		return c->in.bad ? STUB_CLOSE : 0;
+	}
+	c->prog = get_u32(&c->in);
+	c->vers = get_u32(&c->in);
+	c->proc = get_u32(&c->in);
+	//the credentials and the verifier are not looked at
+	get_u32(&c->in);
+	get_opaque(&c->in, &len, 400);
+	get_u32(&c->in);
+	get_opaque(&c->in, &len, 400);
+	if (c->in.bad)
+		return STUB_CLOSE;
+
+	put_u32(&c->out, 0);
+	put_u32(&c->out, 0);
+	put_u32(&c->out, 0);
+	c->accept = c->out.len;
+	put_u32(&c->out, RPC_SUCCESS);
+	switch (c->prog)
+	{
+	case PMAP_PROG:
+		if (c->vers != 2)
+			rpc_mismatch(c, 2);
+		else
+			return pmap2_call(c);
+		break;
+	case MOUNT_PROG:
+		if (c->vers != 3)
+			rpc_mismatch(c, 3);
+		else
+			return mount3_call(c);
+		break;
+	case NFS_PROG:
+		if (c->vers != 3)
+			rpc_mismatch(c, 3);
+		else
+			return nfs3_call(c);
+		break;
+	default:
+		rpc_accept(c, RPC_PROG_UNAVAIL);
+		break;
+	}
+	return 0;
+}
+
+/* ---- connections ---- */
+
+/* when len bytes are through one way of the link, queued behind what is on it */
+static uint64_t stub_link(uint64_t *free_at, uint64_t start, size_t len)
+{
+	uint64_t t;
+
+	if (!stub.kbps)
+		return start;
+	pthread_mutex_lock(&stub.link_lock);
+	if (*free_at < start)
+		*free_at = start;
+	*free_at += (uint64_t)(len * 1e9 / (stub.kbps * 1024));
+	t = *free_at;
+	pthread_mutex_unlock(&stub.link_lock);
+	return t;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len)
+	{
+		ssize_t n = read(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *stub_writer(void *arg)
+{
+	struct stub_conn *conn = arg;
+	struct stub_reply *r;
+
+	pthread_mutex_lock(&conn->lock);
+	for (;;)
+	{
+		while (!conn->replies && !conn->closing)
+			pthread_cond_wait(&conn->cond, &conn->lock);
+		if (!(r = conn->replies))
+			break;
+		if (!conn->dead && r->due > now_ns())
+		{
+			struct timespec ts = {.tv_sec = r->due / 1000000000ULL, .tv_nsec = r->due % 1000000000ULL};
+
+			pthread_cond_timedwait(&conn->cond, &conn->lock, &ts);
+			continue;
+		}
+		conn->replies = r->next;
+		pthread_mutex_unlock(&conn->lock);
+
+		if (!conn->dead)
+		{
+			size_t off = 0;
+
+			while (off < r->len)
+			{
+				ssize_t n = send(conn->fd, r->buf + off, r->len - off, MSG_NOSIGNAL);
+
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+				{
+					conn->dead = 1;
+					break;
+				}
+				off += n;
+			}
+		}
+		free(r->buf);
+		free(r);
+		pthread_mutex_lock(&conn->lock);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return NULL;
+}
+
+static void stub_queue(struct stub_conn *conn, struct xdr_out *out, uint64_t due)
+{
+	struct stub_reply *r, **p;
+
+	if (!(r = malloc(sizeof(*r))))
+	{
+		free(out->buf);
+		return;
+	}
+	set_u32(out->buf, 0x80000000U | (uint32_t)(out->len - 4));
+	r->buf = out->buf;
+	r->len = out->len;
+	r->due = due;
+
+	pthread_mutex_lock(&conn->lock);
+	for (p = &conn->replies; *p && (*p)->due <= due; p = &(*p)->next)
+		;
+	r->next = *p;
+	*p = r;
+	pthread_cond_signal(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+static void *stub_conn_run(void *arg)
+{
+	struct stub_conn *conn = arg;
+	unsigned char *buf = malloc(STUB_MAX_RECORD);
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&conn->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&conn->lock, NULL);
+	if (!buf || pthread_create(&conn->writer, NULL, stub_writer, conn))
+	{
+		free(buf);
+		close(conn->fd);
+		free(conn);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		struct stub_call c = {.conn = conn};
+		unsigned char mark[4];
+		uint32_t frag;
+		size_t len = 0;
+		int ret;
+
+		//records come in fragments, the last one has the top bit set
+		do
+		{
+			if (read_full(conn->fd, mark, 4))
+				goto out;
+			frag = (uint32_t)mark[0] << 24 | mark[1] << 16 | mark[2] << 8 | mark[3];
+			if (len + (frag & 0x7fffffffU) > STUB_MAX_RECORD ||
+				read_full(conn->fd, buf + len, frag & 0x7fffffffU))
+				goto out;
+			len += frag & 0x7fffffffU;
+		} while (!(frag & 0x80000000U));
+		sleep_until(stub_link(&stub.in_free, now_ns(), len + 4));
+
+		c.in.p = buf;
+		c.in.end = buf + len;
+		if ((ret = rpc_call(&c)) == STUB_CLOSE || c.out.bad)
+		{
+			free(c.out.buf);
+			conn->dead = 1;
+			shutdown(conn->fd, SHUT_RDWR);
+			break;
+		}
+		if (ret == STUB_DROP)
+		{
+			free(c.out.buf);
+			continue;
+		}
+		stub_queue(conn, &c.out, stub_link(&stub.out_free, now_ns() + c.delay, c.out.len));
+	}
+out:
+	free(buf);
+	pthread_mutex_lock(&conn->lock);
+	conn->closing = 1;
+	pthread_cond_signal(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+	pthread_join(conn->writer, NULL);
+	close(conn->fd);
+	pthread_cond_destroy(&conn->cond);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+	return NULL;
+}
+
+static int stub_listen(unsigned short port)
+{
+	struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(port)};
+	socklen_t len = sizeof(sin);
+	int fd, on = 1;
+
+	if (inet_pton(AF_INET, stub.addr, &sin.sin_addr) != 1)
+	{
+		fprintf(stderr, "nfsstubd: bad address %s\n", stub.addr);
+		return -1;
+	}
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+		bind(fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(fd, 64) ||
+		getsockname(fd, (struct sockaddr *)&sin, &len))
+	{
+		fprintf(stderr, "nfsstubd: %s:%u: %s\n", stub.addr, port, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (!stub.port)
+		stub.port = ntohs(sin.sin_port);
+	return fd;
+}
+
+static void stub_accept(int lfd)
+{
+	struct stub_conn *conn;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd, on = 1;
+
+	if ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (!(conn = calloc(1, sizeof(*conn))))
+	{
+		close(fd);
+		return;
+	}
+	conn->fd = fd;
+	//a different but repeatable sequence for each connection
+	conn->rand = (stub.seed + 1) * 0x9e3779b97f4a7c15ULL + ++stub.conns;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, stub_conn_run, conn))
+	{
+		close(fd);
+		free(conn);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* ---- setup ---- */
+
+static void stub_stats(void)
+{
+	int i;
+
+	fprintf(stderr, "nfsstubd: calls");
+	for (i = 0; i < NFS3_PROCS; i++)
+	{
+		unsigned long n = __atomic_load_n(&stub.calls[i], __ATOMIC_RELAXED);
+		unsigned long inj = __atomic_load_n(&stub.injected[i], __ATOMIC_RELAXED);
+
+		if (!n)
+			continue;
+		fprintf(stderr, " %s:%lu", nfs3_procs[i].name, n);
+		if (inj)
+			fprintf(stderr, "(%lu failed)", inj);
+	}
+	fprintf(stderr, " data read:%llu KB written:%llu KB\n",
+			__atomic_load_n(&stub.bytes_read, __ATOMIC_RELAXED) / 1024,
+			__atomic_load_n(&stub.bytes_written, __ATOMIC_RELAXED) / 1024);
+}
+
+static int stub_rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+static void stub_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		stub.dump = 1;
+	else
+		stub.stop = 1;
+}
+
+static int stub_proc_index(const char *name, size_t len)
+{
+	int i;
+
+	if (len == 3 && !strncmp(name, "all", 3))
+		return -1;
+	for (i = 0; i < NFS3_PROCS; i++)
+		if (strlen(nfs3_procs[i].name) == len && !strncmp(nfs3_procs[i].name, name, len))
+			return i;
+	return -2;
+}
+
+/* [PROC=]MS */
+static int stub_parse_latency(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	int proc = eq ? stub_proc_index(arg, eq - arg) : -1, i;
+	char *end;
+	double ms = strtod(eq ? eq + 1 : arg, &end);
+
+	if (proc < -1 || *end || ms < 0)
+		return -1;
+	for (i = 0; i < NFS3_PROCS; i++)
+		if (proc < 0 ? i != 0 : i == proc)
+			stub.latency_ms[i] = ms;
+	return 0;
+}
+
+/* PROC=ERROR[:PERCENT] */
+static int stub_parse_rule(const char *arg)
+{
+	static const struct
+	{
+		const char *name;
+		int error;
+	} errors[] = {
+		{"perm", NFS3ERR_PERM}, {"noent", NFS3ERR_NOENT}, {"io", NFS3ERR_IO}, {"nxio", NFS3ERR_NXIO},
+		{"acces", NFS3ERR_ACCES}, {"exist", NFS3ERR_EXIST}, {"xdev", NFS3ERR_XDEV},
+		{"nodev", NFS3ERR_NODEV}, {"notdir", NFS3ERR_NOTDIR}, {"isdir", NFS3ERR_ISDIR},
+		{"inval", NFS3ERR_INVAL}, {"fbig", NFS3ERR_FBIG}, {"nospc", NFS3ERR_NOSPC},
+		{"rofs", NFS3ERR_ROFS}, {"mlink", NFS3ERR_MLINK}, {"nametoolong", NFS3ERR_NAMETOOLONG},
+		{"notempty", NFS3ERR_NOTEMPTY}, {"dquot", NFS3ERR_DQUOT}, {"stale", NFS3ERR_STALE},
+		{"badhandle", NFS3ERR_BADHANDLE}, {"notsupp", NFS3ERR_NOTSUPP},
+		{"serverfault", NFS3ERR_SERVERFAULT}, {"jukebox", NFS3ERR_JUKEBOX},
+		{"drop", STUB_DROP}, {"close", STUB_CLOSE},
+	};
+	const char *eq = strchr(arg, '='), *colon;
+	struct stub_rule *r = &stub.rules[stub.nrules];
+	size_t len;
+	unsigned int i;
+	char *end;
+
+	if (!eq || stub.nrules == STUB_MAX_RULES || (r->proc = stub_proc_index(arg, eq - arg)) < -1)
+		return -1;
+	eq++;
+	colon = strchr(eq, ':');
+	len = colon ? (size_t)(colon - eq) : strlen(eq);
+	r->error = 0;
+	for (i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+		if (strlen(errors[i].name) == len && !strncmp(errors[i].name, eq, len))
+			r->error = errors[i].error;
+	if (!r->error && ((r->error = strtol(eq, &end, 10)) <= 0 || end != eq + len))
+		return -1;
+	r->percent = 100;
+	if (colon && ((r->percent = strtod(colon + 1, &end)) < 0 || *end))
+		return -1;
+	stub.nrules++;
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: nfsstubd [-a ADDR] [-p PORT] [-P] [-x EXPORT] [-l [PROC=]MS] [-j MS]\n"
+			"                [-b KBPS] [-e PROC=ERROR[:PERCENT]] [-s SEED] -m | DIR\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char mem[] = "/dev/shm/nfsstubd.XXXXXX", export[1025];
+	struct pollfd fds[STUB_MAX_LISTEN];
+	struct sigaction sa = {.sa_handler = stub_signal};
+	sigset_t block, orig;
+	struct stat st;
+	unsigned int i, nfds = 0;
+	int opt, port = 0;
+
+	while ((opt = getopt(argc, argv, "a:p:Px:l:j:b:e:s:mh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			stub.addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			stub.portmap = 1;
+			break;
+		case 'x':
+			if (optarg[0] != '/' || strlen(optarg) >= sizeof(export))
+			{
+				usage();
+				return 2;
+			}
+			stub.export = optarg;
+			break;
+		case 'l':
+			if (stub_parse_latency(optarg))
+			{
+				fprintf(stderr, "nfsstubd: bad latency %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'j':
+			stub.jitter_ms = atof(optarg);
+			break;
+		case 'b':
+			stub.kbps = atof(optarg);
+			break;
+		case 'e':
+			if (stub_parse_rule(optarg))
+			{
+				fprintf(stderr, "nfsstubd: bad error rule %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 's':
+			stub.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			stub.memory = 1;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (stub.memory == (optind < argc) || optind + 1 < argc)
+	{
+		usage();
+		return 2;
+	}
+	if (stub.memory && !mkdtemp(mem))
+	{
+		fprintf(stderr, "nfsstubd: %s: %s\n", mem, strerror(errno));
+		return 1;
+	}
+	stub.root = stub.memory ? mem : argv[optind];
+	export_name(stub.export, export);
+	stub.export = export;
+
+	if ((stub.rootfd = open(stub.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fstat(stub.rootfd, &st))
+	{
+		fprintf(stderr, "nfsstubd: %s: %s\n", stub.root, strerror(errno));
+		return 1;
+	}
+	stub.rootino = st.st_ino;
+	stub.fsid = st.st_dev;
+	node_set(stub.rootino, ".");
+	//the modes asked for are the modes given
+	umask(0);
+	{
+		uint64_t boot = (uint64_t)time(NULL) << 32 | getpid();
+
+		for (i = 0; i < sizeof(stub.verf); i++)
+			stub.verf[i] = boot >> (56 - 8 * i);
+	}
+
+	if ((fds[nfds].fd = stub_listen(port)) < 0)
+		goto fail;
+	fds[nfds++].events = POLLIN;
+	if (stub.portmap)
+	{
+		if ((fds[nfds].fd = stub_listen(111)) < 0)
+			goto fail;
+		fds[nfds++].events = POLLIN;
+	}
+
+	//the signals only reach the main thread, in ppoll
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &block, &orig);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("nfsstubd: serving %s as nfs://%s%s?nfsport=%u&mountport=%u\n", stub.root, stub.addr, stub.export,
+		   stub.port, stub.port);
+	fflush(stdout);
+
+	while (!stub.stop)
+	{
+		if (ppoll(fds, nfds, NULL, &orig) < 0)
+		{
+			if (errno != EINTR)
+				break;
+			if (stub.dump)
+			{
+				stub.dump = 0;
+				stub_stats();
+			}
+			continue;
+		}
+		for (i = 0; i < nfds; i++)
+			if (fds[i].revents & POLLIN)
+				stub_accept(fds[i].fd);
+	}
+	stub_stats();
+	if (stub.memory)
+		nftw(mem, stub_rm, 16, FTW_DEPTH | FTW_PHYS);
+	return 0;
+
+fail:
+	if (stub.memory)
+		nftw(mem, stub_rm, 16, FTW_DEPTH | FTW_PHYS);
+	return 1;
+}
@@ -0,0 +1,1284 @@
+/*
+  fusenfs-smb engine: asynchronous libsmb2 requests driven by a dedicated
+  event loop thread
+
+  The smb2_context is not thread-safe, so only the loop thread touches it.
+  FUSE threads queue batches of requests and sleep until every request of
+  the batch has completed. Up to depth requests are outstanding on the
+  session at once; libsmb2 itself holds back PDUs that do not fit into the
+  credits granted by the server. The engine queues and sends a copy of each
+  request that owns its buffers; a waiting thread detaches from its copies
+  once the call is interrupted or their deadline passed and returns at
+  once. A late reply then only lands in the copy, which is freed with it.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <poll.h>
+#endif
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+#include "fusenfs.h"
+#include "smbengine.h"
+
+#define SMB_DEFAULT_IO_SIZE 65536
+//room for the changes of one CHANGE_NOTIFY reply
+#define SMB_NOTIFY_BUFSIZE 16384
+//how often a waiting thread looks for an interrupt or an expired request
+#define SMB_BATCH_TICK_MS 100
+
+//FileId of the related requests in a compound
+static const smb2_file_id compound_file_id = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+/* a batch may span several engines, so it has a lock of its own */
+struct smb_batch
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;
+};
+
+struct smb_engine
+{
+	struct smb2_context *smb2;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int wakefd[2];
+	struct smb_req *queue;
+	struct smb_req **queue_tail;
+	struct smb_req *inflight;
+	unsigned int ninflight;
+	//NOTIFY requests armed on the server, and whether one is to be withdrawn
+	struct smb_req *watches;
+	int unwatch;
+	unsigned int depth;
+	uint32_t max_read;
+	uint32_t max_write;
+	//seconds, the url's timeout= and the one last set on the context
+	int timeout;
+	int timeout_set;
+	int started;
+	int stop;
+	int dead;
+};
+
+static void smb_engine_wake(struct smb_engine *e)
+{
+	char c = 0;
+	if (write(e->wakefd[1], &c, 1) < 0 && errno != EAGAIN)
+		LOG("smb engine wakeup failed: %s\n", strerror(errno));
+}
+
+/* The engine's copy of a request, with room for whatever libsmb2 reads
+ * from or writes into until the reply came. It has no batch, which tells
+ * it from the waiter's.
+ */
+static struct smb_req *smb_req_copy(struct smb_req *req)
+{
+	size_t data = 0, buf = 0, path = 0, path2 = 0;
+	struct smb_req *c;
+	char *p;
+
+	switch (req->op)
+	{
+	case SMB_OP_STAT:
+	case SMB_OP_FSTAT:
+		data = sizeof(struct smb2_stat_64);
+		break;
+	case SMB_OP_STATVFS:
+		data = sizeof(struct smb2_statvfs);
+		break;
+	case SMB_OP_READFILE:
+		data = sizeof(uint64_t);
+		buf = req->count;
+		break;
+	case SMB_OP_READ:
+	case SMB_OP_READLINK:
+	case SMB_OP_WRITE:
+		buf = req->count;
+		break;
+	case SMB_OP_IOCTL:
+		data = req->offset;
+		buf = req->count;
+		break;
+	default:
+		break;
+	}
+	if (req->path)
+		path = strlen(req->path) + 1;
+	if (req->path2)
+		path2 = strlen(req->path2) + 1;
+
+	//the struct keeps data aligned for the stat structs
+	if (!(c = malloc(sizeof(*c) + data + buf + path + path2)))
+		return NULL;
+	*c = *req;
+	p = (char *)(c + 1);
+	if (data)
+	{
+		c->data = p;
+		p += data;
+	}
+	if (buf)
+	{
+		c->buf = (uint8_t *)p;
+		if (req->op == SMB_OP_WRITE || req->op == SMB_OP_IOCTL)
+			memcpy(p, req->buf, buf);
+		p += buf;
+	}
+	if (path)
+	{
+		c->path = memcpy(p, req->path, path);
+		p += path;
+	}
+	if (path2)
+		c->path2 = memcpy(p, req->path2, path2);
+	c->batch = NULL;
+	c->waiter = req;
+	c->sent = NULL;
+	c->next = NULL;
+	c->pprev = NULL;
+	req->sent = c;
+	return c;
+}
+
+/* hand the reply that landed in copy c to its waiter w */
+static void smb_req_return(struct smb_req *c, struct smb_req *w, int status)
+{
+	w->result = c->result;
+	switch (c->op)
+	{
+	case SMB_OP_STAT:
+	case SMB_OP_FSTAT:
+		memcpy(w->data, c->data, sizeof(struct smb2_stat_64));
+		break;
+	case SMB_OP_STATVFS:
+		memcpy(w->data, c->data, sizeof(struct smb2_statvfs));
+		break;
+	case SMB_OP_READFILE:
+		memcpy(w->data, c->data, sizeof(uint64_t));
+		if (status > 0)
+			memcpy(w->buf, c->buf, status);
+		break;
+	case SMB_OP_READ:
+		if (status > 0)
+			memcpy(w->buf, c->buf, status);
+		break;
+	case SMB_OP_READLINK:
+		memcpy(w->buf, c->buf, c->count);
+		break;
+	case SMB_OP_IOCTL:
+		if (status > 0)
+			memcpy(w->data, c->data, status);
+		break;
+	default:
+		break;
+	}
+}
+
+static void smb_drop_cb(struct smb2_context *smb2, int status,
+						void *command_data, void *cb_data)
+{
+}
+
+/* a late reply nobody waits for any more: what it opened is closed again */
+static void smb_req_drop(struct smb_engine *e, struct smb_req *c, int status)
+{
+	if (status < 0 || !c->result)
+		return;
+	if (c->op == SMB_OP_OPEN)
+		smb2_close_async(e->smb2, c->result, smb_drop_cb, NULL);
+	else if (c->op == SMB_OP_OPENDIR)
+		smb2_closedir(e->smb2, c->result);
+}
+
+/* called with e->lock held */
+static void smb_req_complete(struct smb_req *req, int status)
+{
+	struct smb_engine *e = req->engine;
+	struct smb_req *w;
+
+	if (req->pprev)
+	{
+		*req->pprev = req->next;
+		if (req->next)
+			req->next->pprev = req->pprev;
+		req->pprev = NULL;
+		e->ninflight--;
+	}
+	if (!req->batch)
+	{
+		if ((w = req->waiter))
+		{
+			if (status >= 0)
+				smb_req_return(req, w, status);
+			w->sent = NULL;
+			smb_req_complete(w, status);
+		}
+		else
+			smb_req_drop(e, req, status);
+		free(req);
+		return;
+	}
+	req->status = status;
+	pthread_mutex_lock(&req->batch->lock);
+	if (!--req->batch->pending)
+		pthread_cond_broadcast(&req->batch->cond);
+	pthread_mutex_unlock(&req->batch->lock);
+}
+
+static void smb_req_cb(struct smb2_context *smb2, int status,
+					   void *command_data, void *cb_data)
+{
+	struct smb_req *req = cb_data;
+	struct smb_engine *e = req->engine;
+
+	if (status >= 0)
+	{
+		if (req->op == SMB_OP_READLINK)
+		{
+			strncpy((char *)req->buf, command_data, req->count - 1);
+			req->buf[req->count - 1] = '\0';
+		}
+		else
+			req->result = command_data;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	smb_req_complete(req, status);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/* The raw commands of READFILE report NT status codes. The first error
+ * is kept in cstatus, the reply to the CLOSE completes the request.
+ */
+static void smb_readfile_create_cb(struct smb2_context *smb2, int status,
+								   void *command_data, void *cb_data)
+{
+	struct smb_req *req = cb_data;
+	struct smb2_create_reply *rep = command_data;
+
+	if (status != SMB2_STATUS_SUCCESS)
+		req->cstatus = -nterror_to_errno(status);
+	else
+		*(uint64_t *)req->data = rep->end_of_file;
+}
+
+static void smb_readfile_read_cb(struct smb2_context *smb2, int status,
+								 void *command_data, void *cb_data)
+{
+	struct smb_req *req = cb_data;
+	struct smb2_read_reply *rep = command_data;
+
+	if (req->cstatus < 0)
+		return;
+	if (status == SMB2_STATUS_SUCCESS)
+		req->cstatus = rep->data_length;
+	else if ((uint32_t)status != SMB2_STATUS_END_OF_FILE)
+		req->cstatus = -nterror_to_errno(status);
+}
+
+static void smb_readfile_close_cb(struct smb2_context *smb2, int status,
+								  void *command_data, void *cb_data)
+{
+	struct smb_req *req = cb_data;
+	struct smb_engine *e = req->engine;
+
+	pthread_mutex_lock(&e->lock);
+	smb_req_complete(req, req->cstatus);
+	pthread_mutex_unlock(&e->lock);
+}
+
+static int smb_readfile_issue(struct smb2_context *smb2, struct smb_req *req)
+{
+	struct smb2_create_request cr;
+	struct smb2_read_request rr;
+	struct smb2_close_request cl;
+	struct smb2_pdu *pdu, *next_pdu;
+
+	memset(&cr, 0, sizeof(cr));
+	cr.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+	cr.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	cr.desired_access = SMB2_FILE_READ_DATA | SMB2_FILE_READ_ATTRIBUTES;
+	cr.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE;
+	cr.create_disposition = SMB2_FILE_OPEN;
+	cr.create_options = SMB2_FILE_NON_DIRECTORY_FILE;
+	cr.name = req->path;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.length = req->count;
+	rr.offset = 0;
+	rr.buf = req->buf;
+	memcpy(rr.file_id, compound_file_id, SMB2_FD_SIZE);
+
+	memset(&cl, 0, sizeof(cl));
+	memcpy(cl.file_id, compound_file_id, SMB2_FD_SIZE);
+
+	req->cstatus = 0;
+	*(uint64_t *)req->data = 0;
+
+	pdu = smb2_cmd_create_async(smb2, &cr, smb_readfile_create_cb, req);
+	if (!pdu)
+		return -ENOMEM;
+	next_pdu = smb2_cmd_read_async(smb2, &rr, smb_readfile_read_cb, req);
+	if (!next_pdu)
+	{
+		smb2_free_pdu(smb2, pdu);
+		return -ENOMEM;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+	next_pdu = smb2_cmd_close_async(smb2, &cl, smb_readfile_close_cb, req);
+	if (!next_pdu)
+	{
+		smb2_free_pdu(smb2, pdu);
+		return -ENOMEM;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+	smb2_queue_pdu(smb2, pdu);
+	return 0;
+}
+
+/* A watch is a CHANGE_NOTIFY on a directory handle of its own, armed again
+ * after every reply. Withdrawing it closes the handle, the server then ends
+ * the pending request. Its state is changed under e->lock.
+ */
+#define SMB_WATCH_OPEN 1
+#define SMB_WATCH_CLOSING 2
+#define SMB_WATCH_CANCEL 4
+
+/* called with e->lock held */
+static void smb_watch_unlink(struct smb_req *req)
+{
+	if (!req->pprev)
+		return;
+	*req->pprev = req->next;
+	if (req->next)
+		req->next->pprev = req->pprev;
+	req->pprev = NULL;
+}
+
+#ifdef HAVE_SMB2_NOTIFY_CHANGE
+
+static void smb_watch_close_cb(struct smb2_context *smb2, int status,
+							   void *command_data, void *cb_data)
+{
+}
+
+static void smb_watch_close(struct smb_engine *e, struct smb_req *req)
+{
+	struct smb2_close_request cl;
+	struct smb2_pdu *pdu;
+
+	pthread_mutex_lock(&e->lock);
+	if ((req->watch & (SMB_WATCH_OPEN | SMB_WATCH_CLOSING)) != SMB_WATCH_OPEN)
+	{
+		pthread_mutex_unlock(&e->lock);
+		return;
+	}
+	req->watch |= SMB_WATCH_CLOSING;
+	pthread_mutex_unlock(&e->lock);
+
+	memset(&cl, 0, sizeof(cl));
+	memcpy(cl.file_id, req->fid, SMB2_FD_SIZE);
+	//the reply needs nothing of req, which may be gone by then
+	pdu = smb2_cmd_close_async(e->smb2, &cl, smb_watch_close_cb, NULL);
+	if (pdu)
+		smb2_queue_pdu(e->smb2, pdu);
+}
+
+/* the watch is over, its owner hears about it last */
+static void smb_watch_end(struct smb_req *req, int status)
+{
+	struct smb_engine *e = req->engine;
+
+	smb_watch_close(e, req);
+	pthread_mutex_lock(&e->lock);
+	smb_watch_unlink(req);
+	pthread_mutex_unlock(&e->lock);
+	req->notify(req, status, NULL);
+}
+
+static void smb_utf16_to_utf8(const uint8_t *in, uint32_t units, char *out)
+{
+	uint32_t i, c, c2;
+
+	for (i = 0; i < units; i++)
+	{
+		c = in[2 * i] | in[2 * i + 1] << 8;
+		if (c >= 0xd800 && c < 0xdc00 && i + 1 < units)
+		{
+			c2 = in[2 * i + 2] | in[2 * i + 3] << 8;
+			if (c2 >= 0xdc00 && c2 < 0xe000)
+			{
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				i++;
+			}
+		}
+		if (c < 0x80)
+			*out++ = c;
+		else if (c < 0x800)
+		{
+			*out++ = 0xc0 | c >> 6;
+			*out++ = 0x80 | (c & 0x3f);
+		}
+		else if (c < 0x10000)
+		{
+			*out++ = 0xe0 | c >> 12;
+			*out++ = 0x80 | (c >> 6 & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+		else
+		{
+			*out++ = 0xf0 | c >> 18;
+			*out++ = 0x80 | (c >> 12 & 0x3f);
+			*out++ = 0x80 | (c >> 6 & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+	}
+	*out = '\0';
+}
+
+static uint32_t smb_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void smb_changes_free(struct smb_change *list)
+{
+	struct smb_change *c;
+
+	while ((c = list))
+	{
+		list = c->next;
+		free(c);
+	}
+}
+
+/* the FILE_NOTIFY_INFORMATION entries of a reply; NULL, as for an overflow,
+ * when they cannot all be passed on
+ */
+static struct smb_change *smb_changes_decode(const uint8_t *buf, uint32_t len)
+{
+	struct smb_change *list = NULL, **tail = &list, *c;
+	uint32_t off = 0, next, nlen;
+
+	while (off + 12 <= len)
+	{
+		next = smb_le32(buf + off);
+		nlen = smb_le32(buf + off + 8);
+		if (nlen > len - off - 12)
+			break;
+		//a UTF-16 unit takes up to 3 bytes in UTF-8, a surrogate pair 4
+		if (!(c = malloc(sizeof(*c) + nlen / 2 * 3 + 1)))
+		{
+			smb_changes_free(list);
+			return NULL;
+		}
+		c->action = smb_le32(buf + off + 4);
+		c->next = NULL;
+		smb_utf16_to_utf8(buf + off + 12, nlen / 2, c->name);
+		*tail = c;
+		tail = &c->next;
+		if (!next)
+			break;
+		off += next;
+	}
+	return list;
+}
+
+static int smb_watch_arm(struct smb_engine *e, struct smb_req *req, const uint8_t *fid,
+						 struct smb2_pdu *create);
+
+static void smb_watch_notify_cb(struct smb2_context *smb2, int status,
+								void *command_data, void *cb_data)
+{
+	struct smb_req *req = cb_data;
+	struct smb_engine *e = req->engine;
+	struct smb2_change_notify_reply *rep = command_data;
+	struct smb_change *list = NULL;
+	int cancel, res;
+
+	pthread_mutex_lock(&e->lock);
+	cancel = req->watch & SMB_WATCH_CANCEL;
+	pthread_mutex_unlock(&e->lock);
+
+	if (status != SMB2_STATUS_SUCCESS && (uint32_t)status != SMB2_STATUS_NOTIFY_ENUM_DIR)
+	{
+		smb_watch_end(req, cancel ? -ECANCELED : -nterror_to_errno(status));
+		return;
+	}
+	//an empty reply or ENUM_DIR: too many changes, list is NULL
+	if (status == SMB2_STATUS_SUCCESS && rep && rep->output_buffer_length)
+		list = smb_changes_decode(rep->output, rep->output_buffer_length);
+	req->notify(req, 0, list);
+	smb_changes_free(list);
+
+	pthread_mutex_lock(&e->lock);
+	cancel = req->watch & SMB_WATCH_CANCEL;
+	pthread_mutex_unlock(&e->lock);
+	if (cancel)
+		smb_watch_end(req, -ECANCELED);
+	else if ((res = smb_watch_arm(e, req, req->fid, NULL)) < 0)
+		smb_watch_end(req, res);
+}
+
+static void smb_watch_create_cb(struct smb2_context *smb2, int status,
+								void *command_data, void *cb_data)
+{
+	struct smb_req *req = cb_data;
+	struct smb_engine *e = req->engine;
+	struct smb2_create_reply *rep = command_data;
+	int cancel;
+
+	//the notify of the compound fails as well and ends the watch
+	if (status != SMB2_STATUS_SUCCESS)
+		return;
+	memcpy(req->fid, rep->file_id, SMB2_FD_SIZE);
+	pthread_mutex_lock(&e->lock);
+	req->watch |= SMB_WATCH_OPEN;
+	cancel = req->watch & SMB_WATCH_CANCEL;
+	pthread_mutex_unlock(&e->lock);
+	if (cancel)
+		smb_watch_close(e, req);
+}
+
+/* queue the CHANGE_NOTIFY on fid, behind the CREATE of the directory if given */
+static int smb_watch_arm(struct smb_engine *e, struct smb_req *req, const uint8_t *fid,
+						 struct smb2_pdu *create)
+{
+	struct smb2_change_notify_request nr;
+	struct smb2_pdu *pdu;
+
+	memset(&nr, 0, sizeof(nr));
+	nr.output_buffer_length = SMB_NOTIFY_BUFSIZE;
+	nr.completion_filter = req->flags;
+	memcpy(nr.file_id, fid, SMB2_FD_SIZE);
+
+	//a watch waits for good
+	if (e->timeout_set != 0)
+	{
+		smb2_set_timeout(e->smb2, 0);
+		e->timeout_set = 0;
+	}
+	pdu = smb2_cmd_change_notify_async(e->smb2, &nr, smb_watch_notify_cb, req);
+	if (!pdu)
+	{
+		if (create)
+			smb2_free_pdu(e->smb2, create);
+		return -ENOMEM;
+	}
+	if (create)
+	{
+		smb2_add_compound_pdu(e->smb2, create, pdu);
+		pdu = create;
+	}
+	smb2_queue_pdu(e->smb2, pdu);
+	return 0;
+}
+
+static int smb_watch_issue(struct smb_engine *e, struct smb_req *req)
+{
+	struct smb2_create_request cr;
+	struct smb2_pdu *pdu;
+
+	memset(&cr, 0, sizeof(cr));
+	cr.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+	cr.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	cr.desired_access = SMB2_FILE_LIST_DIRECTORY | SMB2_FILE_READ_ATTRIBUTES;
+	cr.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE | SMB2_FILE_SHARE_DELETE;
+	cr.create_disposition = SMB2_FILE_OPEN;
+	cr.create_options = SMB2_FILE_DIRECTORY_FILE;
+	cr.name = req->path;
+
+	pdu = smb2_cmd_create_async(e->smb2, &cr, smb_watch_create_cb, req);
+	if (!pdu)
+		return -ENOMEM;
+	return smb_watch_arm(e, req, compound_file_id, pdu);
+}
+
+/* withdraw the watches asked for since the last round, on the loop thread */
+static void smb_watch_withdraw(struct smb_engine *e)
+{
+	struct smb_req *req, *list[64];
+	int i, n;
+
+	do
+	{
+		n = 0;
+		pthread_mutex_lock(&e->lock);
+		e->unwatch = 0;
+		for (req = e->watches; req; req = req->next)
+		{
+			if ((req->watch & (SMB_WATCH_CANCEL | SMB_WATCH_OPEN | SMB_WATCH_CLOSING)) !=
+				(SMB_WATCH_CANCEL | SMB_WATCH_OPEN))
+				continue;
+			if (n == 64)
+			{
+				e->unwatch = 1;
+				break;
+			}
+			list[n++] = req;
+		}
+		pthread_mutex_unlock(&e->lock);
+		//only the loop thread ends watches, they stay until the replies came
+		for (i = 0; i < n; i++)
+			smb_watch_close(e, list[i]);
+	} while (n == 64);
+}
+#else
+static int smb_watch_issue(struct smb_engine *e, struct smb_req *req)
+{
+	return -ENOTSUP;
+}
+
+static void smb_watch_withdraw(struct smb_engine *e)
+{
+}
+#endif
+
+static void smb_ioctl_cb(struct smb2_context *smb2, int status,
+						 void *command_data, void *cb_data)
+{
+	struct smb_req *req = cb_data;
+	struct smb2_ioctl_reply *rep = command_data;
+	struct smb_engine *e = req->engine;
+
+	if (status != SMB2_STATUS_SUCCESS)
+		status = -nterror_to_errno(status);
+	else
+	{
+		status = rep->output_count < req->offset ? rep->output_count : req->offset;
+		if (rep->output)
+		{
+			if (status)
+				memcpy(req->data, rep->output, status);
+			smb2_free_data(smb2, rep->output);
+		}
+	}
+
+	pthread_mutex_lock(&e->lock);
+	smb_req_complete(req, status);
+	pthread_mutex_unlock(&e->lock);
+}
+
+static int smb_ioctl_issue(struct smb2_context *smb2, struct smb_req *req)
+{
+	struct smb2_ioctl_request io;
+	struct smb2_pdu *pdu;
+
+	memset(&io, 0, sizeof(io));
+	io.ctl_code = req->flags;
+	memcpy(io.file_id, smb2_get_file_id(req->fh), SMB2_FD_SIZE);
+	io.input_count = req->count;
+	io.input = req->buf;
+	io.max_output_response = req->offset;
+	io.flags = SMB2_0_IOCTL_IS_FSCTL;
+
+	pdu = smb2_cmd_ioctl_async(smb2, &io, smb_ioctl_cb, req);
+	if (!pdu)
+		return -ENOMEM;
+	smb2_queue_pdu(smb2, pdu);
+	return 0;
+}
+
+static enum deadline_class smb_req_class(struct smb_req *req)
+{
+	switch (req->op)
+	{
+	case SMB_OP_READ:
+	case SMB_OP_READFILE:
+		return DEADLINE_READ;
+	case SMB_OP_WRITE:
+	case SMB_OP_FSYNC:
+	case SMB_OP_IOCTL:
+		return DEADLINE_WRITE;
+	default:
+		return DEADLINE_META;
+	}
+}
+
+/* libsmb2 stamps the timeout on a command when it is queued, an expired one
+ * completes with an error and its late reply is dropped, like a lost one.
+ * It counts whole seconds: the waiter left at its deadline already, this
+ * only bounds how long the detached copy keeps its slot in the window.
+ */
+static void smb_req_deadline(struct smb_engine *e, struct smb_req *req)
+{
+	int ms = deadline_ms(smb_req_class(req));
+	int secs = ms < 0 ? e->timeout : (ms + 999) / 1000;
+
+	if (secs >= 0 && secs != e->timeout_set)
+	{
+		smb2_set_timeout(e->smb2, secs);
+		e->timeout_set = secs;
+	}
+}
+
+static int smb_req_issue(struct smb2_context *smb2, struct smb_req *req)
+{
+	switch (req->op)
+	{
+	case SMB_OP_STAT:
+		return smb2_stat_async(smb2, req->path, req->data, smb_req_cb, req);
+	case SMB_OP_FSTAT:
+		return smb2_fstat_async(smb2, req->fh, req->data, smb_req_cb, req);
+	case SMB_OP_STATVFS:
+		return smb2_statvfs_async(smb2, req->path, req->data, smb_req_cb, req);
+	case SMB_OP_OPENDIR:
+		return smb2_opendir_async(smb2, req->path, smb_req_cb, req);
+	case SMB_OP_CLOSEDIR:
+		//local, but it touches the context
+		smb2_closedir(smb2, req->data);
+		smb_req_cb(smb2, 0, NULL, req);
+		return 0;
+	case SMB_OP_OPEN:
+		return smb2_open_async(smb2, req->path, req->flags, smb_req_cb, req);
+	case SMB_OP_CLOSE:
+		return smb2_close_async(smb2, req->fh, smb_req_cb, req);
+	case SMB_OP_FSYNC:
+		return smb2_fsync_async(smb2, req->fh, smb_req_cb, req);
+	case SMB_OP_READ:
+		return smb2_pread_async(smb2, req->fh, req->buf, req->count,
+								req->offset, smb_req_cb, req);
+	case SMB_OP_READFILE:
+		return smb_readfile_issue(smb2, req);
+	case SMB_OP_WRITE:
+		return smb2_pwrite_async(smb2, req->fh, req->buf, req->count,
+								 req->offset, smb_req_cb, req);
+	case SMB_OP_MKDIR:
+		return smb2_mkdir_async(smb2, req->path, smb_req_cb, req);
+	case SMB_OP_RMDIR:
+		return smb2_rmdir_async(smb2, req->path, smb_req_cb, req);
+	case SMB_OP_UNLINK:
+		return smb2_unlink_async(smb2, req->path, smb_req_cb, req);
+	case SMB_OP_RENAME:
+		return smb2_rename_async(smb2, req->path, req->path2, smb_req_cb, req);
+	case SMB_OP_TRUNCATE:
+		return smb2_truncate_async(smb2, req->path, req->offset, smb_req_cb, req);
+	case SMB_OP_FTRUNCATE:
+		return smb2_ftruncate_async(smb2, req->fh, req->offset, smb_req_cb, req);
+	case SMB_OP_READLINK:
+		return smb2_readlink_async(smb2, req->path, smb_req_cb, req);
+	case SMB_OP_IOCTL:
+		return smb_ioctl_issue(smb2, req);
+	case SMB_OP_NOTIFY:
+		//see smb_watch_issue()
+		break;
+	}
+	return -EINVAL;
+}
+
+/* move queued requests into the window, called with e->lock held */
+static struct smb_req *smb_engine_take(struct smb_engine *e)
+{
+	struct smb_req *list = NULL, **tail = &list, *req;
+
+	while (e->queue && e->ninflight < e->depth)
+	{
+		req = e->queue;
+		e->queue = req->next;
+		if (!e->queue)
+			e->queue_tail = &e->queue;
+
+		req->next = NULL;
+		*tail = req;
+		tail = &req->next;
+		if (!req->notify)
+			e->ninflight++;
+	}
+	return list;
+}
+
+/* The connection is gone: fail every request, watches armed on the server
+ * included. The context is left alone (and never destroyed) so that
+ * libsmb2 cannot run callbacks on requests whose waiters have already
+ * returned.
+ */
+static void smb_engine_fail(struct smb_engine *e)
+{
+	struct smb_req *req, *watches;
+
+	LOG("smb engine: connection failed: %s\n", smb2_get_error(e->smb2));
+	pthread_mutex_lock(&e->lock);
+	e->dead = 1;
+	while ((req = e->inflight))
+		smb_req_complete(req, -EIO);
+	watches = e->watches;
+	e->watches = NULL;
+	while ((req = e->queue))
+	{
+		e->queue = req->next;
+		if (req->notify)
+		{
+			req->next = watches;
+			watches = req;
+		}
+		else
+			smb_req_complete(req, -EIO);
+	}
+	e->queue_tail = &e->queue;
+	pthread_mutex_unlock(&e->lock);
+
+	while ((req = watches))
+	{
+		watches = req->next;
+		req->pprev = NULL;
+		req->notify(req, -EIO, NULL);
+	}
+}
+
+static void *smb_engine_loop(void *arg)
+{
+	struct smb_engine *e = arg;
+	struct smb_req *list, *req, *next;
+	struct pollfd pfd[2];
+	char tmp[64];
+	int ret, unwatch;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&e->lock);
+		if (e->stop || e->dead)
+		{
+			pthread_mutex_unlock(&e->lock);
+			break;
+		}
+		list = smb_engine_take(e);
+		unwatch = e->unwatch;
+		pthread_mutex_unlock(&e->lock);
+
+		if (unwatch)
+			smb_watch_withdraw(e);
+
+		for (req = list; req; req = next)
+		{
+			next = req->next;
+			if (req->notify)
+			{
+				//armed for good, it is in no window
+				pthread_mutex_lock(&e->lock);
+				req->next = e->watches;
+				if (e->watches)
+					e->watches->pprev = &req->next;
+				req->pprev = &e->watches;
+				e->watches = req;
+				pthread_mutex_unlock(&e->lock);
+
+				ret = smb_watch_issue(e, req);
+				if (ret < 0)
+				{
+					pthread_mutex_lock(&e->lock);
+					smb_watch_unlink(req);
+					pthread_mutex_unlock(&e->lock);
+					req->notify(req, ret, NULL);
+				}
+				continue;
+			}
+
+			pthread_mutex_lock(&e->lock);
+			req->next = e->inflight;
+			if (e->inflight)
+				e->inflight->pprev = &req->next;
+			req->pprev = &e->inflight;
+			e->inflight = req;
+			pthread_mutex_unlock(&e->lock);
+
+			smb_req_deadline(e, req);
+			ret = smb_req_issue(e->smb2, req);
+			if (ret < 0)
+			{
+				pthread_mutex_lock(&e->lock);
+				smb_req_complete(req, ret);
+				pthread_mutex_unlock(&e->lock);
+			}
+		}
+
+		pfd[0].fd = smb2_get_fd(e->smb2);
+		pfd[0].events = smb2_which_events(e->smb2);
+		pfd[0].revents = 0;
+		pfd[1].fd = e->wakefd[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		ret = poll(pfd, 2, 1000);
+		if (ret < 0 && errno != EINTR)
+		{
+			smb_engine_fail(e);
+			break;
+		}
+		if (pfd[1].revents & POLLIN)
+			while (read(e->wakefd[0], tmp, sizeof(tmp)) > 0)
+				;
+
+		//revents 0 still lets libsmb2 expire timed out commands
+		if (smb2_service(e->smb2, ret < 0 ? 0 : pfd[0].revents) < 0)
+		{
+			smb_engine_fail(e);
+			break;
+		}
+	}
+	return NULL;
+}
+
+struct smb_engine *smb_engine_new(struct smb2_context *smb2, unsigned int depth)
+{
+	struct smb_engine *e = calloc(1, sizeof(struct smb_engine));
+	if (!e)
+		return NULL;
+
+	e->smb2 = smb2;
+	e->depth = depth ? depth : 1;
+	e->queue_tail = &e->queue;
+	e->timeout = e->timeout_set = -1;
+	e->wakefd[0] = e->wakefd[1] = -1;
+	pthread_mutex_init(&e->lock, NULL);
+
+	e->max_read = smb2_get_max_read_size(smb2);
+	if (!e->max_read)
+		e->max_read = SMB_DEFAULT_IO_SIZE;
+	e->max_write = smb2_get_max_write_size(smb2);
+	if (!e->max_write)
+		e->max_write = SMB_DEFAULT_IO_SIZE;
+	return e;
+}
+
+/* the timeout in seconds the context got from its url, put back on the
+ * commands without a deadline of their own
+ */
+void smb_engine_set_timeout(struct smb_engine *e, int secs)
+{
+	e->timeout = e->timeout_set = secs;
+}
+
+/* must run after fuse has daemonized, i.e. from the init operation */
+int smb_engine_start(struct smb_engine *e)
+{
+	if (e->started)
+		return 0;
+	if (pipe(e->wakefd) < 0)
+		return -errno;
+	fcntl(e->wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(e->wakefd[1], F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&e->thread, NULL, smb_engine_loop, e))
+	{
+		close(e->wakefd[0]);
+		close(e->wakefd[1]);
+		e->wakefd[0] = e->wakefd[1] = -1;
+		return -EAGAIN;
+	}
+	e->started = 1;
+	return 0;
+}
+
+/* Put a dead engine back to work on a new connection. Callers still
+ * holding the engine queue on the new context; the old one is left alone
+ * as smb_engine_fail() left it. The caller makes sure no handle of the old
+ * context is still in use.
+ */
+int smb_engine_revive(struct smb_engine *e, struct smb2_context *smb2)
+{
+	if (!smb_engine_dead(e) || !e->started)
+		return -EBUSY;
+	//the loop ends once it sees the engine dead
+	pthread_join(e->thread, NULL);
+
+	pthread_mutex_lock(&e->lock);
+	e->smb2 = smb2;
+	e->unwatch = 0;
+	e->timeout_set = e->timeout;
+	e->max_read = smb2_get_max_read_size(smb2);
+	if (!e->max_read)
+		e->max_read = SMB_DEFAULT_IO_SIZE;
+	e->max_write = smb2_get_max_write_size(smb2);
+	if (!e->max_write)
+		e->max_write = SMB_DEFAULT_IO_SIZE;
+	e->dead = 0;
+	pthread_mutex_unlock(&e->lock);
+
+	if (pthread_create(&e->thread, NULL, smb_engine_loop, e))
+	{
+		//fails what was queued meanwhile, there is no loop left to join
+		pthread_mutex_lock(&e->lock);
+		e->started = 0;
+		pthread_mutex_unlock(&e->lock);
+		smb_engine_fail(e);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+/* End the loop thread, the context is the caller's again. Late replies to
+ * requests whose waiters left may still come while it is disconnected and
+ * destroyed, so the engine is freed only after that.
+ */
+void smb_engine_stop(struct smb_engine *e)
+{
+	if (!e || !e->started)
+		return;
+	pthread_mutex_lock(&e->lock);
+	e->stop = 1;
+	pthread_mutex_unlock(&e->lock);
+	smb_engine_wake(e);
+	pthread_join(e->thread, NULL);
+	e->started = 0;
+}
+
+void smb_engine_free(struct smb_engine *e)
+{
+	struct smb_req *req;
+
+	if (!e)
+		return;
+	smb_engine_stop(e);
+	//copies nobody waits for, their replies will not come any more
+	while ((req = e->inflight))
+		smb_req_complete(req, -ECANCELED);
+	while ((req = e->queue))
+	{
+		e->queue = req->next;
+		if (!req->notify)
+			smb_req_complete(req, -ECANCELED);
+	}
+	if (e->wakefd[0] >= 0)
+	{
+		close(e->wakefd[0]);
+		close(e->wakefd[1]);
+	}
+	pthread_mutex_destroy(&e->lock);
+	free(e);
+}
+
+static uint64_t smb_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Give up on the requests of a batch, all of them once the call was
+ * interrupted, else those past their deadline. A copy still queued is
+ * taken off the queue; a sent one is detached and stays with the engine
+ * until its reply comes or libsmb2 expires it.
+ */
+static void smb_batch_withdraw(struct smb_req *reqs, int n, int intr)
+{
+	uint64_t now = smb_now_ms();
+	struct smb_req **pp, *c;
+	struct smb_engine *e;
+	int i, err = intr ? -EINTR : -ETIMEDOUT;
+
+	for (i = 0; i < n; i++)
+	{
+		if (!intr && (!reqs[i].expires || reqs[i].expires > now))
+			continue;
+		e = reqs[i].engine;
+		pthread_mutex_lock(&e->lock);
+		if ((c = reqs[i].sent))
+		{
+			for (pp = &e->queue; *pp && *pp != c; pp = &(*pp)->next)
+				;
+			if (*pp)
+			{
+				*pp = c->next;
+				if (e->queue_tail == &c->next)
+					e->queue_tail = pp;
+				smb_req_complete(c, err);
+			}
+			else
+			{
+				c->waiter = NULL;
+				reqs[i].sent = NULL;
+				smb_req_complete(&reqs[i], err);
+			}
+		}
+		pthread_mutex_unlock(&e->lock);
+	}
+}
+
+/* how long a batch sleeps before it looks again: a tick, less when the
+ * deadline of a request comes earlier
+ */
+static long smb_batch_wait_ms(struct smb_req *reqs, int n)
+{
+	uint64_t now = smb_now_ms();
+	long ms = SMB_BATCH_TICK_MS;
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (reqs[i].expires > now && reqs[i].expires - now < (uint64_t)ms)
+			ms = reqs[i].expires - now;
+	return ms;
+}
+
+/* Queue n requests, each on the engine set in req->engine, and wait until
+ * all of them completed. Requests for a dead engine fail with -EIO, those
+ * not done when the call is interrupted (-o intr) or their deadline passed
+ * fail with -EINTR or -ETIMEDOUT right then, whether sent or not.
+ */
+int smb_batch_run(struct smb_req *reqs, int n)
+{
+	struct smb_batch batch;
+	struct smb_engine *e;
+	struct smb_req *c;
+	pthread_condattr_t attr;
+	struct timespec ts;
+	uint64_t now;
+	long wait;
+	int i, ms;
+
+	if (n <= 0)
+		return 0;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&batch.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	batch.pending = n;
+	now = smb_now_ms();
+	for (i = 0; i < n; i++)
+	{
+		ms = deadline_ms(smb_req_class(&reqs[i]));
+		reqs[i].expires = ms > 0 ? now + ms : 0;
+		reqs[i].batch = &batch;
+		reqs[i].status = 0;
+		reqs[i].next = NULL;
+		reqs[i].pprev = NULL;
+		reqs[i].sent = NULL;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		e = reqs[i].engine;
+		c = smb_req_copy(&reqs[i]);
+		pthread_mutex_lock(&e->lock);
+		if (!c)
+			smb_req_complete(&reqs[i], -ENOMEM);
+		else if (!e->started || e->dead || e->stop)
+			smb_req_complete(c, -EIO);
+		else
+		{
+			*e->queue_tail = c;
+			e->queue_tail = &c->next;
+		}
+		pthread_mutex_unlock(&e->lock);
+		if (i == n - 1 || reqs[i + 1].engine != e)
+			smb_engine_wake(e);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending)
+	{
+		wait = smb_batch_wait_ms(reqs, n);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += wait * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+			ts.tv_sec++, ts.tv_nsec -= 1000000000L;
+		if (pthread_cond_timedwait(&batch.cond, &batch.lock, &ts) != ETIMEDOUT || !batch.pending)
+			continue;
+		//e->lock is taken before batch.lock
+		pthread_mutex_unlock(&batch.lock);
+		smb_batch_withdraw(reqs, n, fuse_interrupted());
+		pthread_mutex_lock(&batch.lock);
+	}
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+	return 0;
+}
+
+/* queue n requests on one engine and wait until all of them completed */
+int smb_engine_run(struct smb_engine *e, struct smb_req *reqs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		reqs[i].engine = e;
+	return smb_batch_run(reqs, n);
+}
+
+/* arm a NOTIFY request, req->notify must be set */
+int smb_engine_watch(struct smb_engine *e, struct smb_req *req)
+{
+	pthread_mutex_lock(&e->lock);
+	if (!e->started || e->dead || e->stop)
+	{
+		pthread_mutex_unlock(&e->lock);
+		return -EIO;
+	}
+	req->engine = e;
+	req->batch = NULL;
+	req->next = NULL;
+	req->pprev = NULL;
+	req->watch = 0;
+	*e->queue_tail = req;
+	e->queue_tail = &req->next;
+	pthread_mutex_unlock(&e->lock);
+	smb_engine_wake(e);
+	return 0;
+}
+
+/* Withdraw a watch: its handle is closed and notify runs a last time, with
+ * -ECANCELED, once the server ended the request. Until then it is in use.
+ */
+void smb_engine_unwatch(struct smb_engine *e, struct smb_req *req)
+{
+	pthread_mutex_lock(&e->lock);
+	if (e->dead || (req->watch & SMB_WATCH_CANCEL))
+	{
+		pthread_mutex_unlock(&e->lock);
+		return;
+	}
+	req->watch |= SMB_WATCH_CANCEL;
+	e->unwatch = 1;
+	pthread_mutex_unlock(&e->lock);
+	smb_engine_wake(e);
+}
+
+int smb_engine_dead(struct smb_engine *e)
+{
+	int res;
+
+	pthread_mutex_lock(&e->lock);
+	res = e->dead;
+	pthread_mutex_unlock(&e->lock);
+	return res;
+}
+
+uint32_t smb_engine_max_read(struct smb_engine *e)
+{
+	return e->max_read;
+}
+
+uint32_t smb_engine_max_write(struct smb_engine *e)
+{
+	return e->max_write;
+}
@@ -0,0 +1,116 @@
+/*
+  fusenfs-smb engine: asynchronous libsmb2 requests driven by a dedicated
+  event loop thread
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#ifndef SMBENGINE_H_
+#define SMBENGINE_H_
+
+#include <stdint.h>
+
+struct smb2_context;
+struct smb2fh;
+struct smb_engine;
+struct smb_batch;
+
+enum smb_op
+{
+	SMB_OP_STAT,
+	SMB_OP_FSTAT,
+	SMB_OP_STATVFS,
+	SMB_OP_OPENDIR,
+	SMB_OP_CLOSEDIR,
+	SMB_OP_OPEN,
+	SMB_OP_CLOSE,
+	SMB_OP_FSYNC,
+	SMB_OP_READ,
+	SMB_OP_READFILE,
+	SMB_OP_WRITE,
+	SMB_OP_MKDIR,
+	SMB_OP_RMDIR,
+	SMB_OP_UNLINK,
+	SMB_OP_RENAME,
+	SMB_OP_TRUNCATE,
+	SMB_OP_FTRUNCATE,
+	SMB_OP_READLINK,
+	SMB_OP_IOCTL,
+	SMB_OP_NOTIFY,
+};
+
+/* One libsmb2 command. The caller fills in the arguments the op needs,
+ * status receives the callback status (-errno or a byte count) and
+ * result the command data of OPENDIR/OPEN.
+ * READFILE opens path, reads up to count bytes from its start and closes
+ * it again in one compound, data receives the file size (uint64_t).
+ * IOCTL sends FSCTL flags on fh with count bytes of buf as input, up to
+ * offset bytes of the output are copied to data and status is their size.
+ * The engine sends a copy of the request that owns the buffers and paths,
+ * so a waiter interrupted or past its deadline returns at once and the
+ * late reply only lands in the copy.
+ * NOTIFY is not part of a batch: it stays armed on the server and notify
+ * runs on the loop thread for every reply, flags is the completion filter.
+ * command_data is then a list of struct smb_change, NULL when the server
+ * only says that something changed; a status < 0 ends the watch.
+ */
+struct smb_req
+{
+	enum smb_op op;
+	const char *path;
+	const char *path2;
+	int flags;
+	struct smb2fh *fh;
+	uint8_t *buf;
+	uint32_t count;
+	uint64_t offset;
+	void *data;
+	void *result;
+	int status;
+	void (*notify)(struct smb_req *req, int status, void *command_data);
+
+	struct smb_engine *engine;
+	struct smb_batch *batch;
+	int cstatus;
+	//CLOCK_MONOTONIC ms after which its waiter gives up on it
+	uint64_t expires;
+	//the engine's copy while queued or sent, and of a copy its waiter
+	struct smb_req *sent;
+	struct smb_req *waiter;
+	//NOTIFY: handle of the watched directory and the state of the watch
+	uint8_t fid[16];
+	int watch;
+	struct smb_req *next;
+	struct smb_req **pprev;
+};
+
+/* one entry of a CHANGE_NOTIFY reply, action is the MS-FSCC one */
+struct smb_change
+{
+	uint32_t action;
+	struct smb_change *next;
+	char name[];
+};
+
+struct smb_engine *smb_engine_new(struct smb2_context *smb2, unsigned int depth);
+void smb_engine_set_timeout(struct smb_engine *e, int secs);
+int smb_engine_start(struct smb_engine *e);
+int smb_engine_revive(struct smb_engine *e, struct smb2_context *smb2);
+void smb_engine_stop(struct smb_engine *e);
+void smb_engine_free(struct smb_engine *e);
+int smb_engine_run(struct smb_engine *e, struct smb_req *reqs, int n);
+int smb_batch_run(struct smb_req *reqs, int n);
+int smb_engine_watch(struct smb_engine *e, struct smb_req *req);
+void smb_engine_unwatch(struct smb_engine *e, struct smb_req *req);
+int smb_engine_dead(struct smb_engine *e);
+uint32_t smb_engine_max_read(struct smb_engine *e);
+uint32_t smb_engine_max_write(struct smb_engine *e);
+
+static inline int smb_engine_call(struct smb_engine *e, struct smb_req *req)
+{
+	int res = smb_engine_run(e, req, 1);
+	return res < 0 ? res : req->status;
+}
+
+#endif
@@ -0,0 +1,295 @@
+/*
+  fusenfs-bind engine: file system calls of the bind backend submitted
+  through one shared io_uring
+
+  FUSE threads queue their call and sleep, a single completion thread
+  reaps the ring and wakes them. The calls queued while one thread is in
+  io_uring_enter() go to the kernel together in its next one, so under
+  load many calls share a submission. Threads blocked on the backing file
+  system no longer each hold a system call open, and the fds of open files
+  are registered with the ring so reads, writes and fsyncs skip the
+  per-call fd lookup.
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _GNU_SOURCE
+
+#include <fuse_merge.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fusenfs.h"
+#include "uringengine.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+struct uring_engine
+{
+	struct io_uring ring;
+	pthread_t thread;
+	//guards the queue and done/cond of the requests in flight
+	pthread_mutex_t lock;
+	//calls not yet on the submission queue, oldest first
+	struct uring_req *head, **tail;
+	//a caller owns the submission queue and drains the calls to it
+	int submitting;
+	//fds registered at the slot of the same number
+	char *fixed;
+	unsigned int nfiles;
+};
+
+static void *uring_engine_loop(void *data)
+{
+	struct uring_engine *e = data;
+	struct io_uring_cqe *cqe;
+	struct uring_req *req;
+
+	unsigned int head, n;
+	int stop = 0;
+
+	while (!stop)
+	{
+		int res = io_uring_wait_cqe(&e->ring, &cqe);
+		if (res == -EINTR)
+			continue;
+		if (res < 0)
+		{
+			LOG("uring engine wait failed: %s\n", strerror(-res));
+			break;
+		}
+
+		//everything completed so far is handed back under one lock
+		n = 0;
+		pthread_mutex_lock(&e->lock);
+		io_uring_for_each_cqe(&e->ring, head, cqe)
+		{
+			n++;
+			req = io_uring_cqe_get_data(cqe);
+			//the NOP queued by uring_engine_free
+			if (!req)
+			{
+				stop = 1;
+				continue;
+			}
+			req->status = cqe->res;
+			req->done = 1;
+			pthread_cond_signal(&req->cond);
+		}
+		pthread_mutex_unlock(&e->lock);
+		io_uring_cq_advance(&e->ring, n);
+	}
+	return NULL;
+}
+
+struct uring_engine *uring_engine_new(unsigned int depth, unsigned int nfiles)
+{
+	struct uring_engine *e = calloc(1, sizeof(struct uring_engine));
+	int *fds;
+	unsigned int i;
+	int res;
+
+	if (!e)
+		return NULL;
+	if ((res = io_uring_queue_init(depth, &e->ring, 0)) < 0)
+	{
+		free(e);
+		errno = -res;
+		return NULL;
+	}
+	pthread_mutex_init(&e->lock, NULL);
+	e->tail = &e->head;
+
+	//a sparse table, fds are filled in as files are opened
+	fds = malloc(nfiles * sizeof(int));
+	e->fixed = calloc(nfiles, 1);
+	if (fds && e->fixed)
+	{
+		for (i = 0; i < nfiles; i++)
+			fds[i] = -1;
+		if (!io_uring_register_files(&e->ring, fds, nfiles))
+			e->nfiles = nfiles;
+		else
+			LOG("uring engine: registered files unavailable\n");
+	}
+	free(fds);
+
+	if ((res = pthread_create(&e->thread, NULL, uring_engine_loop, e)))
+	{
+		io_uring_queue_exit(&e->ring);
+		free(e->fixed);
+		free(e);
+		errno = res;
+		return NULL;
+	}
+	return e;
+}
+
+void uring_engine_free(struct uring_engine *e)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!e)
+		return;
+	//no call is in flight any more, the submission queue is free
+	while (!(sqe = io_uring_get_sqe(&e->ring)))
+		io_uring_submit(&e->ring);
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, NULL);
+	io_uring_submit(&e->ring);
+	pthread_join(e->thread, NULL);
+
+	io_uring_queue_exit(&e->ring);
+	pthread_mutex_destroy(&e->lock);
+	free(e->fixed);
+	free(e);
+}
+
+static void uring_req_prep(struct uring_engine *e, struct io_uring_sqe *sqe,
+						   struct uring_req *req)
+{
+	switch (req->op)
+	{
+	case URING_OP_READ:
+		io_uring_prep_read(sqe, req->fd, req->buf, req->count, req->offset);
+		break;
+	case URING_OP_WRITE:
+		io_uring_prep_write(sqe, req->fd, req->buf, req->count, req->offset);
+		break;
+	case URING_OP_FSYNC:
+		io_uring_prep_fsync(sqe, req->fd, 0);
+		break;
+	case URING_OP_FDATASYNC:
+		io_uring_prep_fsync(sqe, req->fd, IORING_FSYNC_DATASYNC);
+		break;
+	case URING_OP_STATX:
+		io_uring_prep_statx(sqe, req->dirfd, req->path, req->flags,
+							STATX_BASIC_STATS, req->stx);
+		return;
+	case URING_OP_OPENAT:
+		io_uring_prep_openat(sqe, req->dirfd, req->path, req->flags, req->mode);
+		return;
+	}
+	if (req->fd >= 0 && (unsigned int)req->fd < e->nfiles && e->fixed[req->fd])
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+}
+
+/* Called with e->lock held by the caller that owns the submission queue:
+ * moves the queued calls onto it and submits them with one enter, again
+ * for what was queued meanwhile, until the queue stays empty. A call the
+ * kernel does not take completes right away with the error.
+ */
+static void uring_engine_drain(struct uring_engine *e)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_req *req, *batch;
+	int res;
+
+	while ((batch = e->head))
+	{
+		e->head = NULL;
+		e->tail = &e->head;
+		pthread_mutex_unlock(&e->lock);
+
+		for (req = batch; req; req = req->next)
+		{
+			//a full queue is flushed to the kernel to make room
+			while (!(sqe = io_uring_get_sqe(&e->ring)))
+				if ((res = io_uring_submit(&e->ring)) < 0)
+					break;
+			if (!sqe)
+				break;
+			uring_req_prep(e, sqe, req);
+			io_uring_sqe_set_data(sqe, req);
+		}
+		res = io_uring_submit(&e->ring);
+
+		pthread_mutex_lock(&e->lock);
+		if (res < 0 || req)
+		{
+			//the ring is broken, the calls without an sqe fail now
+			for (; req; req = req->next)
+			{
+				req->status = res < 0 ? res : -EAGAIN;
+				req->done = 1;
+				pthread_cond_signal(&req->cond);
+			}
+		}
+	}
+}
+
+int uring_engine_call(struct uring_engine *e, struct uring_req *req)
+{
+	req->done = 0;
+	req->next = NULL;
+	pthread_cond_init(&req->cond, NULL);
+
+	pthread_mutex_lock(&e->lock);
+	*e->tail = req;
+	e->tail = &req->next;
+	if (!e->submitting)
+	{
+		e->submitting = 1;
+		uring_engine_drain(e);
+		e->submitting = 0;
+	}
+	while (!req->done)
+		pthread_cond_wait(&req->cond, &e->lock);
+	pthread_mutex_unlock(&e->lock);
+
+	pthread_cond_destroy(&req->cond);
+	return req->status;
+}
+
+void uring_engine_register_fd(struct uring_engine *e, int fd)
+{
+	if (fd < 0 || (unsigned int)fd >= e->nfiles)
+		return;
+	if (io_uring_register_files_update(&e->ring, fd, &fd, 1) == 1)
+		e->fixed[fd] = 1;
+}
+
+void uring_engine_unregister_fd(struct uring_engine *e, int fd)
+{
+	int none = -1;
+
+	if (fd < 0 || (unsigned int)fd >= e->nfiles || !e->fixed[fd])
+		return;
+	e->fixed[fd] = 0;
+	io_uring_register_files_update(&e->ring, fd, &none, 1);
+}
+#else
+struct uring_engine *uring_engine_new(unsigned int depth, unsigned int nfiles)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uring_engine_free(struct uring_engine *e) {}
+
+int uring_engine_call(struct uring_engine *e, struct uring_req *req)
+{
+	return -ENOSYS;
+}
+
+void uring_engine_register_fd(struct uring_engine *e, int fd) {}
+void uring_engine_unregister_fd(struct uring_engine *e, int fd) {}
+#endif
@@ -0,0 +1,59 @@
+/*
+  fusenfs-bind engine: file system calls of the bind backend submitted
+  through one shared io_uring
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef URINGENGINE_H_
+#define URINGENGINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+struct statx;
+struct uring_engine;
+
+enum uring_op
+{
+	URING_OP_READ,
+	URING_OP_WRITE,
+	URING_OP_FSYNC,
+	URING_OP_FDATASYNC,
+	URING_OP_STATX,
+	URING_OP_OPENAT,
+};
+
+/* One system call. The caller fills in the arguments the op needs, status
+ * receives what the call would have returned: a byte count, the new fd of
+ * OPENAT, 0, or -errno. STATX and OPENAT resolve path relative to dirfd
+ * (AT_FDCWD or a directory fd), flags are the statx/open flags.
+ */
+struct uring_req
+{
+	enum uring_op op;
+	int fd;
+	int dirfd;
+	const char *path;
+	int flags;
+	mode_t mode;
+	void *buf;
+	size_t count;
+	off_t offset;
+	struct statx *stx;
+	int status;
+
+	pthread_cond_t cond;
+	int done;
+	struct uring_req *next;
+};
+
+struct uring_engine *uring_engine_new(unsigned int depth, unsigned int nfiles);
+void uring_engine_free(struct uring_engine *e);
+int uring_engine_call(struct uring_engine *e, struct uring_req *req);
+void uring_engine_register_fd(struct uring_engine *e, int fd);
+void uring_engine_unregister_fd(struct uring_engine *e, int fd);
+
+#endif